@@ -30,7 +30,6 @@ void Film::save(const std::filesystem::path &fileName) const
         pixelBuffer[index + 0] = static_cast<uint8_t>(rgb.mR);
         pixelBuffer[index + 1] = static_cast<uint8_t>(rgb.mG);
         pixelBuffer[index + 2] = static_cast<uint8_t>(rgb.mB); }, false);
-    threadPool.wait();
 
     // 将像素数据以二进制写入文件
     file.write(reinterpret_cast<const char *>(pixelBuffer.data()), pixelBuffer.size());
@@ -1,6 +1,7 @@
 #include "previewer.hpp"
 #include "../core/renderer/normalRenderer.hpp"
 #include "../core/renderer/debugRenderer.hpp"
+#include "../core/renderer/WavefrontPTRenderer.hpp"
 #include "threadPool.hpp"
 #include <iostream>
 
@@ -11,6 +12,7 @@ Previewer::Previewer(Renderer &renderer, float fps) : mRenderer(renderer), mFPS(
     mFilmResolution = {film.getWidth(), film.getHeight()};
     // 将渲染器添加到渲染模式中，按tab键切换
     mRenderModes.push_back(&mRenderer);
+    mRenderModes.push_back(new WavefrontPTRenderer(mRenderer.mCamera, mRenderer.mScene)); // 与主渲染器对比速度和结果
     mRenderModes.push_back(new NormalRenderer(mRenderer.mCamera, mRenderer.mScene));
     DEBUG_LINE(mRenderModes.push_back(new BoundsTestCountRenderer(mRenderer.mCamera, mRenderer.mScene)));
     DEBUG_LINE(mRenderModes.push_back(new TrianglesTestCountRenderer(mRenderer.mCamera, mRenderer.mScene)));
@@ -165,21 +167,18 @@ Previewer::~Previewer()
 void Previewer::rendererFrame()
 {
     auto *renderer = mRenderModes[mRenderModeIndex];
-    size_t renderSPP = mRenderModeIndex == 0 ? 4 : 1; // 只有路径追踪模式需要多采样
+    size_t renderSPP = mRenderModeIndex <= 1 ? 4 : 1; // 只有主渲染器和波前路径追踪模式需要多采样
     auto &film = mRenderer.mCamera.getFilm();
     if (mCurrentSPP == 0) // 第一次渲染
     {
         film.clear(); // 清空
     }
-    threadPool.parallelFor(film.getWidth(), film.getHeight(), [&](size_t x, size_t y)
+    threadPool.parallelFor(renderer->tileCount(film.getWidth()), renderer->tileCount(film.getHeight()), [&](size_t x, size_t y)
                            {
-                               for (size_t i = mCurrentSPP; i < mCurrentSPP + renderSPP; i++)
-                               {
-                                   film.addSample(x, y, renderer->renderPixel({x, y, i}));
-                               }
+                               renderer->renderTileSamples(x, y, mCurrentSPP, renderSPP);
                                // end
-                           });
-    threadPool.wait();
+                           },
+                           true, renderer->mTileOrder);
     mCurrentSPP += renderSPP;
 }
 
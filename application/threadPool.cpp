@@ -1,53 +1,91 @@
 #include "threadPool.hpp"
 #include <cmath>
+#include <algorithm>
 
 ThreadPool threadPool{};
-// 线程池中的工作线程函数，每个工作线程都会执行该函数。该函数会不断地从任务队列中取出任务并执行，直到线程池被销毁。
-void ThreadPool::workerThread(ThreadPool *master)
+
+// 当前线程所属的线程池和它在池中的编号, 不在任何线程池中的线程为空
+static thread_local ThreadPool *current_pool = nullptr;
+static thread_local size_t current_worker = 0;
+static thread_local uint32_t steal_random_state = 0x9e3779b9u; // 选择窃取对象的xorshift随机数状态, 不能为0
+
+// 没有取到任务时先让出时间片重试这么多次再休眠, 任务接连提交时不必反复休眠和唤醒
+static constexpr int idle_yield_count = 64;
+
+static uint32_t nextStealRandom()
 {
+	uint32_t x = steal_random_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return steal_random_state = x;
+}
+
+// 线程池中的工作线程函数，每个工作线程都会执行该函数。该函数会不断地获取任务并执行，直到线程池被销毁。
+void ThreadPool::workerThread(ThreadPool *master, size_t index)
+{
+	current_pool = master;
+	current_worker = index;
+	steal_random_state = static_cast<uint32_t>(index + 1) * 0x9e3779b9u; // 每个线程的窃取顺序不同
+	int idleCount = 0;
 	while (master->mAlive == 1) // 检查线程池是否处于活动状态
 	{
-		if (master->mTasks.empty()) // 如果任务队列为空，线程会休眠2ms，避免空转CPU
-		{
-			std::this_thread::sleep_for(std::chrono::milliseconds(2));
-			continue;
-		}
-
-		// 从任务队列中取出一个任务并执行
 		Task *task = master->getTask();
 		if (task != nullptr)
 		{
+			// 最后一个寻找任务的线程找到了任务, 队列里可能还有任务, 唤醒一个休眠的线程接替寻找
+			if (idleCount > 0 && --master->mSpinningCount == 0)
+			{
+				master->wakeUp(false);
+			}
+			idleCount = 0;
 			task->run();
-			delete task;
-			master->mPendingTaskCount--;
+			master->finishTask(task);
 		}
-		else
+		else if (++idleCount < idle_yield_count)
 		{
-			// 获取到空任务就把它的操作权交给os，线程会让出 CPU 时间片，让其他线程有机会执行。
+			if (idleCount == 1)
+			{
+				master->mSpinningCount++;
+			}
+			// 剩下的任务正在其它线程上执行或者窃取时竞争失败，让出 CPU 时间片后再尝试
 			std::this_thread::yield();
 		}
+		else
+		{
+			// 一直取不到任务就休眠, 提交任务时立即唤醒, 不再每2ms轮询一次
+			master->mSpinningCount--;
+			master->sleep();
+			idleCount = 0;
+		}
 	}
 }
 
 // 创建指定数量的工作线程，threadCount=0时默认使用硬件并发数量
 ThreadPool::ThreadPool(size_t threadCount)
 {
-	mAlive = 1;			   // 线程池处于活动状态
+	mAlive = 1;            // 线程池处于活动状态
 	mPendingTaskCount = 0; // 初始化待处理任务的数量为0
 	if (threadCount == 0)
 	{
 		threadCount = std::thread::hardware_concurrency(); // 获取硬件并发数量
 	}
+	// 所有队列在线程启动前创建好, 窃取时不需要加锁访问队列数组
 	for (size_t i = 0; i < threadCount; i++)
 	{
-		mThreads.push_back(std::thread(ThreadPool::workerThread, this)); // 创建工作线程并将其加入线程池
+		mWorkerTasks.push_back(std::make_unique<WorkStealingQueue<Task *>>());
+	}
+	for (size_t i = 0; i < threadCount; i++)
+	{
+		mThreads.push_back(std::thread(ThreadPool::workerThread, this, i)); // 创建工作线程并将其加入线程池
 	}
 }
 
 ThreadPool::~ThreadPool()
 {
-	wait();		// 阻塞当前线程，直到所有任务完成
+	wait();     // 阻塞当前线程，直到所有任务完成
 	mAlive = 0; // 线程池不再处于活动状态
+	wakeUp(true);
 	for (auto &thread : mThreads)
 	{
 		thread.join(); // 等待工作线程完成
@@ -55,87 +93,151 @@ ThreadPool::~ThreadPool()
 	mThreads.clear(); // 清空线程池
 }
 
-class ParallelForTask : public Task
+void ThreadPool::chunkSize(size_t width, size_t height, bool isComplex, size_t &chunckWidth, size_t &chunckHeight) const
 {
-public:
-	ParallelForTask(size_t x, size_t y, size_t chunckWidth, size_t chunckHeight, std::function<void(size_t, size_t)> lambda)
-		: x(x), y(y), chunckWidth(chunckWidth), chunckHeight(chunckHeight), lambda(lambda) {}
-	// 实现任务的具体逻辑，通过嵌套循环遍历指定的区域，并调用 lambda 函数处理每个元素。
-	void run() override
+	// 任务分块, 解决每一个像素都要调度一次造成巨大性能损耗的问题
+	size_t targetCount = std::max<size_t>(mThreads.size(), 1) * (isComplex ? 16 : 1);
+	if (width == 1 || height == 1)
 	{
-		for (size_t idx_x = 0; idx_x < chunckWidth; idx_x++)
-		{
-			for (size_t idx_y = 0; idx_y < chunckHeight; idx_y++)
-			{
-				lambda(x + idx_x, y + idx_y);
-			}
-		}
+		size_t length = std::max<size_t>((width * height + targetCount - 1) / targetCount, 1);
+		chunckWidth = width == 1 ? 1 : length;
+		chunckHeight = height == 1 ? 1 : length;
+		return;
 	}
+	// 取不超过理想边长的2的幂, 块的数量在目标的1到4倍之间; 也不超过较短的一边, 否则块内的曲线大多落在循环外
+	float idealSide = std::sqrt(static_cast<float>(width) * static_cast<float>(height) / static_cast<float>(targetCount));
+	size_t side = 1;
+	while (static_cast<float>(side * 2) <= idealSide && side * 2 <= std::min(width, height))
+	{
+		side *= 2;
+	}
+	chunckWidth = chunckHeight = side;
+}
 
-private:
-	size_t x, y, chunckWidth, chunckHeight;
-	std::function<void(size_t, size_t)> lambda; // 存储要执行的任务函数
-};
-
-void ThreadPool::parallelFor(size_t width, size_t height, const std::function<void(size_t, size_t)> &lambda, bool _isComplex)
+void ThreadPool::wait()
 {
-	Guard guard(mSpinLock); // 确保在当前函数执行期间，对共享资源（如任务队列）的访问是线程安全的
+	// 调用线程也参与执行, 直到待处理任务的数量为0; 没有可取的任务时说明剩下的任务都在执行中, 休眠而不是空转
+	waitUntil([&]
+			  { return mPendingTaskCount == 0; });
+}
 
-	// 任务分块, 解决每一个像素都要new一个任务出来造成巨大性能损耗的问题
-	float chunckWidthF = (float)(static_cast<float>(width) / std::sqrt(mThreads.size()));
-	float chunckHeightF = (float)(static_cast<float>(height) / std::sqrt(mThreads.size()));
-	if (_isComplex) // 复杂任务, 进一步分块(任务内容确定，没有分支结构的任务是简单任务)
+void ThreadPool::finishTask(Task *task)
+{
+	task->release();
+	if (--mPendingTaskCount == 0)
 	{
-		chunckWidthF /= (float)std::sqrt(16);
-		chunckHeightF /= (float)std::sqrt(16);
+		notifyDone();
 	}
+}
 
-	size_t chunckWidth = static_cast<size_t>(std::ceil(chunckWidthF));
-	size_t chunckHeight = static_cast<size_t>(std::ceil(chunckHeightF));
+void ThreadPool::sleep()
+{
+	std::unique_lock<std::mutex> lock(mSleepMutex);
+	// 先增加休眠计数再检查条件, 与提交任务时先增加计数再检查休眠计数相对应, 两边至少有一边能看到对方, 不会丢失唤醒
+	mSleepingCount++;
+	mSleepCondition.wait(lock, [&]
+						 { return mQueuedTaskCount > 0 || mAlive == 0; });
+	mSleepingCount--;
+}
 
-	for (size_t x = 0; x < width; x += chunckWidth)
+void ThreadPool::notifyDone()
+{
+	// 条件的修改可能只是release写(如Future的完成标志), 与之后读等待计数之间没有顺序保证, 等待者一侧同理,
+	// 两边都可能读到对方的旧值, 等待者在条件已经满足时休眠且没人唤醒; 两边各有一个全屏障, 至少一边能看到对方
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (mWaitingCount == 0)
 	{
-		for (size_t y = 0; y < height; y += chunckHeight)
-		{
-			mPendingTaskCount++;		 // 增加待处理任务的数量
-			if (x + chunckWidth > width) // 处理边界情况，确保任务不超出边界
-			{
-				chunckWidth = width - x;
-			}
-			if (y + chunckHeight > height)
-			{
-				chunckHeight = height - y;
-			}
-			// 创建一个 ParallelForTask 任务，并将其添加到任务队列中。
-			mTasks.push(new ParallelForTask(x, y, chunckWidth, chunckHeight, lambda));
-		}
+		return;
 	}
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+	}
+	mDoneCondition.notify_all();
 }
 
-void ThreadPool::wait() const
+void ThreadPool::wakeUp(bool all)
 {
-	// 等待所有任务完成，不断检查待处理任务的数量，直到为0。
-	while (mPendingTaskCount > 0)
+	if (mSleepingCount == 0)
+	{
+		return;
+	}
+	// 休眠的线程在检查条件和进入等待之间持有锁, 先获取一次锁保证通知不会落在这段时间里
 	{
-		std::this_thread::yield();
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+	}
+	if (all)
+	{
+		mSleepCondition.notify_all();
+	}
+	else
+	{
+		mSleepCondition.notify_one();
 	}
 }
 
 void ThreadPool::addTask(Task *task)
 {
-	Guard guard(mSpinLock); // 确保在当前函数执行期间，对共享资源（如任务队列）的访问是线程安全的
-	mPendingTaskCount++;
-	mTasks.push(task);
+	mPendingTaskCount++; // 先计数再入队, 任务执行完之前计数不会归零
+	mQueuedTaskCount++;
+	if (current_pool == this)
+	{
+		mWorkerTasks[current_worker]->push(task); // 工作线程提交的任务(如子任务)压入自己的队列, 不需要加锁
+	}
+	else
+	{
+		Guard guard(mSpinLock); // 外部线程可能有多个, 共享队列需要加锁
+		mTasks.push(task);
+		mSharedTaskCount++;
+	}
+	// 有线程正在寻找任务时由它取走, 不必唤醒休眠的线程; 它找到任务后会再唤醒一个接替
+	if (mSpinningCount == 0)
+	{
+		wakeUp(false);
+	}
 }
 
 Task *ThreadPool::getTask()
 {
-	Guard guard(mSpinLock);
-	if (mTasks.empty())
+	bool isWorker = current_pool == this;
+	if (isWorker)
+	{
+		if (Task *task = mWorkerTasks[current_worker]->pop())
+		{
+			mQueuedTaskCount--;
+			return task;
+		}
+	}
+	if (mSharedTaskCount > 0) // 共享队列为空时不去竞争锁
+	{
+		Guard guard(mSpinLock);
+		if (!mTasks.empty())
+		{
+			Task *task = mTasks.front(); // 如果任务队列不为空，获取队列中第一个任务的指针
+			mTasks.pop();                // 从任务队列中移除第一个任务
+			mSharedTaskCount--;
+			mQueuedTaskCount--;
+			return task;
+		}
+	}
+	// 从随机选择的工作线程开始, 每个队列尝试窃取一次
+	size_t queueCount = mWorkerTasks.size();
+	if (queueCount == 0)
 	{
 		return nullptr;
 	}
-	Task *task = mTasks.front(); // 如果任务队列不为空，获取队列中第一个任务的指针
-	mTasks.pop();				 // 从任务队列中移除第一个任务
-	return task;
-}
+	size_t first = nextStealRandom() % queueCount;
+	for (size_t i = 0; i < queueCount; i++)
+	{
+		size_t victim = (first + i) % queueCount;
+		if (isWorker && victim == current_worker)
+		{
+			continue;
+		}
+		if (Task *task = mWorkerTasks[victim]->steal())
+		{
+			mQueuedTaskCount--;
+			return task;
+		}
+	}
+	return nullptr;
+}
\ No newline at end of file
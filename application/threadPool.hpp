@@ -1,9 +1,60 @@
 #pragma once
 #include <thread>
-#include <functional> // 用于封装可调用对象
 #include <vector>
+#include <algorithm>
 #include <queue>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
+#include <type_traits>
 #include "spinLock.hpp"
+#include "workStealingQueue.hpp"
+// parallelFor在块之间和块内访问(x, y)的顺序
+enum class TileOrder
+{
+    RowMajor, // 逐行访问, 与胶片按行存储的像素顺序一致
+    Morton,   // Z序曲线, 连续的迭代在两个方向上都靠得很近
+    Hilbert,  // 希尔伯特曲线, 连续的迭代总是相邻的格子, 局部性最好, 计算稍贵
+};
+
+// 边长为side(2的幂)的正方形网格中, 沿曲线的第index个格子
+inline void curveCell(TileOrder order, size_t side, size_t index, size_t &x, size_t &y)
+{
+    x = y = 0;
+    if (order == TileOrder::Morton) // 偶数位是x, 奇数位是y
+    {
+        for (size_t bit = 0; (size_t(1) << bit) < side; bit++)
+        {
+            x |= ((index >> (2 * bit)) & 1) << bit;
+            y |= ((index >> (2 * bit + 1)) & 1) << bit;
+        }
+        return;
+    }
+    if (order == TileOrder::Hilbert) // 从最小的子正方形开始, 每一级按象限旋转后平移
+    {
+        for (size_t s = 1; s < side; s *= 2, index /= 4)
+        {
+            size_t rx = 1 & (index / 2);
+            size_t ry = 1 & (index ^ rx);
+            if (ry == 0)
+            {
+                if (rx == 1)
+                {
+                    x = s - 1 - x;
+                    y = s - 1 - y;
+                }
+                std::swap(x, y);
+            }
+            x += s * rx;
+            y += s * ry;
+        }
+        return;
+    }
+    x = index % side;
+    y = index / side;
+}
+
 /*
     线程池是一种并发编程模型，用于管理一组预先创建的线程，这些线程可以执行提交给线程池的任务。这种模型可以避免频繁创建和销毁线程带来的开销，提高程序的性能。
 */
@@ -11,31 +62,379 @@ class Task
 {
 public:
     virtual void run() = 0;
+    virtual void release() { delete this; } // 执行完后由线程池调用, 不由线程池持有的任务(如parallelFor的任务)重写它
     virtual ~Task() = default;
 };
 
+template <typename T>
+class Future;
+
+// 每个工作线程有自己的工作窃取队列, 工作线程提交的任务压入自己的队列, 空闲的工作线程随机窃取其它队列中的任务
+// 不在线程池中的线程(如主线程)不能压入工作窃取队列, 提交的任务放入共享队列, 由工作线程取走
 class ThreadPool
 {
 public:
-    static void workerThread(ThreadPool *master); // 工作线程的入口点，每个工作线程都会执行这个函数
+    static void workerThread(ThreadPool *master, size_t index); // 工作线程的入口点，每个工作线程都会执行这个函数
 
     ThreadPool(size_t threadCount = 0); // 创建指定数量的工作线程，threadCount=0时默认使用硬件并发数量
     ~ThreadPool();                      // 等待所有任务完成并销毁所有线程
 
-    // 并行执行一个二维循环，将每个循环迭代作为一个任务提交给线程池
-    void parallelFor(size_t width, size_t height, const std::function<void(size_t, size_t)> &lambda, bool _isComplex = true);
-    // 等待所有任务完成
-    void wait() const;
+    // 并行执行一个二维循环，返回时所有迭代都已完成; 调用线程也参与执行, 可以在任务中嵌套调用
+    // 循环分成正方形的块, 各线程从共享的原子计数中领取块, 整块在一次调用中内联执行, 不为每块分配任务, 也不复制lambda
+    // order同时决定领取块的顺序和块内迭代的顺序, 同时执行的块在图像上相邻, 连续的迭代访问的像素和场景数据也相邻
+    template <typename F>
+    void parallelFor(size_t width, size_t height, const F &lambda, bool _isComplex = true, TileOrder order = TileOrder::RowMajor);
+    // 等待所有任务完成, 等待期间调用线程也从队列中取任务执行, 没有可取的任务时休眠直到任务全部完成
+    void wait();
+    // 提交一个有返回值的任务, deps中的任务全部完成后才入队执行, 返回值通过返回的Future取得
+    // 依赖构成任务图: 加载、构建和渲染前的准备可以交错执行, 不必在主线程上逐个等待; 任务不能抛出异常
+    template <typename F, typename... Ds>
+    auto submit(F &&function, const Future<Ds> &...deps) -> Future<std::invoke_result_t<std::decay_t<F> &>>;
+    // 执行队列中的任务直到done返回true, 没有可取的任务时休眠; 可以在任务中调用, 只等待自己关心的任务而不是整个线程池
+    // done的条件由其它线程改变时, 改变后要调用notifyDone唤醒休眠的等待者
+    template <typename Done>
+    void waitUntil(const Done &done);
+    void notifyDone(); // 唤醒在waitUntil中休眠的线程重新检查条件
 
-    void addTask(Task *task); // 添加一个任务到线程池
-    Task *getTask();          // 从任务队列中获取一个任务
+    void addTask(Task *task); // 添加一个任务到线程池, 工作线程添加到自己的队列, 其它线程添加到共享队列
+    Task *getTask();          // 依次从自己的队列、共享队列和随机选择的其它工作线程的队列中获取一个任务
+    size_t threadCount() const { return mThreads.size(); }
+
+private:
+    template <typename F>
+    class ParallelForTask;
+    // 按代价估计块的大小: 复杂的迭代分成约16倍线程数的块以平衡负载, 简单的迭代每个线程约一块以减少领取的次数
+    // 二维循环的块是边长为2的幂的正方形, 块内的曲线不会经过块外; 一维循环直接按长度分段
+    void chunkSize(size_t width, size_t height, bool isComplex, size_t &chunckWidth, size_t &chunckHeight) const;
+    void finishTask(Task *task); // 释放执行完的任务, 最后一个任务完成时唤醒wait()
+    void sleep();                // 空闲的工作线程休眠到有任务入队或者线程池销毁
+    // waitUntil的调用者休眠到done返回true或者有任务可取, 新提交的任务由工作线程执行, 不唤醒它
+    template <typename Done>
+    void sleepUntil(const Done &done);
+    void wakeUp(bool all); // 有工作线程在休眠时唤醒一个或者全部
 
 private:
     std::atomic<int> mAlive;            // 线程池是否存活的标志
     std::vector<std::thread> mThreads;  // 线程池中的线程
     std::atomic<int> mPendingTaskCount; // 待处理任务的数量
-    std::queue<Task *> mTasks;          // 任务队列，用于存储待执行的任务。
-    SpinLock mSpinLock{};               // 用于保护任务队列的自旋锁，确保线程安全。应当有出队入队两个锁，否则只能主线程操作。
+    std::vector<std::unique_ptr<WorkStealingQueue<Task *>>> mWorkerTasks; // 每个工作线程的工作窃取队列
+    std::queue<Task *> mTasks;          // 不在线程池中的线程提交的任务
+    std::atomic<int> mSharedTaskCount{0}; // 共享队列中的任务数量, 为0时取任务不必加锁
+    std::atomic<int> mQueuedTaskCount{0}; // 所有队列中还没有被取走的任务数量, 休眠的线程据此判断是否醒来
+    std::atomic<int> mSleepingCount{0};   // 正在休眠的工作线程数量, 为0时提交任务不必加锁唤醒
+    std::atomic<int> mWaitingCount{0};    // 在sleepUntil中休眠的线程数量
+    std::atomic<int> mSpinningCount{0};   // 取不到任务、正在让出时间片重试的工作线程数量
+    std::mutex mSleepMutex;
+    std::condition_variable mSleepCondition; // 空闲的工作线程在这里休眠
+    std::condition_variable mDoneCondition;  // wait()和parallelFor的调用者在这里休眠
+    SpinLock mSpinLock{};               // 保护共享队列的自旋锁, 只有外部线程提交和共享队列非空时取任务才会竞争
+};
+
+extern ThreadPool threadPool; // 全局线程池实例，用于简化线程池的使用。
+
+// parallelFor的任务, 在调用者的栈上, 同一个对象压入队列多次, 取到它的线程都从共享的计数中领取块执行
+template <typename F>
+class ThreadPool::ParallelForTask : public Task
+{
+public:
+    ParallelForTask(ThreadPool *pool, size_t width, size_t height, size_t chunckWidth, size_t chunckHeight, TileOrder order, const F &lambda)
+        : pool(pool), width(width), height(height), chunckWidth(chunckWidth), chunckHeight(chunckHeight), order(order), lambda(lambda)
+    {
+        chunckCountX = (width + chunckWidth - 1) / chunckWidth;
+        chunckCountY = (height + chunckHeight - 1) / chunckHeight;
+        chunckCount = chunckCountX * chunckCountY;
+        // 块的网格补齐成2的幂的正方形后沿曲线领取, 经过网格外时跳过; 网格太扁时跳过的太多, 改为逐行领取
+        gridSide = 1;
+        while (gridSide < std::max(chunckCountX, chunckCountY))
+        {
+            gridSide *= 2;
+        }
+        if (order == TileOrder::RowMajor || gridSide * gridSide > 4 * chunckCount)
+        {
+            gridOrder = TileOrder::RowMajor;
+            gridSide = chunckCountX;
+        }
+        else
+        {
+            gridOrder = order;
+        }
+        cellCount = gridOrder == TileOrder::RowMajor ? chunckCount : gridSide * gridSide;
+    }
+
+    void run() override
+    {
+        for (size_t cell = nextCell++; cell < cellCount; cell = nextCell++)
+        {
+            size_t chunckX, chunckY;
+            curveCell(gridOrder, gridSide, cell, chunckX, chunckY);
+            if (chunckX < chunckCountX && chunckY < chunckCountY)
+            {
+                runChunck(chunckX * chunckWidth, chunckY * chunckHeight);
+            }
+        }
+    }
+
+    // 最后一个引用执行完时唤醒调用者; 减少计数后调用者可能立即返回, 之后不能再访问自己
+    void release() override
+    {
+        ThreadPool *master = pool;
+        if (references.fetch_sub(1) == 1)
+        {
+            master->notifyDone();
+        }
+    }
+
+    ThreadPool *pool;
+    size_t width, height, chunckWidth, chunckHeight;
+    size_t chunckCountX, chunckCountY, chunckCount;
+    size_t gridSide, cellCount; // 领取块时曲线所在正方形网格的边长和格子数量
+    TileOrder order, gridOrder; // 块内和块之间的顺序
+    const F &lambda;
+    std::atomic<size_t> nextCell{0};
+    std::atomic<size_t> references{0}; // 压入队列、还没有执行完的引用数量
+
+private:
+    void runChunck(size_t x, size_t y) const
+    {
+        // 处理边界情况，确保任务不超出边界
+        size_t endX = std::min(x + chunckWidth, width);
+        size_t endY = std::min(y + chunckHeight, height);
+        if (order == TileOrder::RowMajor || chunckWidth != chunckHeight) // 一维循环的块不是正方形, 只能逐行
+        {
+            for (size_t idx_y = y; idx_y < endY; idx_y++)
+            {
+                for (size_t idx_x = x; idx_x < endX; idx_x++)
+                {
+                    lambda(idx_x, idx_y);
+                }
+            }
+            return;
+        }
+        for (size_t index = 0; index < chunckWidth * chunckHeight; index++)
+        {
+            size_t dx, dy;
+            curveCell(order, chunckWidth, index, dx, dy);
+            if (x + dx < endX && y + dy < endY)
+            {
+                lambda(x + dx, y + dy);
+            }
+        }
+    }
+};
+
+template <typename F>
+void ThreadPool::parallelFor(size_t width, size_t height, const F &lambda, bool _isComplex, TileOrder order)
+{
+    if (width == 0 || height == 0)
+    {
+        return;
+    }
+    size_t chunckWidth, chunckHeight;
+    chunkSize(width, height, _isComplex, chunckWidth, chunckHeight);
+    ParallelForTask<F> task(this, width, height, chunckWidth, chunckHeight, order, lambda);
+
+    // 除了调用线程, 每个工作线程最多需要一个引用
+    size_t helperCount = std::min(mThreads.size(), task.chunckCount - 1);
+    task.references = helperCount;
+    for (size_t i = 0; i < helperCount; i++)
+    {
+        addTask(&task);
+    }
+    task.run();
+
+    // 块都领取完后还要等其它线程执行完手里的块, 并把还在队列中的引用取走, 否则返回后队列中留下悬空的指针
+    waitUntil([&]
+              { return task.references == 0; });
+}
+
+template <typename Done>
+void ThreadPool::waitUntil(const Done &done)
+{
+    while (!done())
+    {
+        if (Task *task = getTask())
+        {
+            task->run();
+            finishTask(task);
+        }
+        else
+        {
+            sleepUntil(done);
+        }
+    }
+}
+
+template <typename Done>
+void ThreadPool::sleepUntil(const Done &done)
+{
+    std::unique_lock<std::mutex> lock(mSleepMutex);
+    // 先增加等待计数再检查条件, 与完成时先修改条件再检查等待计数相对应, 两边的全屏障保证不会丢失唤醒
+    mWaitingCount++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // 进入时还有任务没被取走就回去执行它, 之后只在条件可能满足时被唤醒
+    mDoneCondition.wait(lock, [&]
+                        { return done() || mQueuedTaskCount > 0; });
+    mWaitingCount--;
+}
+// 任务图中的节点, 所有依赖完成后才提交给线程池; 计数比依赖多一, 提交者注册完所有依赖后再减去, 不会提前入队
+class GraphTask : public Task
+{
+public:
+    GraphTask(ThreadPool *pool, size_t dependencyCount) : mPool(pool), mRemaining(dependencyCount + 1) {}
+
+    void dependencyDone()
+    {
+        if (--mRemaining == 0)
+        {
+            mPool->addTask(this);
+        }
+    }
+
+protected:
+    ThreadPool *mPool;
+
+private:
+    std::atomic<size_t> mRemaining;
+};
+
+// Future和执行任务共享的完成状态, 记录完成前注册的后续任务
+// 后续任务在依赖完成时直接入队, 依赖完成前不计入待处理任务的数量; 依赖入队前就已经计数, 所以wait()仍然等待整个任务图
+class FutureStateBase
+{
+public:
+    bool ready() const { return mDone.load(std::memory_order_acquire); }
+
+    // 已经完成时立即通知, 否则在完成时通知
+    void addDependent(GraphTask *task)
+    {
+        {
+            Guard guard(mSpinLock);
+            if (!mDone.load(std::memory_order_relaxed))
+            {
+                mDependents.push_back(task);
+                return;
+            }
+        }
+        task->dependencyDone();
+    }
+
+    void complete(ThreadPool *pool)
+    {
+        std::vector<GraphTask *> dependents;
+        {
+            Guard guard(mSpinLock);
+            mDone.store(true, std::memory_order_release);
+            dependents.swap(mDependents);
+        }
+        for (auto *task : dependents)
+        {
+            task->dependencyDone();
+        }
+        pool->notifyDone(); // 唤醒在Future::wait中休眠的线程
+    }
+
+private:
+    std::atomic<bool> mDone{false};
+    SpinLock mSpinLock{};
+    std::vector<GraphTask *> mDependents;
+};
+
+template <typename T>
+class FutureState : public FutureStateBase
+{
+public:
+    std::optional<T> value; // 任务完成前为空, 返回值不必能默认构造
+};
+
+template <>
+class FutureState<void> : public FutureStateBase
+{
 };
 
-extern ThreadPool threadPool; // 全局线程池实例，用于简化线程池的使用。
\ No newline at end of file
+// 任务的结果, 可以复制, 所有副本共享同一个状态
+template <typename T>
+class Future
+{
+public:
+    Future() = default;
+
+    bool valid() const { return mState != nullptr; }
+    bool ready() const { return mState->ready(); }
+    // 等待期间当前线程执行其它任务, 可以在任务中调用
+    void wait() const
+    {
+        mPool->waitUntil([&]
+                         { return mState->ready(); });
+    }
+    // 等待任务完成并返回结果的引用, 结果存放在共享状态中, 可以移动出来(如std::unique_ptr)
+    decltype(auto) get() const
+    {
+        wait();
+        if constexpr (!std::is_void_v<T>)
+        {
+            return (*mState->value);
+        }
+    }
+    // 任务完成后以结果(void时没有参数)调用function, 不阻塞当前线程
+    template <typename F>
+    auto then(F &&function) const
+    {
+        return mPool->submit([state = mState, function = std::forward<F>(function)]() mutable
+                             {
+                                 if constexpr (std::is_void_v<T>)
+                                 {
+                                     return function();
+                                 }
+                                 else
+                                 {
+                                     return function(*state->value);
+                                 }
+                             },
+                             *this);
+    }
+
+private:
+    friend class ThreadPool;
+    Future(ThreadPool *pool, std::shared_ptr<FutureState<T>> state) : mPool(pool), mState(std::move(state)) {}
+
+    ThreadPool *mPool{};
+    std::shared_ptr<FutureState<T>> mState;
+};
+
+// submit提交的任务, 执行完后保存返回值并通知后续任务
+template <typename F, typename R>
+class FutureTask : public GraphTask
+{
+public:
+    FutureTask(ThreadPool *pool, size_t dependencyCount, F &&function, std::shared_ptr<FutureState<R>> state)
+        : GraphTask(pool, dependencyCount), mFunction(std::move(function)), mState(std::move(state)) {}
+
+    void run() override
+    {
+        if constexpr (std::is_void_v<R>)
+        {
+            mFunction();
+        }
+        else
+        {
+            mState->value.emplace(mFunction());
+        }
+        mState->complete(mPool);
+    }
+
+private:
+    F mFunction;
+    std::shared_ptr<FutureState<R>> mState;
+};
+
+template <typename F, typename... Ds>
+auto ThreadPool::submit(F &&function, const Future<Ds> &...deps) -> Future<std::invoke_result_t<std::decay_t<F> &>>
+{
+    using Function = std::decay_t<F>;
+    using Result = std::invoke_result_t<Function &>;
+    auto state = std::make_shared<FutureState<Result>>();
+    auto *task = new FutureTask<Function, Result>(this, sizeof...(Ds), Function(std::forward<F>(function)), state);
+    (deps.mState->addDependent(task), ...);
+    task->dependencyDone(); // 依赖都已注册, 释放多出的一个计数; 依赖都已完成时立即入队
+    return Future<Result>(this, std::move(state));
+}
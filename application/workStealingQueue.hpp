@@ -0,0 +1,112 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <cstdint>
+/*
+    Chase–Lev工作窃取队列: 每个工作线程持有一个, 只有持有者在底部压入和弹出, 其它线程从顶部窃取
+    持有者的压入和弹出不加锁, 只有队列中剩最后一个元素时才与窃取者竞争一次CAS
+    内存顺序参考 Lê et al., "Correct and Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013)
+*/
+template <typename T>
+class WorkStealingQueue
+{
+public:
+    explicit WorkStealingQueue(int64_t capacity = 256)
+    {
+        mArrays.push_back(std::make_unique<Array>(capacity));
+        mArray.store(mArrays.back().get(), std::memory_order_relaxed);
+    }
+
+    // 只能由持有者调用, 队列满时容量翻倍
+    void push(T item)
+    {
+        int64_t bottom = mBottom.load(std::memory_order_relaxed);
+        int64_t top = mTop.load(std::memory_order_acquire);
+        Array *array = mArray.load(std::memory_order_relaxed);
+        if (bottom - top > array->capacity - 1)
+        {
+            array = grow(array, bottom, top);
+        }
+        array->put(bottom, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        mBottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    // 只能由持有者调用, 取出最后压入的元素, 队列为空时返回T{}
+    T pop()
+    {
+        int64_t bottom = mBottom.load(std::memory_order_relaxed) - 1;
+        Array *array = mArray.load(std::memory_order_relaxed);
+        mBottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = mTop.load(std::memory_order_relaxed);
+        if (top > bottom) // 队列为空
+        {
+            mBottom.store(bottom + 1, std::memory_order_relaxed);
+            return T{};
+        }
+        T item = array->get(bottom);
+        if (top == bottom) // 最后一个元素, 与窃取者竞争
+        {
+            if (!mTop.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            {
+                item = T{};
+            }
+            mBottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // 任意线程都可以调用, 取出最早压入的元素, 队列为空或者竞争失败时返回T{}
+    T steal()
+    {
+        int64_t top = mTop.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t bottom = mBottom.load(std::memory_order_acquire);
+        if (top >= bottom)
+        {
+            return T{};
+        }
+        T item = mArray.load(std::memory_order_acquire)->get(top);
+        if (!mTop.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            return T{};
+        }
+        return item;
+    }
+
+    bool empty() const { return mTop.load(std::memory_order_relaxed) >= mBottom.load(std::memory_order_relaxed); }
+
+private:
+    // 环形数组, 下标对容量取模; 元素用relaxed原子读写, 顺序由top和bottom上的栅栏保证
+    struct Array
+    {
+        explicit Array(int64_t capacity) : capacity(capacity), mask(capacity - 1), items(new std::atomic<T>[capacity]) {}
+        T get(int64_t index) const { return items[index & mask].load(std::memory_order_relaxed); }
+        void put(int64_t index, T item) { items[index & mask].store(item, std::memory_order_relaxed); }
+
+        int64_t capacity; // 总是2的幂
+        int64_t mask;
+        std::unique_ptr<std::atomic<T>[]> items;
+    };
+
+    // 窃取者可能还在读旧数组, 旧数组保留到队列销毁时才释放
+    Array *grow(Array *array, int64_t bottom, int64_t top)
+    {
+        mArrays.push_back(std::make_unique<Array>(array->capacity * 2));
+        Array *bigger = mArrays.back().get();
+        for (int64_t i = top; i < bottom; i++)
+        {
+            bigger->put(i, array->get(i));
+        }
+        mArray.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    // top和bottom分别由窃取者和持有者频繁修改, 放在不同的cache line上避免伪共享
+    alignas(64) std::atomic<int64_t> mTop{0};
+    alignas(64) std::atomic<int64_t> mBottom{0};
+    alignas(64) std::atomic<Array *> mArray{};
+    std::vector<std::unique_ptr<Array>> mArrays; // 只有持有者扩容时修改
+};
@@ -1,5 +1,17 @@
 #include "bounds.hpp"
 
+// 光线包的包围盒测试按SIMD宽度分组, 与宽BVH的SIMD选择相同
+#if defined(__AVX__)
+#include <immintrin.h>
+#define BOUNDS_PACKET_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define BOUNDS_PACKET_SSE
+#endif
+#pragma warning(push)
+#pragma warning(disable : 4267)
+#pragma warning(disable : 4244)
+
 /**
  * @brief 判断射线是否与轴对齐包围盒相交
  *
@@ -45,4 +57,96 @@ bool Bounds::hasIntersection(const Ray &ray, const glm::vec3 &inv_direction, flo
     float t_near = glm::max(tmin.x, glm::max(tmin.y, tmin.z));
     float t_far = glm::min(tmax.x, glm::min(tmax.y, tmax.z));
     return glm::max(t_near, t_min) <= glm::min(t_far, t_max);
-}
\ No newline at end of file
+}
+bool Bounds::hasIntersection(const RayPacket &packet, size_t i) const
+{
+    return hasIntersection(packet.getRay(i), packet.getInvDirection(i), packet.t_min, packet.t_max[i]);
+}
+
+// 区间[a0, a1]与[b0, b1]之积的下界和上界
+static glm::vec3 intervalMulMin(const glm::vec3 &a0, const glm::vec3 &a1, const glm::vec3 &b0, const glm::vec3 &b1)
+{
+    return glm::min(glm::min(a0 * b0, a0 * b1), glm::min(a1 * b0, a1 * b1));
+}
+
+static glm::vec3 intervalMulMax(const glm::vec3 &a0, const glm::vec3 &a1, const glm::vec3 &b0, const glm::vec3 &b1)
+{
+    return glm::max(glm::max(a0 * b0, a0 * b1), glm::max(a1 * b0, a1 * b1));
+}
+
+/**
+ * @brief 光线包与包围盒的区间算术测试
+ *
+ * 每个轴上射线进入包围盒的平面由方向符号决定, 包内光线方向符号相同时平面对所有光线都一样.
+ * 进入距离 (near - o) * inv_d 的下界不大于每条光线的进入距离, 离开距离的上界不小于每条光线的离开距离,
+ * 所以下界的最大值超过上界的最小值时, 包内没有光线能与包围盒相交.
+ *
+ * @param t_max 包内光线t_max的最大值
+ */
+bool Bounds::mayIntersect(const RayPacket &packet, float t_max) const
+{
+    glm::vec3 near_plane{}, far_plane{};
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        near_plane[axis] = packet.dir_is_neg[axis] ? b_max[axis] : b_min[axis];
+        far_plane[axis] = packet.dir_is_neg[axis] ? b_min[axis] : b_max[axis];
+    }
+    glm::vec3 t_near = intervalMulMin(near_plane - packet.origin_max, near_plane - packet.origin_min, packet.inv_direction_min, packet.inv_direction_max);
+    glm::vec3 t_far = intervalMulMax(far_plane - packet.origin_max, far_plane - packet.origin_min, packet.inv_direction_min, packet.inv_direction_max);
+    float near = glm::max(packet.t_min, glm::max(t_near.x, glm::max(t_near.y, t_near.z)));
+    float far = glm::min(t_max, glm::min(t_far.x, glm::min(t_far.y, t_far.z)));
+    return near <= far;
+}
+
+// SIMD版本与hasIntersection中glm::min、glm::max的参数顺序一致, 遇到NaN时结果也相同
+uint32_t Bounds::intersectPacket(const RayPacket &packet, size_t first) const
+{
+    uint32_t mask = 0;
+#if defined(BOUNDS_PACKET_AVX)
+    constexpr size_t lanes = 8;
+    for (size_t begin = first & ~(lanes - 1); begin < RAY_PACKET_SIZE; begin += lanes)
+    {
+        __m256 t_min_axis[3], t_max_axis[3];
+        for (size_t axis = 0; axis < 3; axis++)
+        {
+            __m256 o = _mm256_load_ps(packet.origin[axis] + begin);
+            __m256 inv_d = _mm256_load_ps(packet.inv_direction[axis] + begin);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b_min[axis]), o), inv_d);
+            __m256 t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b_max[axis]), o), inv_d);
+            t_min_axis[axis] = _mm256_min_ps(t2, t1);
+            t_max_axis[axis] = _mm256_max_ps(t2, t1);
+        }
+        __m256 t_near = _mm256_max_ps(_mm256_max_ps(t_min_axis[2], t_min_axis[1]), t_min_axis[0]);
+        __m256 t_far = _mm256_min_ps(_mm256_min_ps(t_max_axis[2], t_max_axis[1]), t_max_axis[0]);
+        t_near = _mm256_max_ps(_mm256_set1_ps(packet.t_min), t_near);
+        t_far = _mm256_min_ps(_mm256_load_ps(packet.t_max + begin), t_far);
+        mask |= static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ))) << begin;
+    }
+#elif defined(BOUNDS_PACKET_SSE)
+    constexpr size_t lanes = 4;
+    for (size_t begin = first & ~(lanes - 1); begin < RAY_PACKET_SIZE; begin += lanes)
+    {
+        __m128 t_min_axis[3], t_max_axis[3];
+        for (size_t axis = 0; axis < 3; axis++)
+        {
+            __m128 o = _mm_load_ps(packet.origin[axis] + begin);
+            __m128 inv_d = _mm_load_ps(packet.inv_direction[axis] + begin);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b_min[axis]), o), inv_d);
+            __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b_max[axis]), o), inv_d);
+            t_min_axis[axis] = _mm_min_ps(t2, t1);
+            t_max_axis[axis] = _mm_max_ps(t2, t1);
+        }
+        __m128 t_near = _mm_max_ps(_mm_max_ps(t_min_axis[2], t_min_axis[1]), t_min_axis[0]);
+        __m128 t_far = _mm_min_ps(_mm_min_ps(t_max_axis[2], t_max_axis[1]), t_max_axis[0]);
+        t_near = _mm_max_ps(_mm_set1_ps(packet.t_min), t_near);
+        t_far = _mm_min_ps(_mm_load_ps(packet.t_max + begin), t_far);
+        mask |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t_near, t_far))) << begin;
+    }
+#else
+    for (size_t i = first; i < RAY_PACKET_SIZE; i++)
+    {
+        mask |= static_cast<uint32_t>(hasIntersection(packet, i)) << i;
+    }
+#endif
+    return mask & ~((1u << first) - 1);
+}
@@ -2,6 +2,7 @@
 #include <glm/glm.hpp>
 
 #include "../ray.hpp"
+#include "../rayPacket.hpp"
 
 struct Bounds
 {
@@ -22,6 +23,11 @@ struct Bounds
 
     bool hasIntersection(const Ray &ray, float t_min, float t_max) const; // 射线与包围盒是否相交
     bool hasIntersection(const Ray &ray, const glm::vec3 &inv_direction, float t_min, float t_max) const;
+    bool hasIntersection(const RayPacket &packet, size_t i) const; // 光线包中第i条光线是否相交, 结果与单条光线的测试相同
+    // 区间算术测试: 用所有光线起点和方向倒数的区间求出进入、离开距离的保守范围, 返回false时整包光线都不相交
+    bool mayIntersect(const RayPacket &packet, float t_max) const;
+    // 从第first条光线开始一次SIMD测试多条光线, 返回命中的掩码, 第i位为1表示第i条光线相交
+    uint32_t intersectPacket(const RayPacket &packet, size_t first) const;
 
     glm::vec3 diagonal() const { return b_max - b_min; } // 计算包围盒的对角线
 
@@ -47,6 +53,9 @@ struct Bounds
     // 判断包围盒是否是一个退化的包围盒
     bool isValid() const { return b_max.x >= b_min.x && b_max.y >= b_min.y && b_max.z >= b_min.z; }
 
+    // 另一个包围盒是否完全在这个包围盒内
+    bool contains(const Bounds &bounds) const { return glm::all(glm::lessThanEqual(b_min, bounds.b_min)) && glm::all(glm::greaterThanEqual(b_max, bounds.b_max)); }
+
     glm::vec3 b_min;
     glm::vec3 b_max;
 };
\ No newline at end of file
@@ -1,20 +1,155 @@
 #include "bvh.hpp"
 #include <array>
+#include <algorithm>
 #include "../until/debugMacro.hpp"
+#include "../../application/threadPool.hpp"
+#include "bvhRefit.hpp"
 #include <iostream>
 #pragma warning(push)
 #pragma warning(disable : 4267)
 #pragma warning(disable : 4244)
 
-void BVH::build(std::vector<Triangle> &&triangles)
+// 顶层节点三角形数量超过该值时在主线程上并行分桶, 否则交给子树任务串行处理
+static constexpr size_t parallel_binning_threshold = 1 << 16;
+// 子树三角形数量超过该值时作为新任务提交给线程池, 太小的子树不值得调度开销
+static constexpr size_t subtree_task_threshold = 1 << 12;
+static constexpr size_t bucket_count = 12;
+// 一次测试一整块三角形的开销, 以测试一个三角形的开销为单位
+static constexpr float triangle_block_cost = 1.5f;
+
+// 子树构建任务, 每个任务记录自己的构建状态, 完成后合并到总状态中
+// 创建时增加这次构建未完成的任务数量, 执行完减少, 构建只等待自己的子树任务
+class BVHBuildTask : public Task
 {
+public:
+    BVHBuildTask(BVH *bvh, BVHTreeNode *node, BVHState &state, SpinLock &stateLock, std::atomic<size_t> &remaining)
+        : mBVH(bvh), mNode(node), mState(state), mStateLock(stateLock), mRemaining(remaining) { mRemaining++; }
+    BVHBuildTask(const BVHBuildTask &parent, BVHTreeNode *node)
+        : BVHBuildTask(parent.mBVH, node, parent.mState, parent.mStateLock, parent.mRemaining) {}
+
+    void run() override
+    {
+        BVHState state{};
+        mBVH->recursiveSplit(mNode, state, this);
+        {
+            Guard guard(mStateLock);
+            mState.merge(state);
+        }
+        // 减少计数后构建可能立即结束, 之后只能访问线程池
+        if (--mRemaining == 0)
+        {
+            threadPool.notifyDone();
+        }
+    }
+
+private:
+    BVH *mBVH;
+    BVHTreeNode *mNode;
+    BVHState &mState;
+    SpinLock &mStateLock;
+    std::atomic<size_t> &mRemaining;
+};
+
+// 每个轴上每个桶的包围盒与三角形数量, 并行分桶时每一段三角形各自统计, 最后合并
+struct BVHBuckets
+{
+    Bounds bounds[3][bucket_count]{};
+    size_t triangle_count[3][bucket_count]{};
+
+    void merge(const BVHBuckets &other)
+    {
+        for (size_t axis = 0; axis < 3; axis++)
+        {
+            for (size_t i = 0; i < bucket_count; i++)
+            {
+                bounds[axis][i].expand(other.bounds[axis][i]);
+                triangle_count[axis][i] += other.triangle_count[axis][i];
+            }
+        }
+    }
+};
+
+// 计算三角形引用在某个轴上的桶索引
+static size_t bucketIndex(const BVHPrimitive &primitive, const Bounds &bounds, const glm::vec3 &diag, size_t axis)
+{
+    return glm::clamp<size_t>(glm::floor((primitive.center[axis] - bounds.b_min[axis]) * bucket_count / diag[axis]), 0.f, bucket_count - 1); // 计算三角形的桶索引
+}
+
+// 将[begin, end)范围内的三角形引用放入三个轴的桶中
+static void fillBuckets(const BVHTreeNode *node, const BVHPrimitive *primitives, size_t begin, size_t end, BVHBuckets &buckets)
+{
+    auto diag = node->bounds.diagonal();
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        for (size_t idx = begin; idx < end; idx++)
+        {
+            const auto &primitive = primitives[idx];
+            size_t bucket_idx = bucketIndex(primitive, node->bounds, diag, axis);
+            buckets.bounds[axis][bucket_idx].expand(primitive.bounds); // 拓展桶的包围盒
+            buckets.triangle_count[axis][bucket_idx]++;                // 对应桶中的三角形数量加1
+        }
+    }
+}
+
+// 两个孩子成对相邻, 节点只记录左孩子的索引
+template <typename Nodes>
+static auto childrenOf(const Nodes &nodes)
+{
+    return [&nodes](size_t index)
+    { return std::pair<size_t, size_t>(nodes[index].child, nodes[index].child + 1); };
+}
+
+void BVH::build(TriangleMesh &&mesh, const BVHBuildOptions &options)
+{
+    // 重新构建时先清空上一次构建的结果
+    mGeneration++;
+    mOptions = options;
+    mNodes.clear();
+    mTriangleBlocks.clear();
+    // 只为每个三角形生成一个轻量的引用, 之后所有的分割都在这个数组上原地划分
+    size_t mesh_triangles_count = mesh.triangleCount();
+    mPrimitives.resize(mesh_triangles_count);
     auto *root = mAllocator.allocate();
-    root->mTriangles = std::move(triangles);
-    root->updateBounds();
+    for (size_t i = 0; i < mesh_triangles_count; i++)
+    {
+        const auto &p0 = mesh.position(i, 0), &p1 = mesh.position(i, 1), &p2 = mesh.position(i, 2);
+        Bounds bounds{};
+        bounds.expand(p0);
+        bounds.expand(p1);
+        bounds.expand(p2);
+        mPrimitives[i] = {bounds, (p0 + p1 + p2) * 0.333333333333f, static_cast<uint32_t>(i)};
+        root->bounds.expand(mPrimitives[i].bounds);
+    }
+    root->primitives_begin = 0;
+    root->primitives_count = mPrimitives.size();
     root->depth = 1;
     BVHState state{};
-    float triangles_count = static_cast<float>(root->mTriangles.size()); // 在初始三角形列表被清空前记录一下三角形数量，后面会被划分去叶节点
-    recursiveSplit(root, state);
+    float triangles_count = static_cast<float>(mesh_triangles_count);
+    if (options.strategy == BVHBuildStrategy::SpatialSAH)
+    {
+        // 空间分割会复制引用, 无法在一个数组上原地划分, 每个节点单独持有引用, 叶子再依次写回mPrimitives
+        state.spatial_split_budget = static_cast<size_t>(options.spatial_split_budget * triangles_count);
+        state.spatial_split_overlap = 1e-5f * root->bounds.area();
+        std::vector<BVHPrimitive> references;
+        references.swap(mPrimitives);
+        for (auto &reference : references) // 引用被裁剪后中心会变化, SBVH统一使用引用包围盒的中心分桶
+        {
+            reference.center = (reference.bounds.b_min + reference.bounds.b_max) * 0.5f;
+        }
+        recursiveSpatialSplit(root, std::move(references), mesh, state);
+    }
+    else if (options.strategy == BVHBuildStrategy::LBVH || options.strategy == BVHBuildStrategy::HLBVH)
+    {
+        buildLBVH(root, state, options.strategy == BVHBuildStrategy::HLBVH, options.parallel);
+    }
+    else if (options.parallel)
+    {
+        parallelSplit(root, state);
+    }
+    else
+    {
+        recursiveSplit(root, state);
+    }
 
     // std::cout << "Total node count: " << state.total_node_count << std::endl;
     // std::cout << "Leaf node count: " << state.leaf_node_count << std::endl;
@@ -22,16 +157,149 @@ void BVH::build(std::vector<Triangle> &&triangles)
     // std::cout << "Mean leaf node triangle count: " << triangles_count / static_cast<float>(state.leaf_node_count) << std::endl;
     // std::cout << "Max leaf node triangle count: " << state.max_leaf_node_triangle_count << std::endl;
     // std::cout << "Max leaf node depth: " << state.max_leaf_node_depth << std::endl;
+    // std::cout << "Median split count: " << state.median_split_count << std::endl;
+    mBuildState = state;
 
     // 给vector预留足够的空间，避免频繁的重新分配
-    mNodes.reserve(state.total_node_count);
-    mOrderedTriangles.reserve(triangles_count);
-    recursiveFlatten(root);
+    // 根节点之后空出一个位置, 之后的孩子对都从偶数索引开始, 与64字节的cache line对齐
+    mNodes.reserve(state.total_node_count + 1);
+    mNodes.resize(2);
+    recursiveFlatten(root, 0);
+    mAllocator.clear();
+
+    // 顶点数组保持不变, 只按叶子的顺序重排三角形的索引
+    auto &indices = mesh.indices;
+    if (mPrimitives.size() != mesh_triangles_count) // SBVH复制过引用, 引用数组不再是一个置换, 只能按引用拷贝三角形索引
+    {
+        std::vector<glm::uvec3> ordered_indices;
+        ordered_indices.reserve(mPrimitives.size());
+        for (const auto &primitive : mPrimitives)
+        {
+            ordered_indices.push_back(indices[primitive.index]);
+        }
+        indices.swap(ordered_indices);
+    }
+    else
+    {
+        // 划分后引用数组的顺序就是叶子节点深度优先遍历的顺序, 按它原地重排三角形, 不需要再拷贝一份索引数组
+        // 沿置换的环依次移动三角形, 移动过的位置把索引改成自身作为标记
+        for (size_t i = 0; i < mPrimitives.size(); i++)
+        {
+            if (mPrimitives[i].index == i)
+            {
+                continue;
+            }
+            glm::uvec3 temp = indices[i];
+            size_t current = i;
+            while (mPrimitives[current].index != i)
+            {
+                size_t next = mPrimitives[current].index;
+                indices[current] = indices[next];
+                mPrimitives[current].index = static_cast<uint32_t>(current);
+                current = next;
+            }
+            indices[current] = temp;
+            mPrimitives[current].index = static_cast<uint32_t>(current);
+        }
+    }
+    mMesh = std::move(mesh);
+    std::vector<BVHPrimitive>().swap(mPrimitives);
+    buildTriangleBlocks();
+
+    buildWideNodes();
+    // 空网格的根节点是没有三角形的叶子, 但triangles_count为0会被当作内部节点, 不能按孩子展开
+    mBuildSAHCost = mMesh.triangleCount() == 0 ? 0.f : computeSAHCost(mNodes, [](const BVHNode &node)
+                                                                      { return node.triangles_count; }, childrenOf(mNodes));
 }
 
-std::optional<HitInfo> BVH::intersect(const Ray &ray, float t_min, float t_max) const
+void BVH::buildWideNodes()
 {
-    std::optional<HitInfo> closestHitInfo;
+    std::vector<BVHWideNode>().swap(mWideNodes);
+    std::vector<BVHCompressedNode>().swap(mCompressedNodes);
+    if (mOptions.layout == BVHLayout::Wide || mOptions.layout == BVHLayout::Compressed)
+    {
+        mWideNodes.reserve(mNodes.size() / (BVH_WIDTH - 1) + 1);
+        recursiveCollapse(0);
+        if (mOptions.layout == BVHLayout::Compressed)
+        {
+            compressWideNodes();
+        }
+    }
+}
+
+bool BVH::refit(const std::vector<glm::vec3> &positions, const std::vector<glm::vec3> &normals)
+{
+    mMesh.positions = positions;
+    if (!normals.empty())
+    {
+        mMesh.normals = normals;
+    }
+    if (mMesh.triangleCount() == 0)
+    {
+        return false;
+    }
+
+    // 叶子重新计算三角形块中的顶点和边, 同时得到叶子的包围盒
+    auto leafCount = [](const BVHNode &node)
+    { return node.triangles_count; };
+    refitNodes(mNodes, leafCount, childrenOf(mNodes), [&](const BVHNode &node)
+               {
+                   Bounds bounds{};
+                   for (size_t i = 0; i < node.triangles_count; i++)
+                   {
+                       auto &block = mTriangleBlocks[node.triangles_index + i / BVH_WIDTH];
+                       size_t lane = i % BVH_WIDTH;
+                       size_t triangle = block.triangles_index + lane;
+                       const auto &p0 = mMesh.position(triangle, 0), &p1 = mMesh.position(triangle, 1), &p2 = mMesh.position(triangle, 2);
+                       glm::vec3 e0 = p1 - p0;
+                       glm::vec3 e1 = p2 - p0;
+                       for (size_t axis = 0; axis < 3; axis++)
+                       {
+                           block.p0[axis][lane] = p0[axis];
+                           block.e0[axis][lane] = e0[axis];
+                           block.e1[axis][lane] = e1[axis];
+                       }
+                       bounds.expand(p0);
+                       bounds.expand(p1);
+                       bounds.expand(p2);
+                   }
+                   return bounds; }, mOptions.parallel);
+
+    // 顶点移动太多时树的质量会明显下降, 这时重新构建比继续refit更划算
+    if (computeSAHCost(mNodes, leafCount, childrenOf(mNodes)) > mBuildSAHCost * mOptions.refit_rebuild_threshold)
+    {
+        auto mesh = std::move(mMesh);
+        build(std::move(mesh), mOptions);
+        return true;
+    }
+    buildWideNodes();
+    return false;
+}
+
+// 宽节点布局从子树开始只能按二叉节点遍历, 比从根节点按宽节点遍历还慢, 不允许打开
+bool BVH::getNodeChildren(uint32_t node, uint32_t children[2]) const
+{
+    if (mOptions.layout != BVHLayout::Binary || mNodes[node].triangles_count != 0 || mMesh.triangleCount() == 0)
+    {
+        return false;
+    }
+    children[0] = mNodes[node].child;
+    children[1] = mNodes[node].child + 1;
+    return true;
+}
+
+bool BVH::intersectNode(uint32_t root, const Ray &ray, float t_min, float &t_max, HitRecord &record) const
+{
+    if (mMesh.triangleCount() == 0) // 空网格的根节点是没有三角形的叶子, 空包围盒总是通过相交测试, 不能进入遍历
+    {
+        return false;
+    }
+    if (mOptions.layout != BVHLayout::Binary && root == 0)
+    {
+        return intersectRecordWide(ray, t_min, t_max, record);
+    }
+
+    bool hit = false;
 
     DEBUG_LINE(size_t bounds_test_count = 0, triangles_test_count = 0)
 
@@ -39,9 +307,10 @@ std::optional<HitInfo> BVH::intersect(const Ray &ray, float t_min, float t_max)
 
     glm::vec3 inv_dir = 1.0f / ray.mDirection;
 
-    std::array<int, 32> stack;
+    // 二叉遍历每下降一层最多入栈一个节点, 栈的容量为树的最大深度
+    TraversalStack<int, 64> stack(mBuildState.max_leaf_node_depth);
     auto ptr = stack.begin();
-    size_t current_node_index = 0;
+    size_t current_node_index = root;
     while (true)
     {
         auto &node = mNodes[current_node_index];
@@ -55,39 +324,84 @@ std::optional<HitInfo> BVH::intersect(const Ray &ray, float t_min, float t_max)
             current_node_index = *(--ptr);
             continue;
         }
-        if (node.triangles_count == 0) // 不是叶子节点, 就直接进入它的下一个节点, 因为它的下一个节点就是它的左孩子, 而右孩子不相邻
+        if (node.triangles_count == 0) // 不是叶子节点, 两个孩子相邻, 左孩子的索引是child, 右孩子是child + 1
         {
-            if (dir_is_neg[node.split_axis]) // 如果射线方向在当前轴的负方向, 就先左后右
+            if (dir_is_neg[node.split_axis]) // 如果射线方向在当前轴的负方向, 就先右后左
             {
                 // 将左孩子入栈
-                *(ptr++) = current_node_index + 1;
+                *(ptr++) = node.child;
                 // 将当前节点更新为右孩子
-                current_node_index = node.child;
+                current_node_index = node.child + 1;
             }
-            else // 如果射线方向在当前轴的正方向, 就先右后左
+            else // 如果射线方向在当前轴的正方向, 就先左后右
             {
                 // 将右孩子入栈
-                current_node_index++;
-                *(ptr++) = node.child;
+                current_node_index = node.child;
+                *(ptr++) = node.child + 1;
             }
         }
-        else // 是叶子节点, 就遍历它的三角形
+        else // 是叶子节点, 就按块测试它的三角形
         {
-            auto triangles_iter = mOrderedTriangles.begin() + node.triangles_index; // 节点的三角形索引起始位置
-            DEBUG_LINE(triangles_test_count += node.triangles_count)                // 在三角形相交测试前加上叶子节点三角形数量
+            DEBUG_LINE(triangles_test_count += node.triangles_count) // 在三角形相交测试前加上叶子节点三角形数量
 
-            for (size_t i = 0; i < node.triangles_count; ++i)
+            // 如果有交点, 会更新t_max和最近交点信息
+            hit |= intersectTriangleBlocks(mTriangleBlocks.data() + node.triangles_index, node.triangles_count, ray, t_min, t_max, record);
+            // 遍历完三角形后, 弹出栈顶元素, 继续遍历下一个节点
+            if (ptr == stack.begin())
+                break;
+            current_node_index = *(--ptr);
+        }
+    }
+    DEBUG_LINE(ray.bounds_test_count += bounds_test_count)
+    DEBUG_LINE(ray.triangles_test_count += triangles_test_count)
+    return hit;
+}
+
+// 任意交点查询: 找到第一个交点就返回, 不需要按射线方向决定孩子的顺序, 也不用计算交点和法线
+bool BVH::occludedNode(uint32_t root, const Ray &ray, float t_min, float t_max) const
+{
+    if (mMesh.triangleCount() == 0)
+    {
+        return false;
+    }
+    if (mOptions.layout != BVHLayout::Binary && root == 0)
+    {
+        return occludedWide(ray, t_min, t_max);
+    }
+
+    DEBUG_LINE(size_t bounds_test_count = 0, triangles_test_count = 0)
+
+    glm::vec3 inv_dir = 1.0f / ray.mDirection;
+
+    TraversalStack<int, 64> stack(mBuildState.max_leaf_node_depth);
+    auto ptr = stack.begin();
+    size_t current_node_index = root;
+    bool hit = false;
+    while (true)
+    {
+        auto &node = mNodes[current_node_index];
+        DEBUG_LINE(bounds_test_count++)
+
+        if (!node.bounds.hasIntersection(ray, inv_dir, t_min, t_max))
+        {
+            if (ptr == stack.begin())
+                break;
+            current_node_index = *(--ptr);
+            continue;
+        }
+        if (node.triangles_count == 0) // 总是先左后右, 左右孩子在同一条cache line上
+        {
+            current_node_index = node.child;
+            *(ptr++) = node.child + 1;
+        }
+        else
+        {
+            DEBUG_LINE(triangles_test_count += node.triangles_count)
+            if (occludedTriangleBlocks(mTriangleBlocks.data() + node.triangles_index, node.triangles_count, ray, t_min, t_max))
             {
-                auto hitInfo = triangles_iter->intersect(ray, t_min, t_max);
-                triangles_iter++;
-                if (hitInfo)
-                {
-                    // 如果有交点, 更新最近交点信息
-                    t_max = hitInfo->mT;
-                    closestHitInfo = hitInfo;
-                }
+                hit = true;
+                break;
             }
-            // 遍历完三角形后, 弹出栈顶元素, 继续遍历下一个节点
             if (ptr == stack.begin())
                 break;
             current_node_index = *(--ptr);
@@ -96,44 +410,103 @@ std::optional<HitInfo> BVH::intersect(const Ray &ray, float t_min, float t_max)
     DEBUG_LINE(ray.bounds_test_count += bounds_test_count)
     DEBUG_LINE(ray.triangles_test_count += triangles_test_count)
 
-    return closestHitInfo;
+    return hit;
+}
+
+// 顶层节点在主线程上逐个分割, 每个节点的分桶都用满整个线程池; 分到足够小的子树再统一作为任务提交
+// 只等待这次构建的子树任务, 等待时当前线程也执行任务, 构建本身可以作为线程池中的任务运行
+void BVH::parallelSplit(BVHTreeNode *root, BVHState &state)
+{
+    std::vector<BVHTreeNode *> top_nodes{root}; // 待分割的顶层节点
+    std::vector<BVHTreeNode *> subtrees;        // 交给线程池构建的子树
+    while (!top_nodes.empty())
+    {
+        auto *node = top_nodes.back();
+        top_nodes.pop_back();
+        if (node->primitives_count < parallel_binning_threshold)
+        {
+            subtrees.push_back(node);
+            continue;
+        }
+        state.total_node_count++;
+        if (!splitNode(node, true, state))
+        {
+            state.addLeafNode(node);
+            continue;
+        }
+        top_nodes.push_back(node->children[1]);
+        top_nodes.push_back(node->children[0]);
+    }
+
+    SpinLock stateLock{};
+    std::atomic<size_t> remaining{0};
+    for (auto *node : subtrees)
+    {
+        threadPool.addTask(new BVHBuildTask(this, node, state, stateLock, remaining));
+    }
+    threadPool.waitUntil([&]
+                         { return remaining == 0; });
 }
 
-void BVH::recursiveSplit(BVHTreeNode *node, BVHState &state)
+void BVH::recursiveSplit(BVHTreeNode *node, BVHState &state, const BVHBuildTask *task)
 {
-    state.total_node_count++;                             // 每递归进来一次, 就增加一个节点
-    if (node->mTriangles.size() == 1 || node->depth > 32) // 节点只有一个三角形或者深度超过32就不再分割(相交测试的栈深度为32)，认为它是叶子节点
+    state.total_node_count++; // 每递归进来一次, 就增加一个节点
+    if (!splitNode(node, false, state))
     {
         state.addLeafNode(node);
         return;
     }
+    // 较大的右子树提交给线程池, 左子树在当前线程继续构建
+    if (task != nullptr && node->children[1]->primitives_count >= subtree_task_threshold)
+    {
+        threadPool.addTask(new BVHBuildTask(*task, node->children[1]));
+    }
+    else
+    {
+        recursiveSplit(node->children[1], state, task);
+    }
+    recursiveSplit(node->children[0], state, task);
+}
+
+bool BVH::splitNode(BVHTreeNode *node, bool parallelBinning, BVHState &state)
+{
+    if (node->primitives_count == 1) // 节点只有一个三角形就不再分割，认为它是叶子节点
+    {
+        return false;
+    }
+    if (node->depth > BVH_MAX_SAH_DEPTH) // 树已经太深了, 之后只用中位数分割, 限制递归和遍历栈的深度
+    {
+        return medianSplitNode(node, state);
+    }
 
-    auto diag = node->bounds.diagonal();                          // 计算包围盒的对角线长度
     float min_cost = std::numeric_limits<float>::infinity();      // SAH算法的最小成本
     size_t min_split_index = 0;                                   // 记录最小成本的分割索引
     Bounds min_leftBounds{}, min_rightBounds{};                   // 记录最小成本的左右子树的包围盒
     size_t min_leftTriangleCount = 0, min_rightTriangleCount = 0; // 记录最小成本的左右子树的三角形数量
-    constexpr size_t bucket_count = 12;
-    std::vector<size_t> triangle_indices_buckets[3][bucket_count] = {}; // 记录每个桶中的三角形索引, 三维数组, 第一维是轴, 第二维是桶, 第三维是三角形索引
 
-    for (size_t axis = 0; axis < 3; axis++) // 遍历三个轴，计算哪一个轴的SAH开销最小
+    BVHBuckets buckets{};
+    auto *primitives = mPrimitives.data() + node->primitives_begin;
+    if (parallelBinning) // 三角形分段并行分桶, 每段各自统计后再合并, 包围盒取最值与顺序无关, 结果与串行一致
     {
-        Bounds bounds_bucket[bucket_count] = {};          // 桶的包围盒
-        size_t triangle_count_buckets[bucket_count] = {}; // 记录每个桶中的三角形数量
-        size_t triangle_idx = 0;
-        for (const auto &triangle : node->mTriangles)
+        constexpr size_t chunk_size = 1 << 14;
+        size_t chunk_count = (node->primitives_count + chunk_size - 1) / chunk_size;
+        std::vector<BVHBuckets> chunk_buckets(chunk_count);
+        threadPool.parallelFor(chunk_count, 1, [&](size_t chunk, size_t)
+                               { fillBuckets(node, primitives, chunk * chunk_size, glm::min((chunk + 1) * chunk_size, node->primitives_count), chunk_buckets[chunk]); }, false);
+        for (const auto &chunk : chunk_buckets)
         {
-            auto triangle_center = (triangle.p0[axis] + triangle.p1[axis] + triangle.p2[axis]) * 0.333333333333f;                                                // 计算三角形的中心坐标
-            size_t bucket_idx = glm::clamp<size_t>(glm::floor((triangle_center - node->bounds.b_min[axis]) * bucket_count / diag[axis]), 0.f, bucket_count - 1); // 计算三角形的桶索引
-            // 拓展桶的包围盒
-            bounds_bucket[bucket_idx].expand(triangle.p0);
-            bounds_bucket[bucket_idx].expand(triangle.p1);
-            bounds_bucket[bucket_idx].expand(triangle.p2);
-
-            triangle_count_buckets[bucket_idx]++;                               // 对应桶中的三角形数量加1
-            triangle_indices_buckets[axis][bucket_idx].push_back(triangle_idx); // 记录三角形索引
-            triangle_idx++;                                                     // 三角形索引加1
+            buckets.merge(chunk);
         }
+    }
+    else
+    {
+        fillBuckets(node, primitives, 0, node->primitives_count, buckets);
+    }
+
+    for (size_t axis = 0; axis < 3; axis++) // 遍历三个轴，计算哪一个轴的SAH开销最小
+    {
+        const auto &bounds_bucket = buckets.bounds[axis];                 // 桶的包围盒
+        const auto &triangle_count_buckets = buckets.triangle_count[axis]; // 记录每个桶中的三角形数量
 
         // 将所有桶按索引视为左右两边
         Bounds leftBounds = bounds_bucket[0];
@@ -173,10 +546,14 @@ void BVH::recursiveSplit(BVHTreeNode *node, BVHState &state)
         }
     }
 
-    if (min_split_index == 0) // 表明不可被分割为两个子节点，认为它是叶子节点
+    if (min_split_index == 0) // 三角形中心都落在同一个桶里, SAH无法分割, 三角形不多时作为叶子, 否则按中位数分割
     {
-        state.addLeafNode(node);
-        return;
+        return medianSplitNode(node, state);
+    }
+    // 不超过一块的三角形只需要一次SIMD测试, 整块作为叶子的开销比分割后分别测试左右孩子更低时不再分割
+    if (node->primitives_count <= BVH_WIDTH && node->bounds.area() * triangle_block_cost <= min_cost)
+    {
+        return false;
     }
 
     auto *leftNode = mAllocator.allocate();
@@ -184,58 +561,84 @@ void BVH::recursiveSplit(BVHTreeNode *node, BVHState &state)
     node->children[0] = leftNode;
     node->children[1] = rightNode;
 
-    // 为左右子节点的三角形列表分配足够的空间, 避免频繁的重新分配
-    leftNode->mTriangles.reserve(min_leftTriangleCount);
-    rightNode->mTriangles.reserve(min_rightTriangleCount);
+    // 原地划分三角形引用, 左边桶的引用放在前面, 右边桶的引用放在后面, 左右子节点各自占据父节点范围的一段
+    auto diag = node->bounds.diagonal();
+    std::partition(primitives, primitives + node->primitives_count, [&](const BVHPrimitive &primitive)
+                   { return bucketIndex(primitive, node->bounds, diag, node->split_axis) < min_split_index; });
+    leftNode->primitives_begin = node->primitives_begin;
+    leftNode->primitives_count = min_leftTriangleCount;
+    rightNode->primitives_begin = node->primitives_begin + min_leftTriangleCount;
+    rightNode->primitives_count = min_rightTriangleCount;
+
+    // 更新孩子节点深度
+    leftNode->depth = node->depth + 1;
+    rightNode->depth = node->depth + 1;
+    // 更新孩子节点的包围盒
+    leftNode->bounds = min_leftBounds;
+    rightNode->bounds = min_rightBounds;
+    return true;
+}
 
-    // 根据桶内的索引初始化左右子节点的三角形列表
-    for (size_t i = 0; i < min_split_index; i++)
+size_t BVH::medianSplit(BVHPrimitive *primitives, size_t count, size_t &split_axis)
+{
+    Bounds center_bounds{};
+    for (size_t i = 0; i < count; i++)
     {
-        for (size_t idx : triangle_indices_buckets[node->split_axis][i])
-        {
-            leftNode->mTriangles.push_back(node->mTriangles[idx]);
-        }
+        center_bounds.expand(primitives[i].center);
     }
-    for (size_t i = min_split_index; i < bucket_count; i++)
+    auto diag = center_bounds.diagonal();
+    split_axis = diag.x > diag.y ? (diag.x > diag.z ? 0 : 2) : (diag.y > diag.z ? 1 : 2);
+    // 中心完全重合时比较结果都相等, nth_element仍然会分成数量相等的两半
+    size_t half = count / 2;
+    std::nth_element(primitives, primitives + half, primitives + count, [axis = split_axis](const BVHPrimitive &a, const BVHPrimitive &b)
+                     { return a.center[axis] < b.center[axis]; });
+    return half;
+}
+
+bool BVH::medianSplitNode(BVHTreeNode *node, BVHState &state)
+{
+    if (node->primitives_count <= BVH_MAX_LEAF_SIZE)
     {
-        for (size_t idx : triangle_indices_buckets[node->split_axis][i])
-        {
-            rightNode->mTriangles.push_back(node->mTriangles[idx]);
-        }
+        return false;
     }
+    state.median_split_count++;
+    auto *primitives = mPrimitives.data() + node->primitives_begin;
+    size_t left_count = medianSplit(primitives, node->primitives_count, node->split_axis);
 
-    // 清空父节点的三角形列表, 因为它已经被分割为两个子节点了, 不需要再存储
-    node->mTriangles.clear();
-    node->mTriangles.shrink_to_fit();
-    // 更新孩子节点深度
+    auto *leftNode = mAllocator.allocate();
+    auto *rightNode = mAllocator.allocate();
+    node->children[0] = leftNode;
+    node->children[1] = rightNode;
+    leftNode->primitives_begin = node->primitives_begin;
+    leftNode->primitives_count = left_count;
+    rightNode->primitives_begin = node->primitives_begin + left_count;
+    rightNode->primitives_count = node->primitives_count - left_count;
     leftNode->depth = node->depth + 1;
     rightNode->depth = node->depth + 1;
-    // 更新孩子节点的包围盒
-    leftNode->bounds = min_leftBounds;
-    rightNode->bounds = min_rightBounds;
-    recursiveSplit(leftNode, state);
-    recursiveSplit(rightNode, state);
+    for (size_t i = 0; i < node->primitives_count; i++)
+    {
+        (i < left_count ? leftNode : rightNode)->bounds.expand(primitives[i].bounds);
+    }
+    return true;
 }
 
-// BVHTreeNode的大小远大于BVHNode, 会使cache miss严重, 深度dfs树形结构(左孩子会与父节点相邻，故父节点只需存储右孩子的索引)，转化为线性结构, 可以减少cache miss.
-size_t BVH::recursiveFlatten(BVHTreeNode *node)
+// BVHTreeNode的大小远大于BVHNode, 会使cache miss严重, 转化为线性结构可以减少cache miss.
+// 两个孩子成对分配, 父节点只存左孩子的索引; 访问一个孩子时它的兄弟也在同一条cache line上, 而遍历几乎总是要测试兄弟
+// 孩子对按深度优先的顺序追加, 父节点的索引总是小于孩子, 一个节点的所有后代在数组中是连续的一段
+void BVH::recursiveFlatten(BVHTreeNode *node, size_t index)
 {
-    BVHNode bvhNode{node->bounds, 0, static_cast<uint16_t>(node->mTriangles.size()), static_cast<uint8_t>(node->split_axis)};
-    auto index = mNodes.size();
-    mNodes.push_back(bvhNode);
-    if (bvhNode.triangles_count == 0) // 如果不是叶子节点, 就递归遍历它的子节点
+    bool is_leaf = node->children[0] == nullptr;
+    mNodes[index] = BVHNode{node->bounds, 0, static_cast<uint16_t>(is_leaf ? node->primitives_count : 0), static_cast<uint8_t>(node->split_axis)};
+    if (!is_leaf) // 如果不是叶子节点, 就在末尾为两个孩子分配相邻的位置, 再递归展平它们
     {
-        recursiveFlatten(node->children[0]);                       // 遍历左孩子，左孩子与父节点相邻，故不需要存储左孩子的索引
-        mNodes[index].child = recursiveFlatten(node->children[1]); // 遍历右孩子，并将右孩子的索引存储在父节点的child字段中
+        size_t child_index = mNodes.size();
+        mNodes.resize(child_index + 2);
+        mNodes[index].child = static_cast<int>(child_index);
+        recursiveFlatten(node->children[0], child_index);
+        recursiveFlatten(node->children[1], child_index + 1);
     }
-    else // 如果是叶子节点
+    else // 如果是叶子节点, 引用数组已经按深度优先的叶子顺序排列, 三角形起始索引就是引用的起始位置
     {
-        mNodes[index].triangles_index = mOrderedTriangles.size(); // 这个节点的三角形起始索引位置就是当前的三角形数量
-        for (const auto &triangle : node->mTriangles)
-        {
-            // 遍历三角形, 并将它们的索引存储在mOrderedTriangles数组中
-            mOrderedTriangles.push_back(triangle);
-        }
+        mNodes[index].triangles_index = node->primitives_begin;
     }
-    return index;
 }
\ No newline at end of file
@@ -1,56 +1,162 @@
 #pragma once
 #include "bounds.hpp"
-#include "../mesh/triangle.hpp"
+#include "../mesh/shape.hpp"
+#include "../mesh/triangleMesh.hpp"
+#include "../../application/spinLock.hpp"
+#include "../until/alignedAllocator.hpp"
+#include "traversalStack.hpp"
 #include <vector>
+#include <filesystem>
+
+// 宽BVH的孩子数量与SIMD宽度一致: 开启AVX时一个节点8个孩子, 否则用SSE一次测试4个孩子
+#if defined(__AVX__)
+#include <immintrin.h>
+#define BVH_WIDE_AVX
+constexpr size_t BVH_WIDTH = 8;
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define BVH_WIDE_SSE
+constexpr size_t BVH_WIDTH = 4;
+#else
+constexpr size_t BVH_WIDTH = 4;
+#endif
+
+// SAH找不到有效分割时, 超过这个数量的三角形不做叶子, 改用中位数分割, 保证叶子的大小有上限
+constexpr size_t BVH_MAX_LEAF_SIZE = 16;
+// SAH分割可能很不均衡, 深度超过这个值后只用中位数分割, 每层数量减半, 树的深度不超过它加上log2(三角形数量)
+constexpr size_t BVH_MAX_SAH_DEPTH = 64;
+
+// 构建时对三角形的引用, 只记录分桶需要的包围盒和中心, 分割时原地划分引用数组而不是拷贝三角形
+struct BVHPrimitive
+{
+    Bounds bounds{};    // 三角形的包围盒
+    glm::vec3 center{}; // 三角形的中心
+    uint32_t index;     // 三角形在输入数组中的索引
+};
 
 struct BVHTreeNode
 {
-    Bounds bounds{};                  // 存储自己的包围盒
-    std::vector<Triangle> mTriangles; // 存储三角形
-    BVHTreeNode *children[2];         // 存储子节点
-    size_t depth;                     // 存储本节点深度
+    Bounds bounds{};                   // 存储自己的包围盒
+    size_t primitives_begin{};         // 节点的三角形引用在引用数组中的起始位置
+    size_t primitives_count{};         // 节点的三角形引用数量
+    BVHTreeNode *children[2]{};        // 存储子节点, 叶子节点为空
+    size_t depth;                      // 存储本节点深度
     size_t split_axis;
-
-    void updateBounds()
-    {
-        bounds = {};
-        for (const auto &triangle : mTriangles)
-        {
-            bounds.expand(triangle.getBounds());
-        }
-    }
 };
 
 // 尽可能的减小这个结构体的大小，使得在递归过程中能提高cache的命中率
+// 两个孩子在数组中成对相邻, 数组按64字节对齐, 每对孩子正好占一条cache line
 struct alignas(32) BVHNode
 {
     Bounds bounds{};
 
     union
     {
-        int child;           // 只有非叶子节点才用这个
-        int triangles_index; // 只有叶子节点才用这个
+        int child;           // 只有非叶子节点才用这个, 左孩子的索引, 右孩子紧跟在左孩子之后
+        int triangles_index; // 只有叶子节点才用这个, 构建完成后为叶子第一个三角形块的索引
     };
     uint16_t triangles_count; // 记录三角形的索引和数量在数组中定位该节点的三角形
     uint8_t split_axis;       // 记录分割轴xyz
 };
 
+// 把二叉树折叠成多叉树, 孩子的包围盒按SoA存储, 遍历时一次SIMD测试所有孩子
+struct alignas(32) BVHWideNode
+{
+    float b_min[3][BVH_WIDTH];           // 孩子包围盒的最小点, 第一维是轴, 第二维是孩子
+    float b_max[3][BVH_WIDTH];           // 孩子包围盒的最大点, 空的孩子是一个退化的包围盒, 不会被射线命中
+    int child[BVH_WIDTH];                // 内部孩子为宽节点的索引, 叶子孩子为三角形块的起始索引
+    uint16_t triangles_count[BVH_WIDTH]; // 叶子孩子的三角形数量, 为0表示内部孩子
+};
+
+// 压缩宽节点: 孩子包围盒相对于节点包围盒量化为8位, 量化时最小点向下取整、最大点向上取整, 保证包围盒只会变大
+// 量化步长取2的整数次幂, 反量化 origin + q * 2^exponent 中的乘法没有舍入误差, 每个孩子不超过16字节
+struct alignas(16) BVHCompressedNode
+{
+    glm::vec3 origin;                    // 节点包围盒的最小点
+    int8_t exponent[3];                  // 每个轴的量化步长为2^exponent
+    uint8_t children_count;              // 有效孩子的数量, 其余孩子不参与相交测试
+    uint8_t q_min[3][BVH_WIDTH];         // 量化后的孩子包围盒最小点
+    uint8_t q_max[3][BVH_WIDTH];         // 量化后的孩子包围盒最大点
+    int child[BVH_WIDTH];                // 与BVHWideNode相同
+    uint16_t triangles_count[BVH_WIDTH]; // 与BVHWideNode相同
+};
+static_assert(sizeof(BVHCompressedNode) <= 16 * BVH_WIDTH, "compressed node should not exceed 16 bytes per child");
+
+// 叶子的三角形每BVH_WIDTH个打包成一块, 按SoA存储顶点p0和预先算好的两条边, 一次SIMD测试整块三角形
+// 叶子的最后一块可能不满, 多余的位置边为0, 行列式为0不会被命中
+struct alignas(32) BVHTriangleBlock
+{
+    float p0[3][BVH_WIDTH];   // 第一个顶点, 第一维是轴, 第二维是块内的三角形
+    float e0[3][BVH_WIDTH];   // p1 - p0
+    float e1[3][BVH_WIDTH];   // p2 - p0
+    uint32_t triangles_index; // 块内第一个三角形在网格中的索引, 块内的三角形是连续的
+};
+
+// 射线与叶子中连续的triangles_count个三角形(从blocks开始的若干块)求交, 找到比t_max更近的交点时更新t_max和hit并返回true
+// hit只记录距离、重心坐标和三角形索引, 遍历结束后才由BVH::resolveHit计算交点位置和插值法线
+bool intersectTriangleBlocks(const BVHTriangleBlock *blocks, size_t triangles_count, const Ray &ray, float t_min, float &t_max, HitRecord &hit);
+// 只判断叶子中是否有三角形在(t_min, t_max)内相交, 找到一个就返回true
+bool occludedTriangleBlocks(const BVHTriangleBlock *blocks, size_t triangles_count, const Ray &ray, float t_min, float t_max);
+
+enum class BVHLayout
+{
+    Binary,     // 二叉节点, 按射线方向决定先访问哪个孩子
+    Wide,       // BVH_WIDTH叉节点, 命中的孩子按距离排序后入栈
+    Compressed, // 与Wide相同的树, 孩子包围盒量化为8位, 节点内存约为Wide的四分之一
+};
+
+enum class BVHBuildStrategy
+{
+    SAH,        // 按三角形中心分桶的SAH, 每个三角形只属于一个叶子
+    SpatialSAH, // SBVH: 同时考虑用平面切开三角形的空间分割, 三角形可以被复制到多个叶子, 以更慢的构建换取更少的重叠
+    LBVH,       // 按三角形中心的Morton码排序后按位划分, 构建最快, 树的质量不如SAH
+    HLBVH,      // 与LBVH相同, 但Morton码前缀相同的小树之上的顶层用SAH构建
+};
+
+struct BVHBuildOptions
+{
+    bool parallel{true};                             // 顶层节点并行分桶, 子树作为任务提交给全局线程池并行构建, 展平后的mNodes与串行构建完全一致
+    BVHLayout layout{BVHLayout::Binary};             // 遍历时使用的节点布局
+    BVHBuildStrategy strategy{BVHBuildStrategy::SAH}; // 建树策略, SpatialSAH总是串行构建
+    float spatial_split_budget{0.3f};                // SBVH最多允许复制的引用数量占三角形数量的比例
+    float refit_rebuild_threshold{1.5f};             // refit后树的SAH开销超过构建时的该倍数就重新构建
+    bool disk_cache{true};                           // 从文件加载模型时把构建结果缓存到模型旁边的.bvhcache文件, 源文件不变时跳过解析和构建
+    // 只对Model有效: 加载时只计算网格的包围盒, 第一条到达模型包围盒的光线才构建BVH, 看不到的模型不花构建时间
+    // 构建只提交一次给线程池, 到达的渲染线程等待时执行线程池中的任务, 构建本身仍可并行; 磁盘缓存命中时仍然直接加载
+    bool lazy{false};
+};
+
 struct BVHState // BVH构建状态
 {
     size_t total_node_count{};             // 总节点数
     size_t leaf_node_count{};              // 叶子节点数
     size_t max_leaf_node_triangle_count{}; // 最大叶子节点三角形数
     size_t max_leaf_node_depth{};          // 最大叶子节点深度
+    size_t spatial_split_count{};          // SBVH中空间分割的次数
+    size_t median_split_count{};           // SAH失败或者树太深时退回中位数分割的次数
+    size_t spatial_split_budget{};         // SBVH中还允许复制的引用数量
+    float spatial_split_overlap{};         // 对象分割的左右包围盒重叠面积超过该值才尝试空间分割
 
     void addLeafNode(BVHTreeNode *node) // 更新叶子节点信息
     {
         leaf_node_count++;                                                                              // 叶子节点数加1
-        max_leaf_node_triangle_count = glm::max(max_leaf_node_triangle_count, node->mTriangles.size()); // 更新最大叶子节点三角形数
+        max_leaf_node_triangle_count = glm::max(max_leaf_node_triangle_count, node->primitives_count); // 更新最大叶子节点三角形数
         max_leaf_node_depth = glm::max(max_leaf_node_depth, node->depth);                               // 更新最大叶子节点深度
     }
+
+    void merge(const BVHState &other) // 合并并行构建时各个子树任务的统计信息
+    {
+        total_node_count += other.total_node_count;
+        leaf_node_count += other.leaf_node_count;
+        max_leaf_node_triangle_count = glm::max(max_leaf_node_triangle_count, other.max_leaf_node_triangle_count);
+        max_leaf_node_depth = glm::max(max_leaf_node_depth, other.max_leaf_node_depth);
+        spatial_split_count += other.spatial_split_count;
+        median_split_count += other.median_split_count;
+    }
 };
 
 // 如果每一个节点都在建树时new就会有巨大的开销，提前将内存池分配好，避免频繁的new和delete
+// 并行构建时多个子树任务会同时申请节点，用自旋锁保护内存池
 struct BVHTreeNodeAllcator
 {
 public:
@@ -58,6 +164,7 @@ public:
     BVHTreeNodeAllcator() : ptr(4096) {}
     BVHTreeNode *allocate()
     {
+        Guard guard(mSpinLock);
         // 检查当前内存块是否已分配完 4096 个节点
         if (ptr == 4096)
         {
@@ -69,33 +176,82 @@ public:
         // 返回当前内存块中第 ptr 个 BVHTreeNode 对象的地址，并将 ptr 加 1
         return &nodes_list.back()[ptr++];
     }
-    ~BVHTreeNodeAllcator()
+    ~BVHTreeNodeAllcator() { clear(); }
+
+    // 展平后树形结构就不再需要了, 释放所有内存块
+    void clear()
     {
+        Guard guard(mSpinLock);
         for (auto *nodes : nodes_list)
         {
             delete[] nodes;
         }
         nodes_list.clear();
+        nodes_list.shrink_to_fit();
+        ptr = 4096;
     }
 
 private:
     size_t ptr;
     std::vector<BVHTreeNode *> nodes_list; // 存储一块块的内存块，每块4096
+    SpinLock mSpinLock{};
 };
 
+class BVHBuildTask;
+
 class BVH : public Shape
 {
 public:
-    void build(std::vector<Triangle> &&triangles);
-    std::optional<HitInfo> intersect(const Ray &ray, float t_min, float t_max) const override;
+    void build(TriangleMesh &&mesh, const BVHBuildOptions &options = {}); // 构建时按叶子的顺序重排网格的三角形索引, 网格由BVH持有
+    bool intersectRecord(const Ray &ray, float t_min, float &t_max, HitRecord &record) const override { return intersectNode(0, ray, t_min, t_max, record); }
+    HitInfo resolveHit(const Ray &ray, const HitRecord &record) const override; // 由最近交点的重心坐标计算交点位置和插值法线
+    bool occluded(const Ray &ray, float t_min, float t_max) const override { return occludedNode(0, ray, t_min, t_max); }
+    uint32_t intersectPacket(RayPacket &packet, HitRecord *records) const override { return intersectPacketNode(0, packet, records); } // 只有Binary布局按包遍历
     Bounds getBounds() const override { return mNodes[0].bounds; }
+    // 实例重编时节点编号就是二叉节点的索引, 只有Binary布局可以打开; 其它布局从根节点以外的节点开始时按二叉节点遍历
+    bool getNodeChildren(uint32_t node, uint32_t children[2]) const override;
+    Bounds getNodeBounds(uint32_t node) const override { return mNodes[node].bounds; }
+    uint32_t getNodeGeneration() const override { return mGeneration; } // 每次构建或者从缓存加载都会改变
+    bool intersectNode(uint32_t node, const Ray &ray, float t_min, float &t_max, HitRecord &record) const override;
+    bool occludedNode(uint32_t node, const Ray &ray, float t_min, float t_max) const override;
+    uint32_t intersectPacketNode(uint32_t node, RayPacket &packet, HitRecord *records) const override;
+    const BVHState &getBuildState() const { return mBuildState; } // 最近一次构建的统计信息, 从缓存加载时只有最大深度
+    // 顶点移动后(顶点数量和三角形不变)自底向上更新包围盒, normals为空时保留原来的法线
+    // 返回true表示树的质量下降太多, 已经重新构建, 节点的编号随之改变
+    bool refit(const std::vector<glm::vec3> &positions, const std::vector<glm::vec3> &normals = {});
+    // 磁盘缓存保存展平后的节点、三角形块和重排后的网格, content_hash是源文件内容的哈希
+    // 缓存的版本、SIMD宽度、源文件或构建参数与当前不一致时加载失败, 返回false
+    bool loadCache(const std::filesystem::path &path, uint64_t content_hash, const BVHBuildOptions &options);
+    void saveCache(const std::filesystem::path &path, uint64_t content_hash) const;
 
 private:
-    void recursiveSplit(BVHTreeNode *node, BVHState &state);
-    size_t recursiveFlatten(BVHTreeNode *node);
+    friend class BVHBuildTask;
+    bool splitNode(BVHTreeNode *node, bool parallelBinning, BVHState &state); // 用SAH分割节点, 返回false表示该节点为叶子节点
+    void parallelSplit(BVHTreeNode *root, BVHState &state);
+    void recursiveSplit(BVHTreeNode *node, BVHState &state, const BVHBuildTask *task = nullptr); // task不为空时, 较大的子树会作为新任务提交
+    static size_t medianSplit(BVHPrimitive *primitives, size_t count, size_t &split_axis); // 沿中心分布最长的轴按中位数划分, 返回左边的数量
+    bool medianSplitNode(BVHTreeNode *node, BVHState &state); // SAH失败时的退路, 三角形不超过BVH_MAX_LEAF_SIZE时返回false作为叶子
+    // SBVH的分割, 每个节点持有自己的引用数组, 叶子的引用按深度优先的顺序追加到mPrimitives
+    void recursiveSpatialSplit(BVHTreeNode *node, std::vector<BVHPrimitive> &&references, const TriangleMesh &mesh, BVHState &state);
+    void buildLBVH(BVHTreeNode *root, BVHState &state, bool sahUpperLevels, bool parallel); // 构建Morton码排序后的树, sahUpperLevels为true时顶层用SAH
+    void recursiveFlatten(BVHTreeNode *node, size_t index); // 把节点写到mNodes[index], 孩子成对追加到mNodes末尾
+    size_t recursiveCollapse(size_t node_index); // 从展平后的二叉节点构建宽节点, 返回宽节点的索引
+    void compressWideNodes();                    // 将宽节点量化为压缩宽节点, 完成后释放宽节点
+    void buildTriangleBlocks();                  // 把每个叶子的三角形打包成三角形块, 叶子的triangles_index改为第一块的索引
+    void buildWideNodes();                       // 按布局从二叉节点重新生成宽节点或压缩宽节点
+    bool intersectRecordWide(const Ray &ray, float t_min, float &t_max, HitRecord &record) const;
+    bool occludedWide(const Ray &ray, float t_min, float t_max) const;
 
 private:
+    BVHBuildOptions mOptions{}; // 构建时的参数, refit触发重新构建时沿用
+    float mBuildSAHCost{};      // 构建完成时树的SAH开销
+    uint32_t mGeneration{};     // 节点编号的版本, 每次替换mNodes时增加
+    BVHState mBuildState{};     // 构建的统计信息, 遍历栈的大小由其中的最大深度决定
     BVHTreeNodeAllcator mAllocator{};
-    std::vector<BVHNode> mNodes;             // 将BVHTreeNode转化为BVHNode, 减少内存占用，从树形结构转化为线性结构
-    std::vector<Triangle> mOrderedTriangles; // 总三角形数组，用于存储所有三角形，方便快速访问
+    std::vector<BVHPrimitive> mPrimitives;   // 构建时的三角形引用数组, 构建完成后释放
+    std::vector<BVHNode, AlignedAllocator<BVHNode, 64>> mNodes; // 将BVHTreeNode转化为BVHNode, 减少内存占用，从树形结构转化为线性结构
+    std::vector<BVHWideNode> mWideNodes;             // 宽BVH的节点, 只在Wide布局下保留
+    std::vector<BVHCompressedNode> mCompressedNodes; // 压缩宽BVH的节点, 只在Compressed布局下构建
+    std::vector<BVHTriangleBlock> mTriangleBlocks;   // 叶子的三角形块, 相交测试只访问它
+    TriangleMesh mMesh;                              // 三角形索引按叶子的顺序排列, 只在计算最近交点的法线时访问
 };
\ No newline at end of file
@@ -0,0 +1,165 @@
+#include "bvh.hpp"
+#include "../until/mappedFile.hpp"
+#include "../until/hash.hpp"
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#pragma warning(push)
+#pragma warning(disable : 4267)
+#pragma warning(disable : 4244)
+
+// 缓存文件的格式版本, 节点、三角形块或者构建算法改变导致结果不同时加1, 旧的缓存会自动失效
+static constexpr uint32_t bvh_cache_version = 3;
+static constexpr char bvh_cache_magic[8] = {'C', 'R', 'Y', 'S', 'B', 'V', 'H', '\0'};
+static constexpr size_t bvh_cache_alignment = 64; // 每个数组在文件中按缓存行对齐
+
+struct BVHCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t width;      // BVH_WIDTH, 决定三角形块的大小和叶子的三角形数量
+    uint32_t node_size;  // sizeof(BVHNode)
+    uint32_t block_size; // sizeof(BVHTriangleBlock)
+    uint64_t key;        // 源文件内容和构建参数的哈希
+    uint64_t node_count;
+    uint64_t block_count;
+    uint64_t vertex_count;
+    uint64_t triangle_count;
+    float sah_cost;
+    uint32_t max_depth; // 树的最大深度, 决定遍历栈的大小
+};
+
+static size_t alignOffset(size_t offset)
+{
+    return (offset + bvh_cache_alignment - 1) / bvh_cache_alignment * bvh_cache_alignment;
+}
+
+// 布局不影响二叉节点和三角形块, 加载后再生成宽节点, 同一份缓存可以给所有布局使用
+// 并行与串行构建的结果完全一致, 也不参与计算
+static uint64_t cacheKey(uint64_t content_hash, const BVHBuildOptions &options)
+{
+    uint64_t key = hashCombine(content_hash, bvh_cache_version);
+    key = hashCombine(key, static_cast<uint64_t>(options.strategy));
+    uint32_t budget;
+    std::memcpy(&budget, &options.spatial_split_budget, sizeof(budget));
+    return hashCombine(key, budget);
+}
+
+// 依次计算各个数组在文件中的偏移, 写入和读取共用, 返回文件的总大小
+static size_t cacheLayout(const BVHCacheHeader &header, size_t offsets[5])
+{
+    size_t sizes[5] = {
+        header.node_count * sizeof(BVHNode),
+        header.block_count * sizeof(BVHTriangleBlock),
+        header.vertex_count * sizeof(glm::vec3),
+        header.vertex_count * sizeof(glm::vec3),
+        header.triangle_count * sizeof(glm::uvec3),
+    };
+    size_t offset = sizeof(BVHCacheHeader);
+    for (size_t i = 0; i < 5; i++)
+    {
+        offsets[i] = alignOffset(offset);
+        offset = offsets[i] + sizes[i];
+    }
+    return offset;
+}
+
+template <typename Vector>
+static void copyArray(Vector &dst, const std::byte *src, size_t count)
+{
+    dst.resize(count);
+    std::memcpy(dst.data(), src, count * sizeof(typename Vector::value_type));
+}
+
+bool BVH::loadCache(const std::filesystem::path &path, uint64_t content_hash, const BVHBuildOptions &options)
+{
+    MappedFile file;
+    if (!file.open(path) || file.size() < sizeof(BVHCacheHeader))
+    {
+        return false;
+    }
+    BVHCacheHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, bvh_cache_magic, sizeof(bvh_cache_magic)) != 0 ||
+        header.version != bvh_cache_version ||
+        header.width != BVH_WIDTH ||
+        header.node_size != sizeof(BVHNode) ||
+        header.block_size != sizeof(BVHTriangleBlock) ||
+        header.key != cacheKey(content_hash, options) ||
+        header.node_count == 0)
+    {
+        return false;
+    }
+    size_t offsets[5];
+    if (cacheLayout(header, offsets) != file.size()) // 写入中断的文件大小对不上
+    {
+        return false;
+    }
+
+    mGeneration++;
+    mOptions = options;
+    mBuildSAHCost = header.sah_cost;
+    mBuildState = BVHState{};
+    mBuildState.max_leaf_node_depth = header.max_depth;
+    copyArray(mNodes, file.data() + offsets[0], header.node_count);
+    copyArray(mTriangleBlocks, file.data() + offsets[1], header.block_count);
+    copyArray(mMesh.positions, file.data() + offsets[2], header.vertex_count);
+    copyArray(mMesh.normals, file.data() + offsets[3], header.vertex_count);
+    copyArray(mMesh.indices, file.data() + offsets[4], header.triangle_count);
+    buildWideNodes();
+    return true;
+}
+
+void BVH::saveCache(const std::filesystem::path &path, uint64_t content_hash) const
+{
+    BVHCacheHeader header{};
+    std::memcpy(header.magic, bvh_cache_magic, sizeof(bvh_cache_magic));
+    header.version = bvh_cache_version;
+    header.width = BVH_WIDTH;
+    header.node_size = sizeof(BVHNode);
+    header.block_size = sizeof(BVHTriangleBlock);
+    header.key = cacheKey(content_hash, mOptions);
+    header.node_count = mNodes.size();
+    header.block_count = mTriangleBlocks.size();
+    header.vertex_count = mMesh.positions.size();
+    header.triangle_count = mMesh.indices.size();
+    header.sah_cost = mBuildSAHCost;
+    header.max_depth = static_cast<uint32_t>(mBuildState.max_leaf_node_depth);
+    size_t offsets[5];
+    cacheLayout(header, offsets);
+
+    // 先写到临时文件再改名, 其他进程同时加载时不会读到写了一半的文件
+    auto temp_path = path;
+    temp_path += ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            std::cerr << "Failed to write BVH cache: " << path << std::endl;
+            return;
+        }
+        auto write = [&](size_t offset, const void *data, size_t size)
+        {
+            static const char padding[bvh_cache_alignment]{};
+            out.write(padding, offset - static_cast<size_t>(out.tellp()));
+            out.write(static_cast<const char *>(data), size);
+        };
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        write(offsets[0], mNodes.data(), mNodes.size() * sizeof(BVHNode));
+        write(offsets[1], mTriangleBlocks.data(), mTriangleBlocks.size() * sizeof(BVHTriangleBlock));
+        write(offsets[2], mMesh.positions.data(), mMesh.positions.size() * sizeof(glm::vec3));
+        write(offsets[3], mMesh.normals.data(), mMesh.normals.size() * sizeof(glm::vec3));
+        write(offsets[4], mMesh.indices.data(), mMesh.indices.size() * sizeof(glm::uvec3));
+        if (!out)
+        {
+            std::cerr << "Failed to write BVH cache: " << path << std::endl;
+            return;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temp_path, path, error);
+    if (error)
+    {
+        std::filesystem::remove(temp_path, error);
+    }
+}
@@ -0,0 +1,402 @@
+#include "bvh.hpp"
+#include <array>
+#include <algorithm>
+#include "../../application/threadPool.hpp"
+#pragma warning(push)
+#pragma warning(disable : 4267)
+#pragma warning(disable : 4244)
+
+static constexpr int morton_bits = 63;                // 每个轴量化为21位, 交错成63位的Morton码
+static constexpr int treelet_bits = 12;               // Morton码最高12位相同的三角形组成一棵小树(treelet), 即每个轴16个格子
+static constexpr size_t lbvh_leaf_size = BVH_WIDTH;   // 三角形数量不超过一块就作为叶子, 不再按Morton码继续划分
+static constexpr size_t morton_chunk_size = 1 << 16;  // 计算Morton码、基数排序时每个任务处理的三角形数量
+static constexpr size_t radix_bits = 8;               // 基数排序每一趟处理8位
+static constexpr size_t radix_bucket_count = 1 << radix_bits;
+static constexpr size_t sah_bucket_count = 12;
+
+struct MortonPrimitive
+{
+    uint64_t code;  // 三角形中心的Morton码
+    uint32_t index; // 三角形引用在mPrimitives中的索引
+};
+
+struct LBVHTreelet
+{
+    size_t primitives_begin{}; // 小树的三角形引用在排序后引用数组中的起始位置
+    size_t primitives_count{};
+    uint64_t prefix{};         // Morton码的最高treelet_bits位
+    Bounds bounds{};
+    glm::vec3 center{};
+    BVHTreeNode *node{};       // 顶层构建完成后小树根节点的位置
+};
+
+// Morton码的第bit位对应的轴, 最低位是z, 依次向上为y、x
+static size_t mortonAxis(int bit)
+{
+    return 2 - bit % 3;
+}
+
+// 把21位整数的每一位之间插入两个0
+static uint64_t expandBits(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffff;
+    v = (v | v << 16) & 0x1f0000ff0000ff;
+    v = (v | v << 8) & 0x100f00f00f00f00f;
+    v = (v | v << 4) & 0x10c30c30c30c30c3;
+    v = (v | v << 2) & 0x1249249249249249;
+    return v;
+}
+
+// 并行构建时按段提交给线程池, 否则在当前线程依次执行
+template <typename F>
+static void forEachChunk(bool parallel, size_t chunk_count, const F &lambda)
+{
+    if (!parallel)
+    {
+        for (size_t chunk = 0; chunk < chunk_count; chunk++)
+        {
+            lambda(chunk);
+        }
+        return;
+    }
+    threadPool.parallelFor(chunk_count, 1, [&](size_t chunk, size_t)
+                           { lambda(chunk); }, false);
+}
+
+// 低位优先的基数排序, 每一趟先分段统计直方图, 再按(数字, 段)的顺序求前缀和后分段写入, 排序是稳定的
+// 所有三角形在这一趟的数字都相同时跳过这一趟, Morton码的高位常常如此
+static void radixSort(std::vector<MortonPrimitive> &primitives, bool parallel)
+{
+    size_t count = primitives.size();
+    size_t chunk_count = (count + morton_chunk_size - 1) / morton_chunk_size;
+    std::vector<MortonPrimitive> temp(count);
+    std::vector<std::array<size_t, radix_bucket_count>> offsets(chunk_count);
+    for (size_t shift = 0; shift < morton_bits; shift += radix_bits)
+    {
+        forEachChunk(parallel, chunk_count, [&](size_t chunk)
+                     {
+                         auto &histogram = offsets[chunk];
+                         histogram.fill(0);
+                         for (size_t i = chunk * morton_chunk_size; i < glm::min((chunk + 1) * morton_chunk_size, count); i++)
+                         {
+                             histogram[(primitives[i].code >> shift) & (radix_bucket_count - 1)]++;
+                         } });
+
+        bool skip = false;
+        size_t sum = 0;
+        for (size_t digit = 0; digit < radix_bucket_count; digit++)
+        {
+            size_t digit_count = 0;
+            for (size_t chunk = 0; chunk < chunk_count; chunk++)
+            {
+                size_t chunk_digit_count = offsets[chunk][digit];
+                offsets[chunk][digit] = sum;
+                sum += chunk_digit_count;
+                digit_count += chunk_digit_count;
+            }
+            skip |= digit_count == count;
+        }
+        if (skip)
+        {
+            continue;
+        }
+
+        forEachChunk(parallel, chunk_count, [&](size_t chunk)
+                     {
+                         auto &offset = offsets[chunk];
+                         for (size_t i = chunk * morton_chunk_size; i < glm::min((chunk + 1) * morton_chunk_size, count); i++)
+                         {
+                             temp[offset[(primitives[i].code >> shift) & (radix_bucket_count - 1)]++] = primitives[i];
+                         } });
+        primitives.swap(temp);
+    }
+}
+
+// 把单棵小树放到顶层为它准备的节点上, 小树内部的节点由recursiveMortonSplit计数
+static void placeTreelet(BVHTreeNode *node, LBVHTreelet &treelet)
+{
+    treelet.node = node;
+    node->primitives_begin = treelet.primitives_begin;
+    node->primitives_count = treelet.primitives_count;
+    node->bounds = treelet.bounds;
+}
+
+static void allocateChildren(BVHTreeNodeAllcator &allocator, BVHTreeNode *node)
+{
+    node->children[0] = allocator.allocate();
+    node->children[1] = allocator.allocate();
+    node->children[0]->depth = node->depth + 1;
+    node->children[1]->depth = node->depth + 1;
+}
+
+// 没有小树(空网格)时节点是一个空的叶子, 与SAH构建空网格的结果相同
+static void emptyLeaf(BVHTreeNode *node, BVHState &state)
+{
+    state.total_node_count++;
+    node->bounds = Bounds{};
+    node->primitives_begin = 0;
+    node->primitives_count = 0;
+    state.addLeafNode(node);
+}
+
+// 顶层按小树Morton码前缀的最高不同位划分, 与小树内部的划分方式相同
+static void emitMortonUpperLevels(BVHTreeNodeAllcator &allocator, BVHTreeNode *node, LBVHTreelet *treelets, size_t count, int bit, BVHState &state)
+{
+    if (count == 0)
+    {
+        emptyLeaf(node, state);
+        return;
+    }
+    if (count == 1)
+    {
+        placeTreelet(node, treelets[0]);
+        return;
+    }
+    state.total_node_count++;
+    // 小树的前缀互不相同且有序, 总能找到首尾不同的位
+    while (((treelets[0].prefix ^ treelets[count - 1].prefix) >> bit & 1) == 0)
+    {
+        bit--;
+    }
+    size_t split = std::partition_point(treelets, treelets + count, [&](const LBVHTreelet &treelet)
+                                        { return (treelet.prefix >> bit & 1) == 0; }) -
+                   treelets;
+    node->split_axis = mortonAxis(bit + morton_bits - treelet_bits);
+    allocateChildren(allocator, node);
+    emitMortonUpperLevels(allocator, node->children[0], treelets, split, bit - 1, state);
+    emitMortonUpperLevels(allocator, node->children[1], treelets + split, count - split, bit - 1, state);
+    node->bounds = node->children[0]->bounds;
+    node->bounds.expand(node->children[1]->bounds);
+}
+
+// HLBVH: 小树的数量很少(最多4096棵), 顶层用按小树中心分桶的SAH构建, 改善Morton码划分在顶层的质量
+static void emitSAHUpperLevels(BVHTreeNodeAllcator &allocator, BVHTreeNode *node, LBVHTreelet *treelets, size_t count, BVHState &state)
+{
+    if (count == 0)
+    {
+        emptyLeaf(node, state);
+        return;
+    }
+    if (count == 1)
+    {
+        placeTreelet(node, treelets[0]);
+        return;
+    }
+    state.total_node_count++;
+    Bounds center_bounds{};
+    for (size_t i = 0; i < count; i++)
+    {
+        center_bounds.expand(treelets[i].center);
+    }
+    auto diag = center_bounds.diagonal();
+    auto bucketIndex = [&](const LBVHTreelet &treelet, size_t axis)
+    { return glm::clamp<size_t>(glm::floor((treelet.center[axis] - center_bounds.b_min[axis]) * sah_bucket_count / diag[axis]), 0.f, sah_bucket_count - 1); };
+
+    float min_cost = std::numeric_limits<float>::infinity();
+    size_t min_split_index = 0;
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        if (diag[axis] <= 0.f)
+        {
+            continue;
+        }
+        Bounds bounds_bucket[sah_bucket_count] = {};
+        size_t count_bucket[sah_bucket_count] = {};
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t bucket_idx = bucketIndex(treelets[i], axis);
+            bounds_bucket[bucket_idx].expand(treelets[i].bounds);
+            count_bucket[bucket_idx] += treelets[i].primitives_count;
+        }
+        Bounds leftBounds{};
+        size_t leftCount = 0;
+        for (size_t i = 1; i < sah_bucket_count; i++)
+        {
+            leftBounds.expand(bounds_bucket[i - 1]);
+            leftCount += count_bucket[i - 1];
+            Bounds rightBounds{};
+            size_t rightCount = 0;
+            for (size_t j = i; j < sah_bucket_count; j++)
+            {
+                rightBounds.expand(bounds_bucket[j]);
+                rightCount += count_bucket[j];
+            }
+            if (leftCount == 0 || rightCount == 0)
+            {
+                continue;
+            }
+            float cost = leftBounds.area() * static_cast<float>(leftCount) + rightBounds.area() * static_cast<float>(rightCount);
+            if (cost < min_cost)
+            {
+                min_cost = cost;
+                node->split_axis = axis;
+                min_split_index = i;
+            }
+        }
+    }
+
+    size_t split = 0;
+    if (min_split_index == 0) // 小树中心无法分桶, 沿最长轴从中间分开
+    {
+        node->split_axis = diag.x > diag.y ? (diag.x > diag.z ? 0 : 2) : (diag.y > diag.z ? 1 : 2);
+        split = count / 2;
+        std::nth_element(treelets, treelets + split, treelets + count, [&](const LBVHTreelet &a, const LBVHTreelet &b)
+                         { return a.center[node->split_axis] < b.center[node->split_axis]; });
+    }
+    else
+    {
+        split = std::partition(treelets, treelets + count, [&](const LBVHTreelet &treelet)
+                               { return bucketIndex(treelet, node->split_axis) < min_split_index; }) -
+                treelets;
+    }
+    allocateChildren(allocator, node);
+    emitSAHUpperLevels(allocator, node->children[0], treelets, split, state);
+    emitSAHUpperLevels(allocator, node->children[1], treelets + split, count - split, state);
+    node->bounds = node->children[0]->bounds;
+    node->bounds.expand(node->children[1]->bounds);
+}
+
+// 小树内部: 有序的Morton码区间按最高的不同位一分为二, 包围盒在子节点完成后自底向上合并
+static void recursiveMortonSplit(BVHTreeNodeAllcator &allocator, BVHTreeNode *node, const BVHPrimitive *primitives, const uint64_t *codes, int bit, BVHState &state)
+{
+    state.total_node_count++;
+    size_t begin = node->primitives_begin, end = node->primitives_begin + node->primitives_count;
+    if (node->primitives_count <= lbvh_leaf_size) // Morton码最多63位, 加上码相同时的中位数分割, 深度总是有限的
+    {
+        node->bounds = Bounds{};
+        for (size_t i = begin; i < end; i++)
+        {
+            node->bounds.expand(primitives[i].bounds);
+        }
+        state.addLeafNode(node);
+        return;
+    }
+
+    // 区间是有序的, 首尾的Morton码在某一位相同则整个区间在这一位都相同
+    while (bit >= 0 && ((codes[begin] ^ codes[end - 1]) >> bit & 1) == 0)
+    {
+        bit--;
+    }
+    size_t split = 0;
+    if (bit < 0) // Morton码完全相同(三角形中心重合或量化到同一个格子), 从中间分开
+    {
+        split = begin + node->primitives_count / 2;
+        node->split_axis = 0;
+        state.median_split_count++;
+    }
+    else
+    {
+        split = std::partition_point(codes + begin, codes + end, [&](uint64_t code)
+                                     { return (code >> bit & 1) == 0; }) -
+                codes;
+        node->split_axis = mortonAxis(bit);
+    }
+    allocateChildren(allocator, node);
+    node->children[0]->primitives_begin = begin;
+    node->children[0]->primitives_count = split - begin;
+    node->children[1]->primitives_begin = split;
+    node->children[1]->primitives_count = end - split;
+    recursiveMortonSplit(allocator, node->children[0], primitives, codes, bit - 1, state);
+    recursiveMortonSplit(allocator, node->children[1], primitives, codes, bit - 1, state);
+    node->bounds = node->children[0]->bounds;
+    node->bounds.expand(node->children[1]->bounds);
+}
+
+void BVH::buildLBVH(BVHTreeNode *root, BVHState &state, bool sahUpperLevels, bool parallel)
+{
+    size_t count = mPrimitives.size();
+    if (count == 0)
+    {
+        emptyLeaf(root, state);
+        return;
+    }
+    size_t chunk_count = (count + morton_chunk_size - 1) / morton_chunk_size;
+
+    // 用三角形中心的包围盒而不是三角形的包围盒量化, 每个轴的21位都能用满
+    Bounds center_bounds{};
+    for (const auto &primitive : mPrimitives)
+    {
+        center_bounds.expand(primitive.center);
+    }
+    auto diag = center_bounds.diagonal();
+    glm::vec3 scale{};
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        scale[axis] = diag[axis] > 0.f ? static_cast<float>((1 << 21) - 1) / diag[axis] : 0.f;
+    }
+
+    std::vector<MortonPrimitive> morton_primitives(count);
+    forEachChunk(parallel, chunk_count, [&](size_t chunk)
+                 {
+                     for (size_t i = chunk * morton_chunk_size; i < glm::min((chunk + 1) * morton_chunk_size, count); i++)
+                     {
+                         auto grid = glm::clamp((mPrimitives[i].center - center_bounds.b_min) * scale, glm::vec3(0.f), glm::vec3((1 << 21) - 1));
+                         uint64_t code = (expandBits(static_cast<uint64_t>(grid.x)) << 2) | (expandBits(static_cast<uint64_t>(grid.y)) << 1) | expandBits(static_cast<uint64_t>(grid.z));
+                         morton_primitives[i] = {code, static_cast<uint32_t>(i)};
+                     } });
+    radixSort(morton_primitives, parallel);
+
+    // 引用数组按Morton码重排, 之后每个节点都是排序后数组中连续的一段
+    std::vector<BVHPrimitive> sorted_primitives(count);
+    std::vector<uint64_t> codes(count);
+    forEachChunk(parallel, chunk_count, [&](size_t chunk)
+                 {
+                     for (size_t i = chunk * morton_chunk_size; i < glm::min((chunk + 1) * morton_chunk_size, count); i++)
+                     {
+                         sorted_primitives[i] = mPrimitives[morton_primitives[i].index];
+                         codes[i] = morton_primitives[i].code;
+                     } });
+    mPrimitives.swap(sorted_primitives);
+    std::vector<BVHPrimitive>().swap(sorted_primitives);
+    std::vector<MortonPrimitive>().swap(morton_primitives);
+
+    std::vector<LBVHTreelet> treelets;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t prefix = codes[i] >> (morton_bits - treelet_bits);
+        if (treelets.empty() || treelets.back().prefix != prefix)
+        {
+            treelets.push_back({i, 0, prefix});
+        }
+        treelets.back().primitives_count++;
+    }
+    forEachChunk(parallel, treelets.size(), [&](size_t i)
+                 {
+                     auto &treelet = treelets[i];
+                     for (size_t j = treelet.primitives_begin; j < treelet.primitives_begin + treelet.primitives_count; j++)
+                     {
+                         treelet.bounds.expand(mPrimitives[j].bounds);
+                     }
+                     treelet.center = (treelet.bounds.b_min + treelet.bounds.b_max) * 0.5f; });
+
+    if (sahUpperLevels)
+    {
+        emitSAHUpperLevels(mAllocator, root, treelets.data(), treelets.size(), state);
+    }
+    else
+    {
+        emitMortonUpperLevels(mAllocator, root, treelets.data(), treelets.size(), treelet_bits - 1, state);
+    }
+
+    // 各个小树互不相交, 并行构建, 每棵小树记录自己的构建状态, 完成后合并
+    std::vector<BVHState> treelet_states(treelets.size());
+    auto buildTreelet = [&](size_t i)
+    { recursiveMortonSplit(mAllocator, treelets[i].node, mPrimitives.data(), codes.data(), morton_bits - treelet_bits - 1, treelet_states[i]); };
+    if (parallel)
+    {
+        threadPool.parallelFor(treelets.size(), 1, [&](size_t i, size_t)
+                               { buildTreelet(i); });
+    }
+    else
+    {
+        for (size_t i = 0; i < treelets.size(); i++)
+        {
+            buildTreelet(i);
+        }
+    }
+    for (const auto &treelet_state : treelet_states)
+    {
+        state.merge(treelet_state);
+    }
+}
@@ -0,0 +1,95 @@
+#include "bvh.hpp"
+#pragma warning(push)
+#pragma warning(disable : 4267)
+#pragma warning(disable : 4244)
+
+/**
+ * @brief 整包光线一起遍历二叉BVH
+ *
+ * 栈中的每个节点同时记录第一条可能与它相交的光线first, first之前的光线已经确定不与该节点相交.
+ * 访问节点时先单独测试第first条光线, 相交就直接下降; 不相交时先用区间算术尝试剔除整包光线,
+ * 剔除不了再一次SIMD测试剩下的光线找到新的first. 叶子中只有命中叶子包围盒的光线才逐块测试三角形.
+ * 包内光线的方向符号都相同, 孩子的访问顺序对所有光线都一样.
+ * 宽节点布局和方向符号不一致的光线包退回逐条光线求交. 实例重编时从root开始遍历子树, 宽节点布局的子树也按二叉节点遍历.
+ */
+uint32_t BVH::intersectPacketNode(uint32_t root, RayPacket &packet, HitRecord *records) const
+{
+    if (mMesh.triangleCount() == 0)
+    {
+        return 0;
+    }
+    if ((mOptions.layout != BVHLayout::Binary && root == 0) || !packet.coherent)
+    {
+        return Shape::intersectPacketNode(root, packet, records);
+    }
+
+    uint32_t hit_mask = 0;
+    float packet_t_max = packet.maxT(); // 区间算术测试用所有光线中最大的t_max
+
+    DEBUG_LINE(size_t bounds_test_count = 0, triangles_test_count = 0)
+
+    struct StackEntry
+    {
+        int index;
+        int first; // 第一条可能相交的光线
+    };
+    TraversalStack<StackEntry, 64> stack(mBuildState.max_leaf_node_depth);
+    auto ptr = stack.begin();
+    StackEntry current{static_cast<int>(root), 0};
+    while (true)
+    {
+        auto &node = mNodes[current.index];
+        DEBUG_LINE(bounds_test_count++)
+
+        size_t first = current.first;
+        if (!node.bounds.hasIntersection(packet, first))
+        {
+            uint32_t mask = node.bounds.mayIntersect(packet, packet_t_max) ? node.bounds.intersectPacket(packet, first + 1) : 0;
+            first = RayPacket::firstActive(mask, first + 1);
+            if (first == RAY_PACKET_SIZE) // 整包光线都不相交
+            {
+                if (ptr == stack.begin())
+                    break;
+                current = *(--ptr);
+                continue;
+            }
+        }
+        if (node.triangles_count == 0)
+        {
+            if (packet.dir_is_neg[node.split_axis])
+            {
+                *(ptr++) = {node.child, static_cast<int>(first)};
+                current = {node.child + 1, static_cast<int>(first)};
+            }
+            else
+            {
+                current = {node.child, static_cast<int>(first)};
+                *(ptr++) = {node.child + 1, static_cast<int>(first)};
+            }
+        }
+        else
+        {
+            // 叶子的三角形块对包内所有光线只读取一次
+            uint32_t mask = node.bounds.intersectPacket(packet, first);
+            for (size_t i = first; i < RAY_PACKET_SIZE; i++)
+            {
+                if ((mask & (1u << i)) == 0)
+                {
+                    continue;
+                }
+                DEBUG_LINE(triangles_test_count += node.triangles_count)
+                if (intersectTriangleBlocks(mTriangleBlocks.data() + node.triangles_index, node.triangles_count, packet.getRay(i), packet.t_min, packet.t_max[i], records[i]))
+                {
+                    hit_mask |= 1u << i;
+                }
+            }
+            packet_t_max = packet.maxT();
+            if (ptr == stack.begin())
+                break;
+            current = *(--ptr);
+        }
+    }
+    DEBUG_LINE(packet.bounds_test_count += bounds_test_count)
+    DEBUG_LINE(packet.triangles_test_count += triangles_test_count)
+    return hit_mask;
+}
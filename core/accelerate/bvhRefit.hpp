@@ -0,0 +1,104 @@
+#pragma once
+#include "bounds.hpp"
+#include "../../application/threadPool.hpp"
+#include <vector>
+#include <utility>
+
+// BVH和SceneBVH共用的refit: 两者的孩子在数组中的位置不同, 由children(index)返回两个孩子的索引
+// 两种布局中孩子的索引都大于父节点, 自底向上更新时只需要保证先更新孩子
+
+static constexpr size_t refit_subtree_count = 64; // 并行refit时顶层展开的子树数量
+
+// 后序遍历一棵子树, 先更新孩子再合并出自己的包围盒
+template <typename Nodes, typename LeafCount, typename Children, typename RefitLeaf>
+void refitSubtree(Nodes &nodes, size_t index, const LeafCount &leafCount, const Children &children, const RefitLeaf &refitLeaf)
+{
+    auto &node = nodes[index];
+    if (leafCount(node) != 0)
+    {
+        node.bounds = refitLeaf(node);
+        return;
+    }
+    auto [left, right] = children(index);
+    refitSubtree(nodes, left, leafCount, children, refitLeaf);
+    refitSubtree(nodes, right, leafCount, children, refitLeaf);
+    node.bounds = nodes[left].bounds;
+    node.bounds.expand(nodes[right].bounds);
+}
+
+/**
+ * @brief 自底向上更新展平后节点的包围盒, 不改变树的结构
+ *
+ * @param leafCount 返回叶子的图元数量, 内部节点为0
+ * @param children 返回内部节点两个孩子的索引
+ * @param refitLeaf 重新计算叶子的包围盒, 可以在这里同时更新叶子引用的数据
+ * @param parallel 为true时顶层展开成若干棵子树交给线程池并行更新, 再串行更新顶层节点
+ */
+template <typename Nodes, typename LeafCount, typename Children, typename RefitLeaf>
+void refitNodes(Nodes &nodes, const LeafCount &leafCount, const Children &children, const RefitLeaf &refitLeaf, bool parallel)
+{
+    if (!parallel || nodes.size() < refit_subtree_count * 2)
+    {
+        refitSubtree(nodes, 0, leafCount, children, refitLeaf);
+        return;
+    }
+
+    // 从根节点开始逐层展开, 直到子树数量足够, 展开过的节点留到最后串行更新
+    std::vector<size_t> subtrees{0};
+    std::vector<size_t> top_nodes;
+    while (subtrees.size() < refit_subtree_count)
+    {
+        std::vector<size_t> next_subtrees;
+        for (size_t index : subtrees)
+        {
+            if (leafCount(nodes[index]) != 0)
+            {
+                next_subtrees.push_back(index);
+                continue;
+            }
+            top_nodes.push_back(index);
+            auto [left, right] = children(index);
+            next_subtrees.push_back(left);
+            next_subtrees.push_back(right);
+        }
+        if (next_subtrees.size() == subtrees.size()) // 全部都是叶子, 无法再展开
+        {
+            break;
+        }
+        subtrees.swap(next_subtrees);
+    }
+    threadPool.parallelFor(subtrees.size(), 1, [&](size_t i, size_t)
+                           { refitSubtree(nodes, subtrees[i], leafCount, children, refitLeaf); });
+
+    // 顶层节点按展开的逆序更新, 它们的孩子要么是子树的根, 要么是已经更新过的顶层节点
+    for (auto iter = top_nodes.rbegin(); iter != top_nodes.rend(); ++iter)
+    {
+        auto [left, right] = children(*iter);
+        nodes[*iter].bounds = nodes[left].bounds;
+        nodes[*iter].bounds.expand(nodes[right].bounds);
+    }
+}
+
+// 树的SAH开销: 内部节点按一次包围盒测试、叶子按图元数量计, 以表面积加权后除以根节点的表面积
+// refit后与构建时的开销比较, 物体移动使包围盒大量重叠时开销会明显变大
+template <typename Nodes, typename LeafCount, typename Children>
+float computeSAHCost(const Nodes &nodes, const LeafCount &leafCount, const Children &children)
+{
+    float cost = 0.f;
+    std::vector<size_t> stack{0};
+    while (!stack.empty())
+    {
+        size_t index = stack.back();
+        stack.pop_back();
+        size_t count = leafCount(nodes[index]);
+        cost += nodes[index].bounds.area() * static_cast<float>(count == 0 ? 1 : count);
+        if (count == 0)
+        {
+            auto [left, right] = children(index);
+            stack.push_back(left);
+            stack.push_back(right);
+        }
+    }
+    float root_area = nodes[0].bounds.area();
+    return root_area > 0.f ? cost / root_area : cost;
+}
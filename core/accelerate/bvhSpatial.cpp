@@ -0,0 +1,328 @@
+#include "bvh.hpp"
+#include <cmath>
+#pragma warning(push)
+#pragma warning(disable : 4267)
+#pragma warning(disable : 4244)
+
+static constexpr size_t object_bucket_count = 12; // 对象分割的桶数量, 与SAH相同
+static constexpr size_t spatial_bin_count = 32;   // 空间分割的格子数量
+static constexpr float triangle_block_cost = 1.5f; // 一次测试一整块三角形的开销, 与SAH构建的叶子判断相同
+
+static Bounds intersectBounds(const Bounds &a, const Bounds &b)
+{
+    return {glm::max(a.b_min, b.b_min), glm::min(a.b_max, b.b_max)};
+}
+
+static Bounds unionBounds(Bounds a, const Bounds &b)
+{
+    a.expand(b);
+    return a;
+}
+
+static size_t objectBucketIndex(const BVHPrimitive &reference, const Bounds &bounds, const glm::vec3 &diag, size_t axis)
+{
+    return glm::clamp<size_t>(glm::floor((reference.center[axis] - bounds.b_min[axis]) * object_bucket_count / diag[axis]), 0.f, object_bucket_count - 1);
+}
+
+/**
+ * @brief 用垂直于axis的平面把三角形引用切成左右两部分
+ *
+ * 沿三角形的三条边, 平面左右两侧的顶点分别拓展左右包围盒, 与平面相交的边的交点同时拓展两边,
+ * 最后再与原引用的包围盒求交, 因为引用可能已经被之前的平面裁剪过. 某一边没有三角形时得到退化的包围盒.
+ */
+static void splitReference(const TriangleMesh &mesh, const BVHPrimitive &reference, size_t axis, float position, BVHPrimitive &left, BVHPrimitive &right)
+{
+    Bounds left_bounds{}, right_bounds{};
+    const glm::vec3 *vertices[3] = {&mesh.position(reference.index, 0), &mesh.position(reference.index, 1), &mesh.position(reference.index, 2)};
+    for (size_t i = 0; i < 3; i++)
+    {
+        const auto &v0 = *vertices[i];
+        const auto &v1 = *vertices[(i + 1) % 3];
+        if (v0[axis] <= position)
+        {
+            left_bounds.expand(v0);
+        }
+        if (v0[axis] >= position)
+        {
+            right_bounds.expand(v0);
+        }
+        if ((v0[axis] < position && v1[axis] > position) || (v0[axis] > position && v1[axis] < position))
+        {
+            auto point = glm::mix(v0, v1, (position - v0[axis]) / (v1[axis] - v0[axis]));
+            point[axis] = position;
+            left_bounds.expand(point);
+            right_bounds.expand(point);
+        }
+    }
+    left_bounds.b_max[axis] = glm::min(left_bounds.b_max[axis], position);
+    right_bounds.b_min[axis] = glm::max(right_bounds.b_min[axis], position);
+
+    left = reference;
+    right = reference;
+    left.bounds = intersectBounds(left_bounds, reference.bounds);
+    right.bounds = intersectBounds(right_bounds, reference.bounds);
+    left.center = (left.bounds.b_min + left.bounds.b_max) * 0.5f;
+    right.center = (right.bounds.b_min + right.bounds.b_max) * 0.5f;
+}
+
+void BVH::recursiveSpatialSplit(BVHTreeNode *node, std::vector<BVHPrimitive> &&references, const TriangleMesh &mesh, BVHState &state)
+{
+    state.total_node_count++;
+    node->primitives_count = references.size();
+    auto makeLeaf = [&]()
+    {
+        // 递归总是先左后右, 叶子的引用追加的顺序就是展平时叶子的深度优先顺序
+        node->primitives_begin = mPrimitives.size();
+        mPrimitives.insert(mPrimitives.end(), references.begin(), references.end());
+        state.addLeafNode(node);
+    };
+    if (references.size() == 1)
+    {
+        makeLeaf();
+        return;
+    }
+    bool too_deep = node->depth > BVH_MAX_SAH_DEPTH; // 树已经太深了, 只用中位数分割
+
+    auto diag = node->bounds.diagonal();
+    float node_count = static_cast<float>(references.size());
+
+    // 对象分割, 与SAH相同, 只是按引用包围盒的中心分桶
+    float object_cost = std::numeric_limits<float>::infinity();
+    size_t object_axis = 0, object_split_index = 0;
+    Bounds object_leftBounds{}, object_rightBounds{};
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        Bounds bounds_bucket[object_bucket_count] = {};
+        size_t count_bucket[object_bucket_count] = {};
+        for (const auto &reference : references)
+        {
+            size_t bucket_idx = objectBucketIndex(reference, node->bounds, diag, axis);
+            bounds_bucket[bucket_idx].expand(reference.bounds);
+            count_bucket[bucket_idx]++;
+        }
+
+        // 从右往左累计右边桶, 再从左往右扫描所有分割位置
+        Bounds right_bounds[object_bucket_count] = {};
+        size_t right_count[object_bucket_count] = {};
+        right_bounds[object_bucket_count - 1] = bounds_bucket[object_bucket_count - 1];
+        right_count[object_bucket_count - 1] = count_bucket[object_bucket_count - 1];
+        for (size_t i = object_bucket_count - 1; i > 0; i--)
+        {
+            right_bounds[i - 1] = unionBounds(right_bounds[i], bounds_bucket[i - 1]);
+            right_count[i - 1] = right_count[i] + count_bucket[i - 1];
+        }
+        Bounds leftBounds{};
+        size_t leftCount = 0;
+        for (size_t i = 1; i < object_bucket_count; i++)
+        {
+            leftBounds.expand(bounds_bucket[i - 1]);
+            leftCount += count_bucket[i - 1];
+            if (leftCount == 0 || right_count[i] == 0)
+            {
+                continue;
+            }
+            float cost = leftBounds.area() * static_cast<float>(leftCount) + right_bounds[i].area() * static_cast<float>(right_count[i]);
+            if (cost < object_cost)
+            {
+                object_cost = cost;
+                object_axis = axis;
+                object_split_index = i;
+                object_leftBounds = leftBounds;
+                object_rightBounds = right_bounds[i];
+            }
+        }
+    }
+
+    // 空间分割: 只有对象分割的左右子节点重叠较大时才尝试, 引用跨越的每个格子都会得到它被裁剪后的包围盒
+    float spatial_cost = std::numeric_limits<float>::infinity();
+    size_t spatial_axis = 0;
+    float spatial_position = 0.f;
+    Bounds spatial_leftBounds{}, spatial_rightBounds{};
+    float spatial_leftCount = 0.f, spatial_rightCount = 0.f;
+    Bounds overlap = intersectBounds(object_leftBounds, object_rightBounds);
+    bool try_spatial = object_split_index == 0 || (overlap.isValid() && overlap.area() > state.spatial_split_overlap);
+    if (try_spatial && !too_deep && state.spatial_split_budget > 0)
+    {
+        for (size_t axis = 0; axis < 3; axis++)
+        {
+            if (diag[axis] <= 0.f)
+            {
+                continue;
+            }
+            float origin = node->bounds.b_min[axis];
+            float bin_width = diag[axis] / spatial_bin_count;
+            auto binIndex = [&](float position)
+            { return static_cast<size_t>(glm::clamp(static_cast<int>(std::floor((position - origin) / bin_width)), 0, static_cast<int>(spatial_bin_count) - 1)); };
+
+            Bounds bounds_bin[spatial_bin_count] = {};
+            size_t enter_bin[spatial_bin_count] = {}; // 引用从这个格子开始
+            size_t exit_bin[spatial_bin_count] = {};  // 引用在这个格子结束
+            for (const auto &reference : references)
+            {
+                size_t first = binIndex(reference.bounds.b_min[axis]);
+                size_t last = glm::max(first, binIndex(reference.bounds.b_max[axis]));
+                auto current = reference;
+                for (size_t bin = first; bin < last; bin++)
+                {
+                    BVHPrimitive left, right;
+                    splitReference(mesh, current, axis, origin + bin_width * (bin + 1), left, right);
+                    if (left.bounds.isValid())
+                    {
+                        bounds_bin[bin].expand(left.bounds);
+                    }
+                    current = right;
+                }
+                if (current.bounds.isValid())
+                {
+                    bounds_bin[last].expand(current.bounds);
+                }
+                enter_bin[first]++;
+                exit_bin[last]++;
+            }
+
+            Bounds right_bounds[spatial_bin_count] = {};
+            size_t right_count[spatial_bin_count] = {};
+            right_bounds[spatial_bin_count - 1] = bounds_bin[spatial_bin_count - 1];
+            right_count[spatial_bin_count - 1] = exit_bin[spatial_bin_count - 1];
+            for (size_t i = spatial_bin_count - 1; i > 0; i--)
+            {
+                right_bounds[i - 1] = unionBounds(right_bounds[i], bounds_bin[i - 1]);
+                right_count[i - 1] = right_count[i] + exit_bin[i - 1];
+            }
+            Bounds leftBounds{};
+            size_t leftCount = 0;
+            for (size_t i = 1; i < spatial_bin_count; i++)
+            {
+                leftBounds.expand(bounds_bin[i - 1]);
+                leftCount += enter_bin[i - 1];
+                if (leftCount == 0 || right_count[i] == 0)
+                {
+                    continue;
+                }
+                float cost = leftBounds.area() * static_cast<float>(leftCount) + right_bounds[i].area() * static_cast<float>(right_count[i]);
+                if (cost < spatial_cost)
+                {
+                    spatial_cost = cost;
+                    spatial_axis = axis;
+                    spatial_position = origin + bin_width * i;
+                    spatial_leftBounds = leftBounds;
+                    spatial_rightBounds = right_bounds[i];
+                    spatial_leftCount = static_cast<float>(leftCount);
+                    spatial_rightCount = static_cast<float>(right_count[i]);
+                }
+            }
+        }
+    }
+
+    // 不超过一块的引用只需要一次SIMD测试, 整块作为叶子比最好的分割更便宜时不再分割, 不留下大半空着的三角形块
+    if (references.size() <= BVH_WIDTH && node->bounds.area() * triangle_block_cost <= glm::min(object_cost, spatial_cost))
+    {
+        makeLeaf();
+        return;
+    }
+
+    std::vector<BVHPrimitive> left_references, right_references;
+    // 没有评估空间分割时两边的数量都是0, 估计值为负数, 保持浮点比较, 不能转换成size_t
+    float duplicated_estimate = spatial_leftCount + spatial_rightCount - node_count;
+    if (spatial_cost < object_cost && duplicated_estimate <= static_cast<float>(state.spatial_split_budget))
+    {
+        // 跨越分割平面的引用可以被切开放入两边, 也可以整个放入一边(unsplitting), 选择SAH开销最小的方式
+        size_t duplicated_count = 0;
+        for (const auto &reference : references)
+        {
+            if (reference.bounds.b_max[spatial_axis] <= spatial_position)
+            {
+                left_references.push_back(reference);
+                continue;
+            }
+            if (reference.bounds.b_min[spatial_axis] >= spatial_position)
+            {
+                right_references.push_back(reference);
+                continue;
+            }
+            auto left_union = unionBounds(spatial_leftBounds, reference.bounds);
+            auto right_union = unionBounds(spatial_rightBounds, reference.bounds);
+            float split_cost = spatial_leftBounds.area() * spatial_leftCount + spatial_rightBounds.area() * spatial_rightCount;
+            float left_cost = left_union.area() * spatial_leftCount + spatial_rightBounds.area() * (spatial_rightCount - 1.f);
+            float right_cost = spatial_leftBounds.area() * (spatial_leftCount - 1.f) + right_union.area() * spatial_rightCount;
+            if (left_cost < split_cost && left_cost <= right_cost)
+            {
+                left_references.push_back(reference);
+                spatial_leftBounds = left_union;
+                spatial_rightCount -= 1.f;
+            }
+            else if (right_cost < split_cost)
+            {
+                right_references.push_back(reference);
+                spatial_rightBounds = right_union;
+                spatial_leftCount -= 1.f;
+            }
+            else
+            {
+                BVHPrimitive left, right;
+                splitReference(mesh, reference, spatial_axis, spatial_position, left, right);
+                if (left.bounds.isValid())
+                {
+                    left_references.push_back(left);
+                }
+                if (right.bounds.isValid())
+                {
+                    right_references.push_back(right);
+                }
+                duplicated_count += left.bounds.isValid() && right.bounds.isValid();
+            }
+        }
+        if (left_references.empty() || right_references.empty()) // 全部被放到了一边, 退回对象分割
+        {
+            left_references.clear();
+            right_references.clear();
+        }
+        else
+        {
+            node->split_axis = spatial_axis;
+            state.spatial_split_count++;
+            state.spatial_split_budget -= glm::min(duplicated_count, state.spatial_split_budget);
+        }
+    }
+    if (left_references.empty() && (object_split_index == 0 || too_deep)) // SAH无法分割, 引用不多时作为叶子, 否则按中位数分成两半
+    {
+        if (references.size() <= BVH_MAX_LEAF_SIZE)
+        {
+            makeLeaf();
+            return;
+        }
+        state.median_split_count++;
+        size_t left_count = medianSplit(references.data(), references.size(), node->split_axis);
+        left_references.assign(references.begin(), references.begin() + left_count);
+        right_references.assign(references.begin() + left_count, references.end());
+    }
+    else if (left_references.empty())
+    {
+        for (const auto &reference : references)
+        {
+            auto &children_references = objectBucketIndex(reference, node->bounds, diag, object_axis) < object_split_index ? left_references : right_references;
+            children_references.push_back(reference);
+        }
+        node->split_axis = object_axis;
+    }
+
+    // 父节点的引用已经分给了孩子, 先释放再递归, 降低峰值内存
+    std::vector<BVHPrimitive>().swap(references);
+
+    auto *leftNode = mAllocator.allocate();
+    auto *rightNode = mAllocator.allocate();
+    node->children[0] = leftNode;
+    node->children[1] = rightNode;
+    leftNode->depth = node->depth + 1;
+    rightNode->depth = node->depth + 1;
+    for (const auto &reference : left_references)
+    {
+        leftNode->bounds.expand(reference.bounds);
+    }
+    for (const auto &reference : right_references)
+    {
+        rightNode->bounds.expand(reference.bounds);
+    }
+    recursiveSpatialSplit(leftNode, std::move(left_references), mesh, state);
+    recursiveSpatialSplit(rightNode, std::move(right_references), mesh, state);
+}
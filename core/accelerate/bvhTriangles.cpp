@@ -0,0 +1,190 @@
+#include "bvh.hpp"
+#pragma warning(push)
+#pragma warning(disable : 4267)
+#pragma warning(disable : 4244)
+
+/**
+ * @brief 射线与一块三角形同时做Möller–Trumbore求交
+ *
+ * 计算顺序与Triangle::intersect完全一致(叉积、点积的运算顺序相同), 结果逐位相同, 只是边e0、e1是预先算好的.
+ * u、v为NaN(行列式为0)时比较结果为false, 不会被命中.
+ *
+ * @return 命中的掩码, 第i位为1表示块内第i个三角形在(t_min, t_max)内相交
+ */
+static uint32_t intersectBlock(const BVHTriangleBlock &block, const Ray &ray, float t_min, float t_max, float *t, float *u, float *v)
+{
+#if defined(BVH_WIDE_AVX)
+    __m256 dx = _mm256_set1_ps(ray.mDirection.x), dy = _mm256_set1_ps(ray.mDirection.y), dz = _mm256_set1_ps(ray.mDirection.z);
+    __m256 e0x = _mm256_load_ps(block.e0[0]), e0y = _mm256_load_ps(block.e0[1]), e0z = _mm256_load_ps(block.e0[2]);
+    __m256 e1x = _mm256_load_ps(block.e1[0]), e1y = _mm256_load_ps(block.e1[1]), e1z = _mm256_load_ps(block.e1[2]);
+
+    // s1 = cross(d, e1)
+    __m256 s1x = _mm256_sub_ps(_mm256_mul_ps(dy, e1z), _mm256_mul_ps(e1y, dz));
+    __m256 s1y = _mm256_sub_ps(_mm256_mul_ps(dz, e1x), _mm256_mul_ps(e1z, dx));
+    __m256 s1z = _mm256_sub_ps(_mm256_mul_ps(dx, e1y), _mm256_mul_ps(e1x, dy));
+    __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.f), _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(s1x, e0x), _mm256_mul_ps(s1y, e0y)), _mm256_mul_ps(s1z, e0z)));
+
+    // s = o - p0
+    __m256 sx = _mm256_sub_ps(_mm256_set1_ps(ray.mOrigin.x), _mm256_load_ps(block.p0[0]));
+    __m256 sy = _mm256_sub_ps(_mm256_set1_ps(ray.mOrigin.y), _mm256_load_ps(block.p0[1]));
+    __m256 sz = _mm256_sub_ps(_mm256_set1_ps(ray.mOrigin.z), _mm256_load_ps(block.p0[2]));
+    __m256 u_ = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(s1x, sx), _mm256_mul_ps(s1y, sy)), _mm256_mul_ps(s1z, sz)), inv_det);
+
+    // s2 = cross(s, e0)
+    __m256 s2x = _mm256_sub_ps(_mm256_mul_ps(sy, e0z), _mm256_mul_ps(e0y, sz));
+    __m256 s2y = _mm256_sub_ps(_mm256_mul_ps(sz, e0x), _mm256_mul_ps(e0z, sx));
+    __m256 s2z = _mm256_sub_ps(_mm256_mul_ps(sx, e0y), _mm256_mul_ps(e0x, sy));
+    __m256 v_ = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(s2x, dx), _mm256_mul_ps(s2y, dy)), _mm256_mul_ps(s2z, dz)), inv_det);
+    __m256 t_ = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(s2x, e1x), _mm256_mul_ps(s2y, e1y)), _mm256_mul_ps(s2z, e1z)), inv_det);
+
+    __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    __m256 mask = _mm256_and_ps(_mm256_cmp_ps(u_, zero, _CMP_GE_OQ), _mm256_cmp_ps(u_, one, _CMP_LE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(v_, zero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u_, v_), one, _CMP_LE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(t_, _mm256_set1_ps(t_min), _CMP_GT_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(t_, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+    _mm256_store_ps(t, t_);
+    _mm256_store_ps(u, u_);
+    _mm256_store_ps(v, v_);
+    return static_cast<uint32_t>(_mm256_movemask_ps(mask));
+#elif defined(BVH_WIDE_SSE)
+    __m128 dx = _mm_set1_ps(ray.mDirection.x), dy = _mm_set1_ps(ray.mDirection.y), dz = _mm_set1_ps(ray.mDirection.z);
+    __m128 e0x = _mm_load_ps(block.e0[0]), e0y = _mm_load_ps(block.e0[1]), e0z = _mm_load_ps(block.e0[2]);
+    __m128 e1x = _mm_load_ps(block.e1[0]), e1y = _mm_load_ps(block.e1[1]), e1z = _mm_load_ps(block.e1[2]);
+
+    // s1 = cross(d, e1)
+    __m128 s1x = _mm_sub_ps(_mm_mul_ps(dy, e1z), _mm_mul_ps(e1y, dz));
+    __m128 s1y = _mm_sub_ps(_mm_mul_ps(dz, e1x), _mm_mul_ps(e1z, dx));
+    __m128 s1z = _mm_sub_ps(_mm_mul_ps(dx, e1y), _mm_mul_ps(e1x, dy));
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(s1x, e0x), _mm_mul_ps(s1y, e0y)), _mm_mul_ps(s1z, e0z)));
+
+    // s = o - p0
+    __m128 sx = _mm_sub_ps(_mm_set1_ps(ray.mOrigin.x), _mm_load_ps(block.p0[0]));
+    __m128 sy = _mm_sub_ps(_mm_set1_ps(ray.mOrigin.y), _mm_load_ps(block.p0[1]));
+    __m128 sz = _mm_sub_ps(_mm_set1_ps(ray.mOrigin.z), _mm_load_ps(block.p0[2]));
+    __m128 u_ = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(s1x, sx), _mm_mul_ps(s1y, sy)), _mm_mul_ps(s1z, sz)), inv_det);
+
+    // s2 = cross(s, e0)
+    __m128 s2x = _mm_sub_ps(_mm_mul_ps(sy, e0z), _mm_mul_ps(e0y, sz));
+    __m128 s2y = _mm_sub_ps(_mm_mul_ps(sz, e0x), _mm_mul_ps(e0z, sx));
+    __m128 s2z = _mm_sub_ps(_mm_mul_ps(sx, e0y), _mm_mul_ps(e0x, sy));
+    __m128 v_ = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(s2x, dx), _mm_mul_ps(s2y, dy)), _mm_mul_ps(s2z, dz)), inv_det);
+    __m128 t_ = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(s2x, e1x), _mm_mul_ps(s2y, e1y)), _mm_mul_ps(s2z, e1z)), inv_det);
+
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    __m128 mask = _mm_and_ps(_mm_cmpge_ps(u_, zero), _mm_cmple_ps(u_, one));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(v_, zero));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u_, v_), one));
+    mask = _mm_and_ps(mask, _mm_cmpgt_ps(t_, _mm_set1_ps(t_min)));
+    mask = _mm_and_ps(mask, _mm_cmplt_ps(t_, _mm_set1_ps(t_max)));
+    _mm_store_ps(t, t_);
+    _mm_store_ps(u, u_);
+    _mm_store_ps(v, v_);
+    return static_cast<uint32_t>(_mm_movemask_ps(mask));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < BVH_WIDTH; i++)
+    {
+        glm::vec3 p0{block.p0[0][i], block.p0[1][i], block.p0[2][i]};
+        glm::vec3 e0{block.e0[0][i], block.e0[1][i], block.e0[2][i]};
+        glm::vec3 e1{block.e1[0][i], block.e1[1][i], block.e1[2][i]};
+        glm::vec3 s1 = glm::cross(ray.mDirection, e1);
+        float inv_det = 1.f / glm::dot(s1, e0);
+        glm::vec3 s = ray.mOrigin - p0;
+        glm::vec3 s2 = glm::cross(s, e0);
+        u[i] = glm::dot(s1, s) * inv_det;
+        v[i] = glm::dot(s2, ray.mDirection) * inv_det;
+        t[i] = glm::dot(s2, e1) * inv_det;
+        bool hit = u[i] >= 0.f && u[i] <= 1.f && v[i] >= 0.f && u[i] + v[i] <= 1.f && t[i] > t_min && t[i] < t_max;
+        mask |= static_cast<uint32_t>(hit) << i;
+    }
+    return mask;
+#endif
+}
+
+bool intersectTriangleBlocks(const BVHTriangleBlock *blocks, size_t triangles_count, const Ray &ray, float t_min, float &t_max, HitRecord &hit)
+{
+    bool found = false;
+    for (size_t block_begin = 0; block_begin < triangles_count; block_begin += BVH_WIDTH, blocks++)
+    {
+        size_t block_count = glm::min(triangles_count - block_begin, BVH_WIDTH);
+        alignas(32) float t[BVH_WIDTH], u[BVH_WIDTH], v[BVH_WIDTH];
+        uint32_t hit_mask = intersectBlock(*blocks, ray, t_min, t_max, t, u, v) & ((1u << block_count) - 1);
+        // 按块内顺序依次更新最近交点, 与逐个三角形求交时选中的三角形相同
+        for (size_t i = 0; hit_mask != 0; i++, hit_mask >>= 1)
+        {
+            if ((hit_mask & 1u) != 0 && t[i] < t_max)
+            {
+                t_max = t[i];
+                hit = {t[i], u[i], v[i], blocks->triangles_index + static_cast<uint32_t>(i)};
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+bool occludedTriangleBlocks(const BVHTriangleBlock *blocks, size_t triangles_count, const Ray &ray, float t_min, float t_max)
+{
+    for (size_t block_begin = 0; block_begin < triangles_count; block_begin += BVH_WIDTH, blocks++)
+    {
+        size_t block_count = glm::min(triangles_count - block_begin, BVH_WIDTH);
+        alignas(32) float t[BVH_WIDTH], u[BVH_WIDTH], v[BVH_WIDTH];
+        // 不关心是哪个三角形, 块内任意一个命中就可以返回
+        if ((intersectBlock(*blocks, ray, t_min, t_max, t, u, v) & ((1u << block_count) - 1)) != 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+HitInfo BVH::resolveHit(const Ray &ray, const HitRecord &hit) const
+{
+    const auto &index = mMesh.indices[hit.primitive];
+    glm::vec3 normal = (1.f - hit.u - hit.v) * mMesh.normals[index.x] + hit.u * mMesh.normals[index.y] + hit.v * mMesh.normals[index.z]; // 插值计算法线
+    if (normal == glm::vec3(0.f)) // 顶点没有法线, 使用几何法线
+    {
+        normal = glm::cross(mMesh.positions[index.y] - mMesh.positions[index.x], mMesh.positions[index.z] - mMesh.positions[index.x]);
+    }
+    return HitInfo{hit.t, ray.hit(hit.t), glm::normalize(normal)};
+}
+
+void BVH::buildTriangleBlocks()
+{
+    size_t block_count = 0;
+    for (const auto &node : mNodes)
+    {
+        block_count += node.triangles_count == 0 ? 0 : (node.triangles_count + BVH_WIDTH - 1) / BVH_WIDTH;
+    }
+    mTriangleBlocks.assign(block_count, BVHTriangleBlock{});
+    size_t block_index = 0;
+    for (auto &node : mNodes)
+    {
+        if (node.triangles_count == 0)
+        {
+            continue;
+        }
+        size_t triangles_index = node.triangles_index;
+        node.triangles_index = static_cast<int>(block_index);
+        for (size_t i = 0; i < node.triangles_count; i++)
+        {
+            auto &block = mTriangleBlocks[block_index + i / BVH_WIDTH];
+            size_t lane = i % BVH_WIDTH;
+            const auto &p0 = mMesh.position(triangles_index + i, 0);
+            if (lane == 0)
+            {
+                block.triangles_index = static_cast<uint32_t>(triangles_index + i);
+            }
+            glm::vec3 e0 = mMesh.position(triangles_index + i, 1) - p0;
+            glm::vec3 e1 = mMesh.position(triangles_index + i, 2) - p0;
+            for (size_t axis = 0; axis < 3; axis++)
+            {
+                block.p0[axis][lane] = p0[axis];
+                block.e0[axis][lane] = e0[axis];
+                block.e1[axis][lane] = e1[axis];
+            }
+        }
+        block_index += (node.triangles_count + BVH_WIDTH - 1) / BVH_WIDTH;
+    }
+}
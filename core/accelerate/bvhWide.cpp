@@ -0,0 +1,430 @@
+#include "bvh.hpp"
+#include <array>
+#include <cmath>
+#include <cstring>
+#include "../until/debugMacro.hpp"
+#pragma warning(push)
+#pragma warning(disable : 4267)
+#pragma warning(disable : 4244)
+
+/**
+ * @brief 射线与宽节点所有孩子的包围盒同时做slab测试
+ *
+ * 按射线方向的正负选取每个轴上先进入和后离开的面, 这样不需要再取min/max;
+ * 空的孩子最小点为正无穷、最大点为负无穷, 进入距离为正无穷、离开距离为负无穷, 一定不相交.
+ * 0 * inf 产生的NaN会被max/min的第二个操作数(射线的t范围)替代, 相当于该轴不做限制.
+ *
+ * @param t_near 输出每个孩子的进入距离
+ * @return 命中孩子的掩码, 第i位为1表示第i个孩子相交
+ */
+static uint32_t intersectChildren(const BVHWideNode &node, const glm::vec3 &origin, const glm::vec3 &inv_direction, const glm::bvec3 &dir_is_neg, float t_min, float t_max, float *t_near)
+{
+#if defined(BVH_WIDE_AVX)
+    __m256 tn = _mm256_set1_ps(t_min);
+    __m256 tf = _mm256_set1_ps(t_max);
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        __m256 o = _mm256_set1_ps(origin[axis]);
+        __m256 inv_d = _mm256_set1_ps(inv_direction[axis]);
+        __m256 near_plane = _mm256_load_ps(dir_is_neg[axis] ? node.b_max[axis] : node.b_min[axis]);
+        __m256 far_plane = _mm256_load_ps(dir_is_neg[axis] ? node.b_min[axis] : node.b_max[axis]);
+        tn = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(near_plane, o), inv_d), tn);
+        tf = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(far_plane, o), inv_d), tf);
+    }
+    _mm256_storeu_ps(t_near, tn);
+    return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ)));
+#elif defined(BVH_WIDE_SSE)
+    __m128 tn = _mm_set1_ps(t_min);
+    __m128 tf = _mm_set1_ps(t_max);
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        __m128 o = _mm_set1_ps(origin[axis]);
+        __m128 inv_d = _mm_set1_ps(inv_direction[axis]);
+        __m128 near_plane = _mm_load_ps(dir_is_neg[axis] ? node.b_max[axis] : node.b_min[axis]);
+        __m128 far_plane = _mm_load_ps(dir_is_neg[axis] ? node.b_min[axis] : node.b_max[axis]);
+        tn = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near_plane, o), inv_d), tn);
+        tf = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far_plane, o), inv_d), tf);
+    }
+    _mm_storeu_ps(t_near, tn);
+    return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(tn, tf)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < BVH_WIDTH; i++)
+    {
+        float tn = t_min, tf = t_max;
+        for (size_t axis = 0; axis < 3; axis++)
+        {
+            float near_t = ((dir_is_neg[axis] ? node.b_max[axis][i] : node.b_min[axis][i]) - origin[axis]) * inv_direction[axis];
+            float far_t = ((dir_is_neg[axis] ? node.b_min[axis][i] : node.b_max[axis][i]) - origin[axis]) * inv_direction[axis];
+            tn = near_t > tn ? near_t : tn;
+            tf = far_t < tf ? far_t : tf;
+        }
+        t_near[i] = tn;
+        mask |= static_cast<uint32_t>(tn <= tf) << i;
+    }
+    return mask;
+#endif
+}
+
+// 量化步长2^exponent, 直接构造浮点数的指数位
+static float exponentScale(int exponent)
+{
+    uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(float));
+    return scale;
+}
+
+#if defined(BVH_WIDE_AVX)
+static __m256 loadQuantized(const uint8_t *q)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i q16 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(q)), zero);
+    __m128i lo = _mm_unpacklo_epi16(q16, zero);
+    __m128i hi = _mm_unpackhi_epi16(q16, zero);
+    return _mm256_cvtepi32_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1));
+}
+#elif defined(BVH_WIDE_SSE)
+static __m128 loadQuantized(const uint8_t *q)
+{
+    __m128i zero = _mm_setzero_si128();
+    int32_t packed;
+    std::memcpy(&packed, q, sizeof(int32_t));
+    __m128i q32 = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+    return _mm_cvtepi32_ps(q32);
+}
+#endif
+
+// 压缩宽节点的孩子测试: 先反量化出孩子的包围盒平面 origin + q * scale, 再与宽节点一样做slab测试
+static uint32_t intersectChildren(const BVHCompressedNode &node, const glm::vec3 &origin, const glm::vec3 &inv_direction, const glm::bvec3 &dir_is_neg, float t_min, float t_max, float *t_near)
+{
+    uint32_t valid_mask = (1u << node.children_count) - 1;
+#if defined(BVH_WIDE_AVX)
+    __m256 tn = _mm256_set1_ps(t_min);
+    __m256 tf = _mm256_set1_ps(t_max);
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        __m256 node_origin = _mm256_set1_ps(node.origin[axis]);
+        __m256 scale = _mm256_set1_ps(exponentScale(node.exponent[axis]));
+        __m256 o = _mm256_set1_ps(origin[axis]);
+        __m256 inv_d = _mm256_set1_ps(inv_direction[axis]);
+        __m256 near_plane = _mm256_add_ps(node_origin, _mm256_mul_ps(loadQuantized(dir_is_neg[axis] ? node.q_max[axis] : node.q_min[axis]), scale));
+        __m256 far_plane = _mm256_add_ps(node_origin, _mm256_mul_ps(loadQuantized(dir_is_neg[axis] ? node.q_min[axis] : node.q_max[axis]), scale));
+        tn = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(near_plane, o), inv_d), tn);
+        tf = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(far_plane, o), inv_d), tf);
+    }
+    _mm256_storeu_ps(t_near, tn);
+    return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ))) & valid_mask;
+#elif defined(BVH_WIDE_SSE)
+    __m128 tn = _mm_set1_ps(t_min);
+    __m128 tf = _mm_set1_ps(t_max);
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        __m128 node_origin = _mm_set1_ps(node.origin[axis]);
+        __m128 scale = _mm_set1_ps(exponentScale(node.exponent[axis]));
+        __m128 o = _mm_set1_ps(origin[axis]);
+        __m128 inv_d = _mm_set1_ps(inv_direction[axis]);
+        __m128 near_plane = _mm_add_ps(node_origin, _mm_mul_ps(loadQuantized(dir_is_neg[axis] ? node.q_max[axis] : node.q_min[axis]), scale));
+        __m128 far_plane = _mm_add_ps(node_origin, _mm_mul_ps(loadQuantized(dir_is_neg[axis] ? node.q_min[axis] : node.q_max[axis]), scale));
+        tn = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near_plane, o), inv_d), tn);
+        tf = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far_plane, o), inv_d), tf);
+    }
+    _mm_storeu_ps(t_near, tn);
+    return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(tn, tf))) & valid_mask;
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < node.children_count; i++)
+    {
+        float tn = t_min, tf = t_max;
+        for (size_t axis = 0; axis < 3; axis++)
+        {
+            float scale = exponentScale(node.exponent[axis]);
+            float b_min = node.origin[axis] + static_cast<float>(node.q_min[axis][i]) * scale;
+            float b_max = node.origin[axis] + static_cast<float>(node.q_max[axis][i]) * scale;
+            float near_t = ((dir_is_neg[axis] ? b_max : b_min) - origin[axis]) * inv_direction[axis];
+            float far_t = ((dir_is_neg[axis] ? b_min : b_max) - origin[axis]) * inv_direction[axis];
+            tn = near_t > tn ? near_t : tn;
+            tf = far_t < tf ? far_t : tf;
+        }
+        t_near[i] = tn;
+        mask |= static_cast<uint32_t>(tn <= tf) << i;
+    }
+    return mask & valid_mask;
+#endif
+}
+
+// 宽节点与压缩宽节点共用的遍历, 只有孩子包围盒的测试不同
+template <typename WideNode>
+static bool traverseWide(const std::vector<WideNode> &nodes, const std::vector<BVHTriangleBlock> &blocks, size_t depth, const Ray &ray, float t_min, float &t_max, HitRecord &closestHit)
+{
+    bool hit = false;
+
+    DEBUG_LINE(size_t bounds_test_count = 0, triangles_test_count = 0)
+
+    glm::bvec3 dir_is_neg = glm::bvec3(ray.mDirection.x < 0, ray.mDirection.y < 0, ray.mDirection.z < 0);
+    glm::vec3 inv_dir = 1.0f / ray.mDirection;
+
+    // 栈中同时存放宽节点和叶子, 并记录进入距离, 找到更近的交点后可以直接跳过更远的孩子
+    struct StackEntry
+    {
+        int index;                // 宽节点索引或叶子的三角形块起始索引
+        uint16_t triangles_count; // 为0表示宽节点
+        float t_near;             // 射线进入该孩子包围盒的距离
+    };
+    // 每个宽节点出栈一次、最多入栈BVH_WIDTH个孩子, 宽树的深度不超过二叉树的深度
+    TraversalStack<StackEntry, 64 * BVH_WIDTH> stack(depth * (BVH_WIDTH - 1) + 1);
+    auto ptr = stack.begin();
+    *(ptr++) = {0, 0, t_min};
+    while (ptr != stack.begin())
+    {
+        auto entry = *(--ptr);
+        if (entry.t_near > t_max) // 已经有比这个孩子更近的交点了
+        {
+            continue;
+        }
+        if (entry.triangles_count == 0)
+        {
+            const auto &node = nodes[entry.index];
+            DEBUG_LINE(bounds_test_count++) // 一次SIMD测试所有孩子, 计为一次包围盒测试
+
+            alignas(32) float t_near[BVH_WIDTH];
+            uint32_t hit_mask = intersectChildren(node, ray.mOrigin, inv_dir, dir_is_neg, t_min, t_max, t_near);
+            // 命中的孩子按进入距离从远到近入栈, 使最近的孩子最先出栈
+            auto first = ptr;
+            for (size_t i = 0; i < BVH_WIDTH; i++)
+            {
+                if ((hit_mask & (1u << i)) == 0)
+                {
+                    continue;
+                }
+                StackEntry child{node.child[i], node.triangles_count[i], t_near[i]};
+                auto insert = ptr++;
+                while (insert != first && (insert - 1)->t_near < child.t_near)
+                {
+                    *insert = *(insert - 1);
+                    insert--;
+                }
+                *insert = child;
+            }
+        }
+        else
+        {
+            DEBUG_LINE(triangles_test_count += entry.triangles_count)
+            hit |= intersectTriangleBlocks(blocks.data() + entry.index, entry.triangles_count, ray, t_min, t_max, closestHit);
+        }
+    }
+    DEBUG_LINE(ray.bounds_test_count += bounds_test_count)
+    DEBUG_LINE(ray.triangles_test_count += triangles_test_count)
+
+    return hit;
+}
+
+bool BVH::intersectRecordWide(const Ray &ray, float t_min, float &t_max, HitRecord &record) const
+{
+    return mOptions.layout == BVHLayout::Compressed ? traverseWide(mCompressedNodes, mTriangleBlocks, mBuildState.max_leaf_node_depth, ray, t_min, t_max, record)
+                                                    : traverseWide(mWideNodes, mTriangleBlocks, mBuildState.max_leaf_node_depth, ray, t_min, t_max, record);
+}
+
+// 任意交点查询的宽遍历: 命中的孩子不排序直接入栈, 叶子中有任意一个三角形相交就返回
+template <typename WideNode>
+static bool traverseWideOccluded(const std::vector<WideNode> &nodes, const std::vector<BVHTriangleBlock> &blocks, size_t depth, const Ray &ray, float t_min, float t_max)
+{
+    bool hit = false;
+
+    DEBUG_LINE(size_t bounds_test_count = 0, triangles_test_count = 0)
+
+    glm::bvec3 dir_is_neg = glm::bvec3(ray.mDirection.x < 0, ray.mDirection.y < 0, ray.mDirection.z < 0);
+    glm::vec3 inv_dir = 1.0f / ray.mDirection;
+
+    struct StackEntry
+    {
+        int index;
+        uint16_t triangles_count;
+    };
+    TraversalStack<StackEntry, 64 * BVH_WIDTH> stack(depth * (BVH_WIDTH - 1) + 1);
+    auto ptr = stack.begin();
+    *(ptr++) = {0, 0};
+    while (ptr != stack.begin())
+    {
+        auto entry = *(--ptr);
+        if (entry.triangles_count == 0)
+        {
+            const auto &node = nodes[entry.index];
+            DEBUG_LINE(bounds_test_count++)
+
+            alignas(32) float t_near[BVH_WIDTH];
+            uint32_t hit_mask = intersectChildren(node, ray.mOrigin, inv_dir, dir_is_neg, t_min, t_max, t_near);
+            for (size_t i = 0; hit_mask != 0; i++, hit_mask >>= 1)
+            {
+                if ((hit_mask & 1u) != 0)
+                {
+                    *(ptr++) = {node.child[i], node.triangles_count[i]};
+                }
+            }
+        }
+        else
+        {
+            DEBUG_LINE(triangles_test_count += entry.triangles_count)
+            if (occludedTriangleBlocks(blocks.data() + entry.index, entry.triangles_count, ray, t_min, t_max))
+            {
+                hit = true;
+                break;
+            }
+        }
+    }
+    DEBUG_LINE(ray.bounds_test_count += bounds_test_count)
+    DEBUG_LINE(ray.triangles_test_count += triangles_test_count)
+
+    return hit;
+}
+
+bool BVH::occludedWide(const Ray &ray, float t_min, float t_max) const
+{
+    return mOptions.layout == BVHLayout::Compressed ? traverseWideOccluded(mCompressedNodes, mTriangleBlocks, mBuildState.max_leaf_node_depth, ray, t_min, t_max)
+                                                    : traverseWideOccluded(mWideNodes, mTriangleBlocks, mBuildState.max_leaf_node_depth, ray, t_min, t_max);
+}
+
+// 从二叉节点的两个孩子开始, 不断展开表面积最大的内部孩子, 直到孩子数量达到BVH_WIDTH或者全部是叶子
+size_t BVH::recursiveCollapse(size_t node_index)
+{
+    size_t children[BVH_WIDTH];
+    size_t children_count = 0;
+    if (mMesh.triangleCount() == 0)
+    {
+        // 空网格只有一个没有三角形的根节点, 宽节点的孩子全部为空
+    }
+    else if (mNodes[node_index].triangles_count == 0)
+    {
+        children[children_count++] = mNodes[node_index].child;
+        children[children_count++] = mNodes[node_index].child + 1;
+    }
+    else // 只有根节点可能是叶子, 这时宽节点只有它自己一个孩子
+    {
+        children[children_count++] = node_index;
+    }
+
+    while (children_count < BVH_WIDTH)
+    {
+        size_t largest = BVH_WIDTH;
+        float largest_area = -1.f;
+        for (size_t i = 0; i < children_count; i++)
+        {
+            const auto &child = mNodes[children[i]];
+            if (child.triangles_count == 0 && child.bounds.area() > largest_area)
+            {
+                largest = i;
+                largest_area = child.bounds.area();
+            }
+        }
+        if (largest == BVH_WIDTH) // 没有可以展开的内部孩子了
+        {
+            break;
+        }
+        auto expand_index = children[largest];
+        children[largest] = mNodes[expand_index].child;
+        children[children_count++] = mNodes[expand_index].child + 1;
+    }
+
+    auto wide_index = mWideNodes.size();
+    mWideNodes.emplace_back();
+    for (size_t i = 0; i < BVH_WIDTH; i++)
+    {
+        auto &wideNode = mWideNodes[wide_index];
+        Bounds bounds{}; // 空的孩子使用默认的退化包围盒
+        if (i < children_count)
+        {
+            const auto &child = mNodes[children[i]];
+            bounds = child.bounds;
+            wideNode.triangles_count[i] = child.triangles_count;
+            wideNode.child[i] = child.triangles_index;
+        }
+        for (size_t axis = 0; axis < 3; axis++)
+        {
+            wideNode.b_min[axis][i] = bounds.b_min[axis];
+            wideNode.b_max[axis][i] = bounds.b_max[axis];
+        }
+    }
+    // 递归时mWideNodes可能重新分配, 每次都通过索引写回
+    for (size_t i = 0; i < children_count; i++)
+    {
+        if (mNodes[children[i]].triangles_count == 0)
+        {
+            auto child_index = recursiveCollapse(children[i]);
+            mWideNodes[wide_index].child[i] = static_cast<int>(child_index);
+        }
+    }
+    return wide_index;
+}
+
+// 计算一个轴上的量化步长和孩子的量化坐标, 反量化的计算方式与遍历时完全一致, 保证量化后的包围盒包含原包围盒
+static void quantizeAxis(const BVHWideNode &wideNode, size_t children_count, size_t axis, BVHCompressedNode &node)
+{
+    float origin = node.origin[axis];
+    float extent = 0.f;
+    for (size_t i = 0; i < children_count; i++)
+    {
+        extent = glm::max(extent, wideNode.b_max[axis][i] - origin);
+    }
+    int exponent;
+    std::frexp(extent / 255.f, &exponent); // extent / 255 = m * 2^exponent, m在[0.5, 1)之间, 所以255 * 2^exponent >= extent
+    exponent = glm::clamp(exponent, -126, 127);
+    while (true)
+    {
+        float scale = exponentScale(exponent);
+        bool fits = true;
+        for (size_t i = 0; i < children_count && fits; i++)
+        {
+            float b_min = wideNode.b_min[axis][i], b_max = wideNode.b_max[axis][i];
+            int q_min = glm::clamp(static_cast<int>(std::floor((b_min - origin) / scale)), 0, 255);
+            while (q_min > 0 && origin + static_cast<float>(q_min) * scale > b_min) // 向下取整后仍有舍入误差, 再往下调整
+            {
+                q_min--;
+            }
+            int q_max = glm::clamp(static_cast<int>(std::ceil((b_max - origin) / scale)), 0, 255);
+            while (q_max < 255 && origin + static_cast<float>(q_max) * scale < b_max)
+            {
+                q_max++;
+            }
+            fits = origin + static_cast<float>(q_max) * scale >= b_max;
+            node.q_min[axis][i] = static_cast<uint8_t>(q_min);
+            node.q_max[axis][i] = static_cast<uint8_t>(q_max);
+        }
+        if (fits || exponent == 127)
+        {
+            break;
+        }
+        exponent++; // 步长太小, 255个步长覆盖不了节点包围盒
+    }
+    node.exponent[axis] = static_cast<int8_t>(exponent);
+}
+
+void BVH::compressWideNodes()
+{
+    mCompressedNodes.resize(mWideNodes.size());
+    for (size_t node_index = 0; node_index < mWideNodes.size(); node_index++)
+    {
+        const auto &wideNode = mWideNodes[node_index];
+        auto &node = mCompressedNodes[node_index];
+        // 宽节点的空孩子都在末尾, 它们的包围盒是退化的
+        size_t children_count = 0;
+        Bounds bounds{};
+        while (children_count < BVH_WIDTH && wideNode.b_min[0][children_count] <= wideNode.b_max[0][children_count])
+        {
+            bounds.expand(Bounds{{wideNode.b_min[0][children_count], wideNode.b_min[1][children_count], wideNode.b_min[2][children_count]},
+                                 {wideNode.b_max[0][children_count], wideNode.b_max[1][children_count], wideNode.b_max[2][children_count]}});
+            children_count++;
+        }
+        node.origin = bounds.b_min;
+        node.children_count = static_cast<uint8_t>(children_count);
+        for (size_t axis = 0; axis < 3; axis++)
+        {
+            quantizeAxis(wideNode, children_count, axis, node);
+        }
+        for (size_t i = 0; i < BVH_WIDTH; i++)
+        {
+            node.child[i] = wideNode.child[i];
+            node.triangles_count[i] = wideNode.triangles_count[i];
+        }
+    }
+    std::vector<BVHWideNode>().swap(mWideNodes);
+}
@@ -1,21 +1,184 @@
 #include "sceneBVH.hpp"
 #include <array>
+#include <algorithm>
 #include "../until/debugMacro.hpp"
+#include "../../application/threadPool.hpp"
+#include "bvhRefit.hpp"
 #include <iostream>
+#include <unordered_map>
+#include <iterator>
+#include <queue>
 #pragma warning(push)
 #pragma warning(disable : 4267)
 #pragma warning(disable : 4244)
 
-void SceneBVH::build(std::vector<ShapeInstance> &&instances)
+static constexpr size_t parallel_binning_threshold = 1 << 14;
+static constexpr size_t subtree_task_threshold = 1 << 10;
+static constexpr size_t bucket_count = 12;
+static constexpr size_t max_leaf_instance_count = 4; // SAH无法分割时, 超过这个数量的实例改用中位数分割
+static constexpr size_t max_sah_depth = 64;          // 深度超过这个值后只用中位数分割, 限制递归和遍历栈的深度
+static constexpr size_t packet_min_ray_count = 4;    // 到达实例的光线少于这个数量时不再打包, 逐条光线求交
+static constexpr size_t update_subtree_instance_count = 32; // update时新实例插入到不超过这个实例数量的子树中, 只重新构建这棵子树
+static constexpr size_t update_rebuild_ratio = 4;           // 等待插入和删除的实例超过树中实例的1/4时, 直接重新构建整棵树
+
+class SceneBVHBuildTask : public Task
+{
+public:
+    SceneBVHBuildTask(SceneBVH *sceneBVH, SceneBVHTreeNode *node, SceneBVHState &state, SpinLock &stateLock, std::atomic<size_t> &remaining)
+        : mSceneBVH(sceneBVH), mNode(node), mState(state), mStateLock(stateLock), mRemaining(remaining) { mRemaining++; }
+    SceneBVHBuildTask(const SceneBVHBuildTask &parent, SceneBVHTreeNode *node)
+        : SceneBVHBuildTask(parent.mSceneBVH, node, parent.mState, parent.mStateLock, parent.mRemaining) {}
+
+    void run() override
+    {
+        SceneBVHState state{};
+        mSceneBVH->recursiveSplit(mNode, state, this);
+        {
+            Guard guard(mStateLock);
+            mState.merge(state);
+        }
+        if (--mRemaining == 0)
+        {
+            threadPool.notifyDone();
+        }
+    }
+
+private:
+    SceneBVH *mSceneBVH;
+    SceneBVHTreeNode *mNode;
+    SceneBVHState &mState;
+    SpinLock &mStateLock;
+    std::atomic<size_t> &mRemaining; // 这次构建还没有完成的子树任务数量
+};
+
+struct SceneBVHBuckets
+{
+    Bounds bounds[3][bucket_count]{};
+    size_t instance_count[3][bucket_count]{};
+
+    void merge(const SceneBVHBuckets &other)
+    {
+        for (size_t axis = 0; axis < 3; axis++)
+        {
+            for (size_t i = 0; i < bucket_count; i++)
+            {
+                bounds[axis][i].expand(other.bounds[axis][i]);
+                instance_count[axis][i] += other.instance_count[axis][i];
+            }
+        }
+    }
+};
+
+static size_t bucketIndex(const SceneBVHPrimitive &primitive, const Bounds &bounds, const glm::vec3 &diag, size_t axis)
+{
+    return glm::clamp<size_t>(glm::floor((primitive.center[axis] - bounds.b_min[axis]) * bucket_count / diag[axis]), 0.f, bucket_count - 1);
+}
+
+static void fillBuckets(const SceneBVHTreeNode *node, const SceneBVHPrimitive *primitives, size_t begin, size_t end, SceneBVHBuckets &buckets)
+{
+    auto diag = node->bounds.diagonal();
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        for (size_t idx = begin; idx < end; idx++)
+        {
+            const auto &primitive = primitives[idx];
+            size_t bucket_idx = bucketIndex(primitive, node->bounds, diag, axis);
+            buckets.bounds[axis][bucket_idx].expand(primitive.bounds);
+            buckets.instance_count[axis][bucket_idx]++;
+        }
+    }
+}
+
+// 深度优先展平, 左孩子紧跟父节点, 父节点记录右孩子的索引
+static auto childrenOf(const std::vector<SceneBVHNode> &nodes)
+{
+    return [&nodes](size_t index)
+    { return std::pair<size_t, size_t>(index + 1, nodes[index].child); };
+}
+
+static size_t leafCount(const SceneBVHNode &node) { return node.instances_count; }
+
+// 删除的实例在update之前还留在叶子里, 形状换成它, 不与任何光线相交
+struct RemovedShape : public Shape
+{
+    bool intersectRecord(const Ray &ray, float t_min, float &t_max, HitRecord &record) const override { return false; }
+    HitInfo resolveHit(const Ray &ray, const HitRecord &record) const override { return {}; }
+    bool occluded(const Ray &ray, float t_min, float t_max) const override { return false; }
+};
+static const RemovedShape removed_shape{};
+static constexpr uint32_t removed_shape_index = 0; // SceneBVH::mShapes的第一项总是removed_shape
+
+// update时重新输出树需要的旧树和每棵子树的统计
+struct SceneBVHUpdate
+{
+    std::vector<SceneBVHNode> nodes; // 旧树的节点
+    SceneInstanceArray instances;    // 旧树叶子中的实例
+    std::vector<size_t> node_counts; // 子树的节点数量, 深度优先的布局中子树占据[index, index + node_counts[index])
+    std::vector<size_t> live_counts; // 子树中存活的实例数量, 包括插入到子树中的新实例
+    std::unordered_map<size_t, std::vector<SceneInstance>> inserted; // 插入到每棵子树中的新实例, 这些子树重新构建
+};
+
+void SceneBVH::build(std::vector<ShapeInstance> &&instances, const SceneBVHBuildOptions &options)
+{
+    // 把实例转换成紧凑的记录, 形状和材质去重后按索引引用
+    mOptions = options;
+    mShapes.assign(1, &removed_shape);
+    mMaterials.clear();
+    mShapeIndices.clear();
+    mMaterialIndices.clear();
+    mTransforms.resize(instances.size());
+    std::vector<SceneInstance> compact_instances(instances.size());
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+        compact_instances[i] = makeInstance(instances[i], static_cast<uint32_t>(i));
+    }
+    std::vector<ShapeInstance>().swap(instances);
+    buildTree(std::move(compact_instances));
+}
+
+SceneInstance SceneBVH::makeInstance(const ShapeInstance &instance, uint32_t id)
+{
+    auto shape_iter = mShapeIndices.try_emplace(&instance.mShape, static_cast<uint32_t>(mShapes.size())).first;
+    if (shape_iter->second == mShapes.size())
+    {
+        mShapes.push_back(&instance.mShape);
+    }
+    auto material_iter = mMaterialIndices.try_emplace(instance.mMaterial, static_cast<uint32_t>(mMaterials.size())).first;
+    if (material_iter->second == mMaterials.size())
+    {
+        mMaterials.push_back(instance.mMaterial);
+    }
+    glm::mat4 objectFromWorld = glm::inverse(instance.mWorldFromObject);
+    mTransforms[id].set(instance.mWorldFromObject, objectFromWorld);
+    return {glm::mat4x3(objectFromWorld), shape_iter->second, material_iter->second, id, 0};
+}
+
+void SceneBVH::buildTree(std::vector<SceneInstance> &&instances)
 {
+    // 重新构建时先清空上一次构建的结果, 等待插入的实例和删除的实例都已经包含在instances中
+    mNodes.clear();
+    mOrderedInstances.clear();
+    mInfinityInstances.clear();
+    mPendingInstances.clear();
+    mMovedIDs.clear();
+    mRemovedCount = 0;
+    mOpenedGenerations.clear();
+    if (mOptions.rebraid)
+    {
+        openInstances(instances);
+    }
     root = mAllocator.allocate();
-    auto temp_instances = std::move(instances);
-    for (auto &instance : temp_instances) // 将无穷大的物体分离
+    // 只为有限大的实例生成引用, 之后所有的分割都在这个数组上原地划分
+    mPrimitives.clear();
+    mPrimitives.reserve(instances.size());
+    for (size_t i = 0; i < instances.size(); i++) // 将无穷大的物体分离
     {
-        if (instance.mShape.getBounds().isValid())
+        const auto &instance = instances[i];
+        if (mShapes[instance.mShape]->getBounds().isValid())
         {
-            instance.updateBounds();
-            root->mInstances.push_back(instance);
+            Bounds bounds = instanceBounds(instance);
+            mPrimitives.push_back({bounds, (bounds.b_min + bounds.b_max) * 0.5f, static_cast<uint32_t>(i)});
+            root->bounds.expand(bounds);
         }
         else
         {
@@ -23,11 +186,19 @@ void SceneBVH::build(std::vector<ShapeInstance> &&instances)
         }
     }
 
-    root->updateBounds();
+    root->instances_begin = 0;
+    root->instances_count = mPrimitives.size();
     root->depth = 1;
     SceneBVHState state{};
-    float instances_count = static_cast<float>(root->mInstances.size());
-    recursiveSplit(root, state);
+    float instances_count = static_cast<float>(mPrimitives.size());
+    if (mOptions.parallel)
+    {
+        parallelSplit(root, state);
+    }
+    else
+    {
+        recursiveSplit(root, state);
+    }
 
     // std::cout << "Total node count: " << state.total_node_count << std::endl;
     // std::cout << "Leaf node count: " << state.leaf_node_count << std::endl;
@@ -35,16 +206,458 @@ void SceneBVH::build(std::vector<ShapeInstance> &&instances)
     // std::cout << "Mean leaf node ShapeInstance count: " << instances_count / static_cast<float>(state.leaf_node_count) << std::endl;
     // std::cout << "Max leaf node ShapeInstance count: " << state.max_leaf_node_instance_count << std::endl;
     // std::cout << "Max leaf node depth: " << state.max_leaf_node_depth << std::endl;
+    // std::cout << "Median split count: " << state.median_split_count << std::endl;
+    mMaxDepth = state.max_leaf_node_depth;
 
     mNodes.reserve(state.total_node_count);
     mOrderedInstances.reserve(instances_count);
-    recursiveFlatten(root);
+    recursiveFlatten(root, instances);
+    mAllocator.clear();
+    root = nullptr;
+    std::vector<SceneBVHPrimitive>().swap(mPrimitives);
+
+    mInstancesByID.assign(mTransforms.size(), nullptr);
+    indexRecords();
+    for (auto &instance : mInfinityInstances)
+    {
+        mInstancesByID[instance.mID] = &instance;
+    }
+    // 树中没有实例时根节点是一个空的叶子, instances_count为0会被当作内部节点, 不能按孩子展开
+    mBuildSAHCost = mOrderedInstances.empty() ? 0.f : computeSAHCost(mNodes, leafCount, childrenOf(mNodes));
+}
+
+void SceneBVH::rebuild()
+{
+    // 按编号收集存活的实例, 实例的编号保持不变, 打开的实例从根节点重新打开
+    std::vector<SceneInstance> instances;
+    instances.reserve(mInstancesByID.size());
+    for (const auto *instance : mInstancesByID)
+    {
+        if (instance != nullptr)
+        {
+            instances.push_back(*instance);
+            instances.back().mNode = 0;
+        }
+    }
+    buildTree(std::move(instances));
+}
+
+// 每次打开当前世界空间包围盒最大的记录, 用它两个孩子的记录代替, 直到新增的记录用完预算
+// 大的实例通常也是和别的实例重叠最多的实例, 打开后顶层树可以在它的上层节点之间分割
+void SceneBVH::openInstances(std::vector<SceneInstance> &instances)
+{
+    size_t budget = glm::max(static_cast<size_t>(instances.size() * mOptions.rebraid_budget), mOptions.rebraid_min_records);
+    size_t max_records = instances.size() + budget;
+    std::priority_queue<std::pair<float, size_t>> queue; // 记录在世界空间中的表面积, 记录在instances中的位置
+    uint32_t children[2];
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+        if (mShapes[instances[i].mShape]->getNodeChildren(0, children))
+        {
+            queue.push({instanceBounds(instances[i]).area(), i});
+        }
+    }
+    while (!queue.empty() && instances.size() < max_records)
+    {
+        size_t index = queue.top().second;
+        queue.pop();
+        if (!mShapes[instances[index].mShape]->getNodeChildren(instances[index].mNode, children))
+        {
+            continue;
+        }
+        mOpenedGenerations.emplace(instances[index].mShape, mShapes[instances[index].mShape]->getNodeGeneration());
+        auto right = instances[index];
+        right.mNode = children[1];
+        instances[index].mNode = children[0];
+        instances.push_back(right);
+        queue.push({instanceBounds(instances[index]).area(), index});
+        queue.push({instanceBounds(instances.back()).area(), instances.size() - 1});
+    }
+}
+
+void SceneBVH::indexRecords()
+{
+    mOpenedRecords.clear();
+    for (auto &instance : mOrderedInstances)
+    {
+        mInstancesByID[instance.mID] = &instance;
+        if (instance.mNode != 0)
+        {
+            mOpenedRecords[instance.mID].push_back(&instance);
+        }
+    }
+}
+
+template <typename F>
+void SceneBVH::forEachRecord(size_t id, const F &f)
+{
+    auto iter = mOpenedRecords.find(static_cast<uint32_t>(id));
+    if (iter == mOpenedRecords.end())
+    {
+        if (mInstancesByID[id] != nullptr)
+        {
+            f(*mInstancesByID[id]);
+        }
+        return;
+    }
+    // 打开的实例: 树中的记录跳过已经移出叶子的, 移出的记录在等待插入的数组中
+    for (auto *record : iter->second)
+    {
+        if (record->mShape != removed_shape_index)
+        {
+            f(*record);
+        }
+    }
+    for (auto &record : mPendingInstances)
+    {
+        if (record.mID == id)
+        {
+            f(record);
+        }
+    }
+}
+
+Bounds SceneBVH::instanceBounds(const SceneInstance &instance) const
+{
+    Bounds bounds{};
+    const auto *shape = mShapes[instance.mShape];
+    auto bounds_local = instance.mNode == 0 ? shape->getBounds() : shape->getNodeBounds(instance.mNode);
+    const auto &worldFromObject = mTransforms[instance.mID].mWorldFromObject;
+    // 遍历8个角点，将它们转换到世界空间中，然后扩展包围盒
+    for (size_t i = 0; i < 8; i++)
+    {
+        bounds.expand(worldFromObject * glm::vec4(bounds_local.getCorner(i), 1.f));
+    }
+    return bounds;
+}
+
+void SceneBVH::appendInstance(SceneInstanceArray &instances, const SceneInstance &instance)
+{
+    const auto *data = instances.data();
+    instances.push_back(instance);
+    mInstancesByID[instance.mID] = &instances.back();
+    if (instances.data() != data)
+    {
+        for (auto &moved : instances)
+        {
+            mInstancesByID[moved.mID] = &moved;
+        }
+    }
+}
+
+size_t SceneBVH::addInstance(const ShapeInstance &instance)
+{
+    uint32_t id = static_cast<uint32_t>(mTransforms.size());
+    mTransforms.emplace_back();
+    mInstancesByID.push_back(nullptr);
+    auto record = makeInstance(instance, id);
+    // 无穷大的物体本来就逐个求交, 直接放进mInfinityInstances
+    appendInstance(mShapes[record.mShape]->getBounds().isValid() ? mPendingInstances : mInfinityInstances, record);
+    return id;
+}
+
+void SceneBVH::removeInstance(size_t id)
+{
+    auto *instance = mInstancesByID[id];
+    if (instance == nullptr)
+    {
+        return;
+    }
+    // 不在树中的记录与数组的最后一个交换后直接移除
+    auto eraseFrom = [&](SceneInstanceArray &instances, SceneInstance *record)
+    {
+        if (record < instances.data() || record >= instances.data() + instances.size())
+        {
+            return false;
+        }
+        *record = instances.back();
+        instances.pop_back();
+        if (record != instances.data() + instances.size())
+        {
+            mInstancesByID[record->mID] = record;
+        }
+        return true;
+    };
+    // 树中的记录先换成不与光线相交的形状, 叶子要等update时再去掉它
+    if (auto iter = mOpenedRecords.find(static_cast<uint32_t>(id)); iter != mOpenedRecords.end())
+    {
+        // 打开的实例要删除每一条记录, 移出叶子后等待插入的记录直接移除
+        for (auto *record : iter->second)
+        {
+            if (record->mShape != removed_shape_index)
+            {
+                record->mShape = removed_shape_index;
+                mRemovedCount++;
+            }
+        }
+        mOpenedRecords.erase(iter);
+        for (size_t i = mPendingInstances.size(); i-- > 0;)
+        {
+            if (mPendingInstances[i].mID == id)
+            {
+                eraseFrom(mPendingInstances, &mPendingInstances[i]);
+            }
+        }
+    }
+    else if (!eraseFrom(mPendingInstances, instance) && !eraseFrom(mInfinityInstances, instance))
+    {
+        instance->mShape = removed_shape_index;
+        mRemovedCount++;
+    }
+    mInstancesByID[id] = nullptr;
+}
+
+void SceneBVH::setTransform(size_t id, const glm::mat4 &worldFromObject)
+{
+    glm::mat4 objectFromWorld = glm::inverse(worldFromObject);
+    forEachRecord(id, [&](SceneInstance &record)
+                  { record.mObjectFromWorld = glm::mat4x3(objectFromWorld); });
+    mTransforms[id].set(worldFromObject, objectFromWorld);
+    mMovedIDs.push_back(static_cast<uint32_t>(id));
+}
+
+void SceneBVH::refitLeaves()
+{
+    // 叶子重新计算实例在世界空间中的包围盒, 实例引用的模型refit后对象空间的包围盒也会变化
+    refitNodes(mNodes, leafCount, childrenOf(mNodes), [&](const SceneBVHNode &node)
+               {
+                   Bounds bounds{};
+                   size_t end = static_cast<size_t>(node.instances_index) + node.instances_count;
+                   for (size_t i = node.instances_index; i < end; i++)
+                   {
+                       if (mOrderedInstances[i].mShape != removed_shape_index)
+                       {
+                           bounds.expand(instanceBounds(mOrderedInstances[i]));
+                       }
+                   }
+                   return bounds; }, mOptions.parallel);
+}
+
+bool SceneBVH::update(float rebuild_threshold)
+{
+    // 0. 打开的形状重新构建过, 记录引用的节点编号已经失效, 不能再用来更新包围盒或者遍历, 只能重新打开
+    for (const auto &[shape, generation] : mOpenedGenerations)
+    {
+        if (mShapes[shape]->getNodeGeneration() != generation)
+        {
+            rebuild();
+            return true;
+        }
+    }
+
+    // 1. 移动后超出原来叶子包围盒的实例从叶子中删除, 和新实例一样重新插入; 仍在叶子内的实例只需要refit
+    if (!mMovedIDs.empty())
+    {
+        std::vector<uint32_t> leaf_of(mOrderedInstances.size()); // 每个实例所在的叶子
+        for (size_t i = 0; i < mNodes.size(); i++)
+        {
+            std::fill_n(leaf_of.begin() + (mNodes[i].instances_count != 0 ? mNodes[i].instances_index : 0), mNodes[i].instances_count, static_cast<uint32_t>(i));
+        }
+        std::vector<SceneInstance *> records; // 实例在树中的记录, 打开的实例有多条
+        for (uint32_t id : mMovedIDs)
+        {
+            // 删除的实例、无穷大的实例和还没插入树中的记录不需要处理
+            records.clear();
+            forEachRecord(id, [&](SceneInstance &record)
+                          {
+                              if (&record >= mOrderedInstances.data() && &record < mOrderedInstances.data() + mOrderedInstances.size())
+                              {
+                                  records.push_back(&record);
+                              } });
+            for (auto *record : records)
+            {
+                if (mNodes[leaf_of[record - mOrderedInstances.data()]].bounds.contains(instanceBounds(*record)))
+                {
+                    continue;
+                }
+                appendInstance(mPendingInstances, *record);
+                record->mShape = removed_shape_index;
+                mRemovedCount++;
+            }
+        }
+        mMovedIDs.clear();
+    }
+
+    auto checkQuality = [&]()
+    {
+        if (computeSAHCost(mNodes, leafCount, childrenOf(mNodes)) > mBuildSAHCost * rebuild_threshold)
+        {
+            rebuild();
+            return true;
+        }
+        return false;
+    };
+    if (mOrderedInstances.empty()) // 树中没有实例时只有一个空的根节点
+    {
+        if (mPendingInstances.empty())
+        {
+            return false;
+        }
+        rebuild();
+        return true;
+    }
+    if (mPendingInstances.empty() && mRemovedCount == 0)
+    {
+        refitLeaves();
+        return checkQuality();
+    }
+    // 改动的实例太多时局部插入不划算, 直接重新构建
+    size_t live_count = mOrderedInstances.size() - mRemovedCount;
+    if (live_count == 0 || (mPendingInstances.size() + mRemovedCount) * update_rebuild_ratio > live_count)
+    {
+        rebuild();
+        return true;
+    }
+
+    // 2. refit后统计每棵子树的节点数量和存活的实例数量, 孩子的索引总是大于父节点, 逆序遍历即可
+    refitLeaves();
+    SceneBVHUpdate update{};
+    update.node_counts.resize(mNodes.size());
+    update.live_counts.resize(mNodes.size());
+    for (size_t i = mNodes.size(); i-- > 0;)
+    {
+        const auto &node = mNodes[i];
+        if (node.instances_count != 0)
+        {
+            update.node_counts[i] = 1;
+            update.live_counts[i] = std::count_if(mOrderedInstances.begin() + node.instances_index, mOrderedInstances.begin() + node.instances_index + node.instances_count,
+                                                  [](const SceneInstance &instance)
+                                                  { return instance.mShape != removed_shape_index; });
+            continue;
+        }
+        update.node_counts[i] = 1 + update.node_counts[i + 1] + update.node_counts[node.child];
+        update.live_counts[i] = update.live_counts[i + 1] + update.live_counts[node.child];
+    }
+
+    // 3. 每个新实例从根节点向下选择表面积增加最少的孩子, 直到子树足够小或者到达叶子, 这棵子树之后重新构建
+    for (const auto &instance : mPendingInstances)
+    {
+        Bounds bounds = instanceBounds(instance);
+        auto growth = [&](size_t index)
+        {
+            Bounds merged = mNodes[index].bounds;
+            merged.expand(bounds);
+            return merged.area() - (mNodes[index].bounds.isValid() ? mNodes[index].bounds.area() : 0.f);
+        };
+        size_t index = 0;
+        while (true)
+        {
+            update.live_counts[index]++;
+            const auto &node = mNodes[index];
+            if (node.instances_count != 0 || update.live_counts[index] <= update_subtree_instance_count)
+            {
+                break;
+            }
+            index = growth(index + 1) <= growth(node.child) ? index + 1 : node.child;
+        }
+        update.inserted[index].push_back(instance);
+    }
+
+    // 4. 深度优先重新输出整棵树: 没有改动的子树原样拷贝, 去掉删除的实例和空的子树, 插入了新实例的子树重新构建
+    update.nodes.swap(mNodes);
+    update.instances.swap(mOrderedInstances);
+    mNodes.reserve(update.nodes.size() + mPendingInstances.size() * 2);
+    mOrderedInstances.reserve(live_count + mPendingInstances.size());
+    emitSubtree(update, 0);
+    mAllocator.clear();
+    std::vector<SceneBVHPrimitive>().swap(mPrimitives);
+    mPendingInstances.clear();
+    mRemovedCount = 0;
+    indexRecords();
+
+    // 重新构建的子树可能比原来深, 重新计算树的最大深度
+    std::vector<size_t> depths(mNodes.size());
+    depths[0] = 1;
+    mMaxDepth = 0;
+    for (size_t i = 0; i < mNodes.size(); i++)
+    {
+        if (mNodes[i].instances_count != 0)
+        {
+            mMaxDepth = glm::max(mMaxDepth, depths[i]);
+            continue;
+        }
+        depths[i + 1] = depths[i] + 1;
+        depths[mNodes[i].child] = depths[i] + 1;
+    }
+    return checkQuality();
 }
 
-std::optional<HitInfo> SceneBVH::intersect(const Ray &ray, float t_min, float t_max) const
+int SceneBVH::buildSubtree(std::vector<SceneInstance> &&instances)
 {
-    std::optional<HitInfo> closestHitInfo;
-    const ShapeInstance *closestInstance = nullptr;
+    auto *node = mAllocator.allocate();
+    mPrimitives.clear();
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+        Bounds bounds = instanceBounds(instances[i]);
+        mPrimitives.push_back({bounds, (bounds.b_min + bounds.b_max) * 0.5f, static_cast<uint32_t>(i)});
+        node->bounds.expand(bounds);
+    }
+    node->instances_begin = 0;
+    node->instances_count = mPrimitives.size();
+    node->depth = 1;
+    SceneBVHState state{};
+    recursiveSplit(node, state);
+    return recursiveFlatten(node, instances);
+}
+
+int SceneBVH::emitSubtree(const SceneBVHUpdate &update, size_t index)
+{
+    if (update.live_counts[index] == 0)
+    {
+        return -1;
+    }
+    auto isLive = [](const SceneInstance &instance)
+    { return instance.mShape != removed_shape_index; };
+    const auto &node = update.nodes[index];
+    if (update.inserted.count(index) != 0)
+    {
+        // 收集子树中存活的实例和插入到子树(包括更深的子树)中的新实例, 在这一小段上重新构建
+        std::vector<SceneInstance> instances;
+        instances.reserve(update.live_counts[index]);
+        for (size_t i = index; i < index + update.node_counts[index]; i++)
+        {
+            const auto &subtree_node = update.nodes[i];
+            if (subtree_node.instances_count != 0)
+            {
+                std::copy_if(update.instances.begin() + subtree_node.instances_index, update.instances.begin() + subtree_node.instances_index + subtree_node.instances_count,
+                             std::back_inserter(instances), isLive);
+            }
+            if (auto iter = update.inserted.find(i); iter != update.inserted.end())
+            {
+                instances.insert(instances.end(), iter->second.begin(), iter->second.end());
+            }
+        }
+        return buildSubtree(std::move(instances));
+    }
+
+    int new_index = static_cast<int>(mNodes.size());
+    if (node.instances_count != 0)
+    {
+        // 叶子的包围盒在refit时已经跳过了删除的实例
+        mNodes.push_back(node);
+        mNodes[new_index].instances_index = mOrderedInstances.size();
+        std::copy_if(update.instances.begin() + node.instances_index, update.instances.begin() + node.instances_index + node.instances_count,
+                     std::back_inserter(mOrderedInstances), isLive);
+        mNodes[new_index].instances_count = mOrderedInstances.size() - mNodes[new_index].instances_index;
+        return new_index;
+    }
+    // 一边的实例全部被删除时, 用另一边的孩子代替这个节点
+    size_t left = index + 1, right = node.child;
+    if (update.live_counts[left] == 0 || update.live_counts[right] == 0)
+    {
+        return emitSubtree(update, update.live_counts[left] == 0 ? right : left);
+    }
+    mNodes.push_back(node);
+    emitSubtree(update, left);
+    mNodes[new_index].child = emitSubtree(update, right);
+    mNodes[new_index].bounds = mNodes[new_index + 1].bounds;
+    mNodes[new_index].bounds.expand(mNodes[mNodes[new_index].child].bounds);
+    return new_index;
+}
+
+bool SceneBVH::intersectRecord(const Ray &ray, float t_min, float &t_max, HitRecord &record) const
+{
+    bool hit = false;
 
     DEBUG_LINE(size_t bounds_test_count = 0)
 
@@ -52,10 +665,25 @@ std::optional<HitInfo> SceneBVH::intersect(const Ray &ray, float t_min, float t_
 
     glm::vec3 inv_dir = 1.0f / ray.mDirection;
 
-    std::array<int, 32> stack;
+    // 在对象空间中求交, 找到更近的交点时记录实例的编号
+    auto intersectInstance = [&](const SceneInstance &instance)
+    {
+        // 将世界空间中的光线转换到对象空间中，然后在对象空间进行相交测试
+        auto localRay = ray.objectFromWorld(instance.mObjectFromWorld);
+        const auto *shape = mShapes[instance.mShape];
+        if (instance.mNode == 0 ? shape->intersectRecord(localRay, t_min, t_max, record) : shape->intersectNode(instance.mNode, localRay, t_min, t_max, record))
+        {
+            record.instance = instance.mID;
+            hit = true;
+        }
+        DEBUG_LINE(ray.bounds_test_count += localRay.bounds_test_count)
+        DEBUG_LINE(ray.triangles_test_count += localRay.triangles_test_count)
+    };
+
+    TraversalStack<int, 64> stack(mMaxDepth);
     auto ptr = stack.begin();
     size_t current_node_index = 0;
-    while (true)
+    while (!mOrderedInstances.empty()) // 树中没有实例时根节点是一个空的叶子, 空包围盒总是通过相交测试, 不能进入遍历
     {
         auto &node = mNodes[current_node_index];
         DEBUG_LINE(bounds_test_count++)
@@ -83,20 +711,205 @@ std::optional<HitInfo> SceneBVH::intersect(const Ray &ray, float t_min, float t_
         else
         {
             auto instances_iter = mOrderedInstances.begin() + node.instances_index;
-            for (size_t i = 0; i < node.instances_count; ++i)
+            for (size_t i = 0; i < node.instances_count; ++i, ++instances_iter)
+            {
+                intersectInstance(*instances_iter);
+            }
+            if (ptr == stack.begin())
+                break;
+            current_node_index = *(--ptr);
+        }
+    }
+
+    // 无穷大的物体和还没插入树中的实例逐个求交
+    for (const auto &infinityInstance : mInfinityInstances)
+    {
+        intersectInstance(infinityInstance);
+    }
+    for (const auto &pendingInstance : mPendingInstances)
+    {
+        intersectInstance(pendingInstance);
+    }
+
+    DEBUG_LINE(ray.bounds_test_count += bounds_test_count)
+    return hit;
+}
+
+// 只对最近的交点做一次: 在实例的对象空间中计算交点和法线, 再转换到世界空间中
+HitInfo SceneBVH::resolveHit(const Ray &ray, const HitRecord &record) const
+{
+    const auto &instance = *mInstancesByID[record.instance];
+    const auto &transform = mTransforms[record.instance];
+    auto hitInfo = mShapes[instance.mShape]->resolveHit(ray.objectFromWorld(instance.mObjectFromWorld), record);
+    hitInfo.mHitPoint = transform.mWorldFromObject * glm::vec4(hitInfo.mHitPoint, 1);
+    // 转换法线到世界坐标系下, 法线转换需要使用变换矩阵的转置逆矩阵, 构建时已经算好
+    hitInfo.mNormal = glm::normalize(transform.mNormalFromObject * hitInfo.mNormal);
+    hitInfo.mMaterial = mMaterials[instance.mMaterial];
+    return hitInfo;
+}
+
+// 与BVH::intersectPacket相同的遍历, 叶子中把光线包变换到每个实例的对象空间再交给实例的形状
+// 没有命中叶子包围盒的光线在对象空间的光线包中t_max设为负无穷, 不参与实例的求交
+uint32_t SceneBVH::intersectPacket(RayPacket &packet, HitRecord *records) const
+{
+    if (!packet.coherent)
+    {
+        return Shape::intersectPacket(packet, records);
+    }
+
+    uint32_t hit_mask = 0;
+    float packet_t_max = packet.maxT();
+
+    DEBUG_LINE(size_t bounds_test_count = 0)
+
+    // 在对象空间中求交, 找到更近的交点时同时更新世界空间光线包的t_max
+    auto intersectInstance = [&](const SceneInstance &instance, uint32_t mask)
+    {
+        size_t ray_count = 0;
+        for (uint32_t bits = mask; bits != 0; bits &= bits - 1)
+        {
+            ray_count++;
+        }
+        if (ray_count < packet_min_ray_count) // 光线包已经发散, 变换和打包的开销不划算, 逐条光线求交
+        {
+            for (size_t i = 0; i < RAY_PACKET_SIZE; i++)
+            {
+                if ((mask & (1u << i)) == 0)
+                {
+                    continue;
+                }
+                auto localRay = packet.getRay(i).objectFromWorld(instance.mObjectFromWorld);
+                const auto *shape = mShapes[instance.mShape];
+                if (instance.mNode == 0 ? shape->intersectRecord(localRay, packet.t_min, packet.t_max[i], records[i]) : shape->intersectNode(instance.mNode, localRay, packet.t_min, packet.t_max[i], records[i]))
+                {
+                    records[i].instance = instance.mID;
+                    hit_mask |= 1u << i;
+                }
+                DEBUG_LINE(packet.bounds_test_count += localRay.bounds_test_count)
+                DEBUG_LINE(packet.triangles_test_count += localRay.triangles_test_count)
+            }
+            return;
+        }
+        auto localPacket = packet.objectFromWorld(instance.mObjectFromWorld, mask);
+        localPacket.update();
+        // 对象空间的t_max与世界空间相同, 实例只会写入命中更近交点的光线的记录
+        uint32_t local_hit_mask = mShapes[instance.mShape]->intersectPacketNode(instance.mNode, localPacket, records);
+        DEBUG_LINE(packet.bounds_test_count += localPacket.bounds_test_count)
+        DEBUG_LINE(packet.triangles_test_count += localPacket.triangles_test_count)
+        for (uint32_t bits = local_hit_mask; bits != 0; bits &= bits - 1)
+        {
+            size_t i = RayPacket::firstActive(bits, 0);
+            packet.t_max[i] = localPacket.t_max[i];
+            records[i].instance = instance.mID;
+        }
+        hit_mask |= local_hit_mask;
+    };
+
+    struct StackEntry
+    {
+        int index;
+        int first;
+    };
+    TraversalStack<StackEntry, 64> stack(mMaxDepth);
+    auto ptr = stack.begin();
+    StackEntry current{0, 0};
+    while (!mOrderedInstances.empty())
+    {
+        auto &node = mNodes[current.index];
+        DEBUG_LINE(bounds_test_count++)
+
+        size_t first = current.first;
+        if (!node.bounds.hasIntersection(packet, first))
+        {
+            uint32_t mask = node.bounds.mayIntersect(packet, packet_t_max) ? node.bounds.intersectPacket(packet, first + 1) : 0;
+            first = RayPacket::firstActive(mask, first + 1);
+            if (first == RAY_PACKET_SIZE)
+            {
+                if (ptr == stack.begin())
+                    break;
+                current = *(--ptr);
+                continue;
+            }
+        }
+        if (node.instances_count == 0)
+        {
+            if (packet.dir_is_neg[node.split_axis])
+            {
+                *(ptr++) = {current.index + 1, static_cast<int>(first)};
+                current = {node.child, static_cast<int>(first)};
+            }
+            else
+            {
+                current = {current.index + 1, static_cast<int>(first)};
+                *(ptr++) = {node.child, static_cast<int>(first)};
+            }
+        }
+        else
+        {
+            // 与单条光线一样, 到达叶子的光线测试叶子中的所有实例
+            uint32_t mask = node.bounds.intersectPacket(packet, first);
+            auto instances_iter = mOrderedInstances.begin() + node.instances_index;
+            for (size_t i = 0; i < node.instances_count; ++i, ++instances_iter)
+            {
+                intersectInstance(*instances_iter, mask);
+            }
+            packet_t_max = packet.maxT();
+            if (ptr == stack.begin())
+                break;
+            current = *(--ptr);
+        }
+    }
+
+    for (const auto &infinityInstance : mInfinityInstances)
+    {
+        intersectInstance(infinityInstance, (1u << RAY_PACKET_SIZE) - 1);
+    }
+    for (const auto &pendingInstance : mPendingInstances)
+    {
+        intersectInstance(pendingInstance, (1u << RAY_PACKET_SIZE) - 1);
+    }
+
+    DEBUG_LINE(packet.bounds_test_count += bounds_test_count)
+    return hit_mask;
+}
+
+bool SceneBVH::occluded(const Ray &ray, float t_min, float t_max) const
+{
+    DEBUG_LINE(size_t bounds_test_count = 0)
+
+    glm::vec3 inv_dir = 1.0f / ray.mDirection;
+
+    TraversalStack<int, 64> stack(mMaxDepth);
+    auto ptr = stack.begin();
+    size_t current_node_index = 0;
+    bool hit = false;
+    while (!hit && !mOrderedInstances.empty())
+    {
+        auto &node = mNodes[current_node_index];
+        DEBUG_LINE(bounds_test_count++)
+
+        if (!node.bounds.hasIntersection(ray, inv_dir, t_min, t_max))
+        {
+            if (ptr == stack.begin())
+                break;
+            current_node_index = *(--ptr);
+            continue;
+        }
+        if (node.instances_count == 0) // 不区分远近, 总是先访问紧跟在后面的左孩子
+        {
+            current_node_index++;
+            *(ptr++) = node.child;
+        }
+        else
+        {
+            auto instances_iter = mOrderedInstances.begin() + node.instances_index;
+            for (size_t i = 0; i < node.instances_count && !hit; ++i, ++instances_iter)
             {
-                // 将世界空间中的光线转换到对象空间中，然后在对象空间进行相交测试
                 auto localRay = ray.objectFromWorld(instances_iter->mObjectFromWorld);
-                auto hitInfo = instances_iter->mShape.intersect(localRay, t_min, t_max);
+                const auto *shape = mShapes[instances_iter->mShape];
+                hit = instances_iter->mNode == 0 ? shape->occluded(localRay, t_min, t_max) : shape->occludedNode(instances_iter->mNode, localRay, t_min, t_max);
                 DEBUG_LINE(ray.bounds_test_count += localRay.bounds_test_count)
                 DEBUG_LINE(ray.triangles_test_count += localRay.triangles_test_count)
-                if (hitInfo)
-                {
-                    t_max = hitInfo->mT;
-                    closestHitInfo = hitInfo;
-                    closestInstance = &(*instances_iter);
-                }
-                instances_iter++;
             }
             if (ptr == stack.begin())
                 break;
@@ -104,62 +917,112 @@ std::optional<HitInfo> SceneBVH::intersect(const Ray &ray, float t_min, float t_
         }
     }
 
-    // 无穷大的物体的相交测试
-    for (const auto &infinityInstance: mInfinityInstances)
+    for (const auto *instances : {&mInfinityInstances, &mPendingInstances})
     {
-        auto localRay = ray.objectFromWorld(infinityInstance.mObjectFromWorld);
-        auto hitInfo = infinityInstance.mShape.intersect(localRay, t_min, t_max);
-        DEBUG_LINE(ray.bounds_test_count += localRay.bounds_test_count)
-        DEBUG_LINE(ray.triangles_test_count += localRay.triangles_test_count)
-        if (hitInfo)
+        for (auto iter = instances->begin(); iter != instances->end() && !hit; ++iter)
         {
-            t_max = hitInfo->mT;
-            closestHitInfo = hitInfo;
-            closestInstance = &infinityInstance;
+            auto localRay = ray.objectFromWorld(iter->mObjectFromWorld);
+            const auto *shape = mShapes[iter->mShape];
+            hit = iter->mNode == 0 ? shape->occluded(localRay, t_min, t_max) : shape->occludedNode(iter->mNode, localRay, t_min, t_max);
+            DEBUG_LINE(ray.bounds_test_count += localRay.bounds_test_count)
+            DEBUG_LINE(ray.triangles_test_count += localRay.triangles_test_count)
         }
     }
 
-    // 将相交信息的交点和法向量转换到世界空间中
-    if (closestInstance)
+    DEBUG_LINE(ray.bounds_test_count += bounds_test_count)
+    return hit;
+}
+
+void SceneBVH::parallelSplit(SceneBVHTreeNode *root, SceneBVHState &state)
+{
+    std::vector<SceneBVHTreeNode *> top_nodes{root};
+    std::vector<SceneBVHTreeNode *> subtrees;
+    while (!top_nodes.empty())
     {
-        closestHitInfo->mHitPoint = closestInstance->mWorldFromObject * glm::vec4(closestHitInfo->mHitPoint, 1);
-        // 转换法线到世界坐标系下, 法线转换需要使用变换矩阵的转置逆矩阵
-        closestHitInfo->mNormal = glm::normalize(glm::vec3(glm::transpose(closestInstance->mObjectFromWorld) * glm::vec4(closestHitInfo->mNormal, 0)));
-        closestHitInfo->mMaterial = closestInstance->mMaterial;
+        auto *node = top_nodes.back();
+        top_nodes.pop_back();
+        if (node->instances_count < parallel_binning_threshold)
+        {
+            subtrees.push_back(node);
+            continue;
+        }
+        state.total_node_count++;
+        if (!splitNode(node, true, state))
+        {
+            state.addLeafNode(node);
+            continue;
+        }
+        top_nodes.push_back(node->children[1]);
+        top_nodes.push_back(node->children[0]);
     }
 
-    DEBUG_LINE(ray.bounds_test_count += bounds_test_count)
-    return closestHitInfo;
+    SpinLock stateLock{};
+    std::atomic<size_t> remaining{0};
+    for (auto *node : subtrees)
+    {
+        threadPool.addTask(new SceneBVHBuildTask(this, node, state, stateLock, remaining));
+    }
+    threadPool.waitUntil([&]
+                         { return remaining == 0; });
 }
 
-void SceneBVH::recursiveSplit(SceneBVHTreeNode *node, SceneBVHState &state)
+void SceneBVH::recursiveSplit(SceneBVHTreeNode *node, SceneBVHState &state, const SceneBVHBuildTask *task)
 {
     state.total_node_count++;
-    if (node->mInstances.size() == 1 || node->depth > 32)
+    if (!splitNode(node, false, state))
     {
         state.addLeafNode(node);
         return;
     }
-    auto diag = node->bounds.diagonal();
+    if (task != nullptr && node->children[1]->instances_count >= subtree_task_threshold)
+    {
+        threadPool.addTask(new SceneBVHBuildTask(*task, node->children[1]));
+    }
+    else
+    {
+        recursiveSplit(node->children[1], state, task);
+    }
+    recursiveSplit(node->children[0], state, task);
+}
+
+bool SceneBVH::splitNode(SceneBVHTreeNode *node, bool parallelBinning, SceneBVHState &state)
+{
+    if (node->instances_count == 1)
+    {
+        return false;
+    }
+    if (node->depth > max_sah_depth)
+    {
+        return medianSplitNode(node, state);
+    }
     float min_cost = std::numeric_limits<float>::infinity();
     size_t min_split_index = 0;
     Bounds min_leftBounds{}, min_rightBounds{};
     size_t min_leftInstanceCount = 0, min_rightInstanceCount = 0;
-    constexpr size_t bucket_count = 12;
-    std::vector<size_t> instance_indices_buckets[3][bucket_count] = {};
-    for (size_t axis = 0; axis < 3; axis++)
+
+    SceneBVHBuckets buckets{};
+    auto *primitives = mPrimitives.data() + node->instances_begin;
+    if (parallelBinning)
     {
-        Bounds bounds_bucket[bucket_count] = {};
-        size_t instance_count_buckets[bucket_count] = {};
-        size_t instance_idx = 0;
-        for (const auto &instance : node->mInstances)
+        constexpr size_t chunk_size = 1 << 12;
+        size_t chunk_count = (node->instances_count + chunk_size - 1) / chunk_size;
+        std::vector<SceneBVHBuckets> chunk_buckets(chunk_count);
+        threadPool.parallelFor(chunk_count, 1, [&](size_t chunk, size_t)
+                               { fillBuckets(node, primitives, chunk * chunk_size, glm::min((chunk + 1) * chunk_size, node->instances_count), chunk_buckets[chunk]); }, false);
+        for (const auto &chunk : chunk_buckets)
         {
-            size_t bucket_idx = glm::clamp<size_t>(glm::floor((instance.mCenter[axis] - node->bounds.b_min[axis]) * bucket_count / diag[axis]), 0.f, bucket_count - 1);
-            bounds_bucket[bucket_idx].expand(instance.bounds);
-            instance_count_buckets[bucket_idx]++;
-            instance_indices_buckets[axis][bucket_idx].push_back(instance_idx);
-            instance_idx++;
+            buckets.merge(chunk);
         }
+    }
+    else
+    {
+        fillBuckets(node, primitives, 0, node->instances_count, buckets);
+    }
+
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        const auto &bounds_bucket = buckets.bounds[axis];
+        const auto &instance_count_buckets = buckets.instance_count[axis];
 
         Bounds leftBounds = bounds_bucket[0];
         size_t leftInstanceCount = instance_count_buckets[0];
@@ -193,47 +1056,11 @@ void SceneBVH::recursiveSplit(SceneBVHTreeNode *node, SceneBVHState &state)
             leftBounds.expand(bounds_bucket[i]);
             leftInstanceCount += instance_count_buckets[i];
         }
-        // for (size_t i = 0; i < 11; i++)
-        // {
-        //     float mid = node->bounds.b_min[axis] + diag[axis] * (i + 1.f) * 0.0833333f;
-        //     Bounds leftBounds{}, rightBounds{};
-        //     std::vector<ShapeInstance> leftShapeInstances_temp, rightShapeInstances_temp;
-        //     for (const auto &ShapeInstance : node->mShapeInstances)
-        //     {
-        //         if ((ShapeInstance.p0[axis] + ShapeInstance.p1[axis] + ShapeInstance.p2[axis]) / 3.0f < mid)
-        //         {
-        //             leftBounds.expand(ShapeInstance.p0);
-        //             leftBounds.expand(ShapeInstance.p1);
-        //             leftBounds.expand(ShapeInstance.p2);
-        //             leftShapeInstances_temp.push_back(ShapeInstance);
-        //         }
-        //         else
-        //         {
-        //             rightBounds.expand(ShapeInstance.p0);
-        //             rightBounds.expand(ShapeInstance.p1);
-        //             rightBounds.expand(ShapeInstance.p2);
-        //             rightShapeInstances_temp.push_back(ShapeInstance);
-        //         }
-        //     }
-        //     if (leftShapeInstances_temp.empty() || rightShapeInstances_temp.empty())
-        //     {
-        //         continue;
-        //     }
-        //     float cost = leftBounds.area() * static_cast<float>(leftShapeInstances_temp.size()) + rightBounds.area() * static_cast<float>(rightShapeInstances_temp.size());
-        //     if (cost < min_cost)
-        //     {
-        //         min_cost = cost;
-        //         leftShapeInstances = std::move(leftShapeInstances_temp);
-        //         rightShapeInstances = std::move(rightShapeInstances_temp);
-        //         node->split_axis = axis;
-        //     }
-        // }
-    }
-
-    if (min_split_index == 0)
+    }
+
+    if (min_split_index == 0) // 实例中心都落在同一个桶里
     {
-        state.addLeafNode(node);
-        return;
+        return medianSplitNode(node, state);
     }
 
     auto *leftNode = mAllocator.allocate();
@@ -241,50 +1068,77 @@ void SceneBVH::recursiveSplit(SceneBVHTreeNode *node, SceneBVHState &state)
     node->children[0] = leftNode;
     node->children[1] = rightNode;
 
-    leftNode->mInstances.reserve(min_leftInstanceCount);
-    rightNode->mInstances.reserve(min_rightInstanceCount);
-    for (size_t i = 0; i < min_split_index; i++)
+    // 原地划分实例引用, 左边桶的引用放在前面, 右边桶的引用放在后面, 左右子节点各自占据父节点范围的一段
+    auto diag = node->bounds.diagonal();
+    std::partition(primitives, primitives + node->instances_count, [&](const SceneBVHPrimitive &primitive)
+                   { return bucketIndex(primitive, node->bounds, diag, node->split_axis) < min_split_index; });
+    leftNode->instances_begin = node->instances_begin;
+    leftNode->instances_count = min_leftInstanceCount;
+    rightNode->instances_begin = node->instances_begin + min_leftInstanceCount;
+    rightNode->instances_count = min_rightInstanceCount;
+
+    leftNode->depth = node->depth + 1;
+    rightNode->depth = node->depth + 1;
+    leftNode->bounds = min_leftBounds;
+    rightNode->bounds = min_rightBounds;
+    return true;
+}
+
+bool SceneBVH::medianSplitNode(SceneBVHTreeNode *node, SceneBVHState &state)
+{
+    if (node->instances_count <= max_leaf_instance_count)
     {
-        for (size_t idx : instance_indices_buckets[node->split_axis][i])
-        {
-            leftNode->mInstances.push_back(node->mInstances[idx]);
-        }
+        return false;
     }
-    for (size_t i = min_split_index; i < bucket_count; i++)
+    state.median_split_count++;
+    auto *primitives = mPrimitives.data() + node->instances_begin;
+    Bounds center_bounds{};
+    for (size_t i = 0; i < node->instances_count; i++)
     {
-        for (size_t idx : instance_indices_buckets[node->split_axis][i])
-        {
-            rightNode->mInstances.push_back(node->mInstances[idx]);
-        }
+        center_bounds.expand(primitives[i].center);
     }
+    auto diag = center_bounds.diagonal();
+    node->split_axis = diag.x > diag.y ? (diag.x > diag.z ? 0 : 2) : (diag.y > diag.z ? 1 : 2);
+    size_t half = node->instances_count / 2;
+    std::nth_element(primitives, primitives + half, primitives + node->instances_count, [axis = node->split_axis](const SceneBVHPrimitive &a, const SceneBVHPrimitive &b)
+                     { return a.center[axis] < b.center[axis]; });
 
-    node->mInstances.clear();
-    node->mInstances.shrink_to_fit();
+    auto *leftNode = mAllocator.allocate();
+    auto *rightNode = mAllocator.allocate();
+    node->children[0] = leftNode;
+    node->children[1] = rightNode;
+    leftNode->instances_begin = node->instances_begin;
+    leftNode->instances_count = half;
+    rightNode->instances_begin = node->instances_begin + half;
+    rightNode->instances_count = node->instances_count - half;
+    for (size_t i = 0; i < node->instances_count; i++)
+    {
+        (i < half ? leftNode : rightNode)->bounds.expand(primitives[i].bounds);
+    }
     leftNode->depth = node->depth + 1;
     rightNode->depth = node->depth + 1;
-    leftNode->bounds = min_leftBounds;
-    rightNode->bounds = min_rightBounds;
-    recursiveSplit(leftNode, state);
-    recursiveSplit(rightNode, state);
+    return true;
 }
 
-size_t SceneBVH::recursiveFlatten(SceneBVHTreeNode *node)
+// 叶子的实例按深度优先的顺序移动到mOrderedInstances, 遍历一个叶子时它的实例在内存中是连续的
+size_t SceneBVH::recursiveFlatten(SceneBVHTreeNode *node, std::vector<SceneInstance> &instances)
 {
-    SceneBVHNode sceneBVHNode{node->bounds, 0, static_cast<uint16_t>(node->mInstances.size()), static_cast<uint8_t>(node->split_axis)};
+    bool is_leaf = node->children[0] == nullptr;
+    SceneBVHNode sceneBVHNode{node->bounds, 0, static_cast<uint16_t>(is_leaf ? node->instances_count : 0), static_cast<uint8_t>(node->split_axis)};
     auto index = mNodes.size();
     mNodes.push_back(sceneBVHNode);
-    if (sceneBVHNode.instances_count == 0)
+    if (!is_leaf)
     {
-        recursiveFlatten(node->children[0]);
-        mNodes[index].child = recursiveFlatten(node->children[1]);
+        recursiveFlatten(node->children[0], instances);
+        mNodes[index].child = recursiveFlatten(node->children[1], instances);
     }
     else
     {
         mNodes[index].instances_index = mOrderedInstances.size();
-        for (const auto &instance : node->mInstances)
+        for (size_t i = node->instances_begin; i < node->instances_begin + node->instances_count; i++)
         {
-            mOrderedInstances.push_back(instance);
+            mOrderedInstances.push_back(instances[mPrimitives[i].index]);
         }
     }
     return index;
-}
\ No newline at end of file
+}
@@ -1,49 +1,63 @@
 #pragma once
 #include "bounds.hpp"
 #include "../mesh/shape.hpp"
+#include "../../application/spinLock.hpp"
+#include "traversalStack.hpp"
+#include "../until/alignedAllocator.hpp"
 #include <vector>
+#include <unordered_map>
 
+// Scene中添加的实例, 构建前由Scene保存, 构建后添加的实例直接交给SceneBVH, 都转换成紧凑的SceneInstance
 struct ShapeInstance
 {
     const Shape &mShape;
     const Material *mMaterial;
     glm::mat4 mWorldFromObject; // world
-    glm::mat4 mObjectFromWorld; // local
+};
+
+// 遍历时访问的紧凑实例记录, 按叶子的顺序连续存放, 每个实例正好占一条cache line
+// 形状和材质按索引引用SceneBVH中去重后的表, 实例数量很多时大多引用同几个模型
+// 被打开(rebraiding)的实例有多条记录, 编号和变换都相同, 各自引用形状内部的一个节点
+struct alignas(64) SceneInstance
+{
+    glm::mat4x3 mObjectFromWorld; // local, 仿射变换的最后一行总是(0, 0, 0, 1), 只存3x4
+    uint32_t mShape;              // 形状在SceneBVH::mShapes中的索引
+    uint32_t mMaterial;           // 材质在SceneBVH::mMaterials中的索引
+    uint32_t mID;                 // 实例在Scene中添加的顺序, 构建后用于定位实例
+    uint32_t mNode;               // 记录引用的形状内部节点, 没有打开的实例为根节点0
+};
+static_assert(sizeof(SceneInstance) == 64, "instance records should fill exactly one cache line");
+using SceneInstanceArray = std::vector<SceneInstance, AlignedAllocator<SceneInstance, 64>>;
 
-    Bounds bounds{}; // 世界空间中的包围盒
-    glm::vec3 mCenter{}; // 包围盒的中心
+// 只在计算最近交点的信息和update时访问的变换, 按实例编号存放, 不占用遍历的cache
+struct SceneInstanceTransform
+{
+    glm::mat4x3 mWorldFromObject; // world
+    glm::mat3 mNormalFromObject;  // 法线的变换矩阵, 即objectFromWorld的转置
 
-    void updateBounds() // 将对象空间中的包围盒转换到世界空间中
+    void set(const glm::mat4 &worldFromObject, const glm::mat4 &objectFromWorld)
     {
-        bounds = {};
-        auto bounds_local = mShape.getBounds();
-        // 遍历8个角点，将它们转换到世界空间中，然后扩展包围盒
-        for (size_t i = 0; i < 8; i++)
-        {
-            auto corner_local = bounds_local.getCorner(i);
-            glm::vec3 corner_world = mWorldFromObject * glm::vec4(corner_local, 1.f);
-            bounds.expand(corner_world);
-        }
-        mCenter = (bounds.b_min + bounds.b_max) * 0.5f;
+        mWorldFromObject = glm::mat4x3(worldFromObject);
+        mNormalFromObject = glm::transpose(glm::mat3(objectFromWorld));
     }
 };
 
+// 构建时对实例的引用, 只记录分桶需要的包围盒和中心, 分割时原地划分引用数组而不是拷贝实例
+struct SceneBVHPrimitive
+{
+    Bounds bounds{};    // 实例在世界空间中的包围盒
+    glm::vec3 center{}; // 包围盒的中心
+    uint32_t index;     // 实例在构建用的实例数组中的位置
+};
+
 struct SceneBVHTreeNode
 {
     Bounds bounds{};
-    std::vector<ShapeInstance> mInstances;
-    SceneBVHTreeNode *children[2];
+    size_t instances_begin{}; // 节点的实例引用在引用数组中的起始位置
+    size_t instances_count{}; // 节点的实例引用数量
+    SceneBVHTreeNode *children[2]{}; // 叶子节点为空
     size_t depth;
     size_t split_axis;
-
-    void updateBounds()
-    {
-        bounds = {};
-        for (const auto &instance : mInstances)
-        {
-            bounds.expand(instance.bounds);
-        }
-    }
 };
 
 struct alignas(32) SceneBVHNode
@@ -64,13 +78,23 @@ struct SceneBVHState
     size_t leaf_node_count{};
     size_t max_leaf_node_instance_count{};
     size_t max_leaf_node_depth{};
+    size_t median_split_count{}; // SAH失败或者树太深时退回中位数分割的次数
 
     void addLeafNode(SceneBVHTreeNode *node)
     {
         leaf_node_count++;
-        max_leaf_node_instance_count = glm::max(max_leaf_node_instance_count, node->mInstances.size());
+        max_leaf_node_instance_count = glm::max(max_leaf_node_instance_count, node->instances_count);
         max_leaf_node_depth = glm::max(max_leaf_node_depth, node->depth);
     }
+
+    void merge(const SceneBVHState &other)
+    {
+        total_node_count += other.total_node_count;
+        leaf_node_count += other.leaf_node_count;
+        max_leaf_node_instance_count = glm::max(max_leaf_node_instance_count, other.max_leaf_node_instance_count);
+        max_leaf_node_depth = glm::max(max_leaf_node_depth, other.max_leaf_node_depth);
+        median_split_count += other.median_split_count;
+    }
 };
 
 struct SceneBVHTreeNodeAllcator
@@ -79,6 +103,7 @@ public:
     SceneBVHTreeNodeAllcator() : ptr(4096) {}
     SceneBVHTreeNode *allocate()
     {
+        Guard guard(mSpinLock);
         if (ptr == 4096)
         {
             nodes_list.push_back(new SceneBVHTreeNode[4096]);
@@ -86,35 +111,97 @@ public:
         }
         return &nodes_list.back()[ptr++];
     }
-    ~SceneBVHTreeNodeAllcator()
+    ~SceneBVHTreeNodeAllcator() { clear(); }
+
+    void clear()
     {
+        Guard guard(mSpinLock);
         for (auto *nodes : nodes_list)
         {
             delete[] nodes;
         }
         nodes_list.clear();
+        nodes_list.shrink_to_fit();
+        ptr = 4096;
     }
 
 private:
     size_t ptr;
     std::vector<SceneBVHTreeNode *> nodes_list;
+    SpinLock mSpinLock{};
 };
 
+struct SceneBVHBuildOptions
+{
+    bool parallel{true}; // 顶层节点并行分桶, 子树作为任务提交给全局线程池并行构建
+    // 实例重编(rebraiding): 构建时优先打开世界空间包围盒最大的实例, 用它们BVH的上层节点代替实例插入场景BVH中
+    // 互相重叠的大实例被拆开后, 顶层树可以分开它们的上层节点, 光线不必进入每个重叠的实例再从根节点重新遍历
+    // 每条记录都要单独变换光线, 实例重叠不多时得不偿失, 默认关闭
+    bool rebraid{false};
+    float rebraid_budget{1.f}; // 打开实例新增的记录最多为实例数量的该倍数, 实例很少时至少允许rebraid_min_records条
+    size_t rebraid_min_records{16};
+};
+
+class SceneBVHBuildTask;
+struct SceneBVHUpdate;
+
 class SceneBVH : public Shape
 {
 public:
-    void build(std::vector<ShapeInstance> &&instances);
-    std::optional<HitInfo> intersect(const Ray &ray, float t_min, float t_max) const override;
+    void build(std::vector<ShapeInstance> &&instances, const SceneBVHBuildOptions &options = {});
+    bool intersectRecord(const Ray &ray, float t_min, float &t_max, HitRecord &record) const override; // 记录中的instance为实例的编号
+    HitInfo resolveHit(const Ray &ray, const HitRecord &record) const override;                        // 交点和法线转换到世界空间, 并填写实例的材质
+    bool occluded(const Ray &ray, float t_min, float t_max) const override; // 任意一个实例遮挡就返回, 不转换交点和法线
+    uint32_t intersectPacket(RayPacket &packet, HitRecord *records) const override;
     Bounds getBounds() const override { return mNodes[0].bounds; }
+    size_t addInstance(const ShapeInstance &instance);              // 构建后添加实例, 返回实例的编号; update之前不在树中, 逐个求交
+    void removeInstance(size_t id);                                 // 构建后删除实例, 树中的记录在update时才移除
+    void setTransform(size_t id, const glm::mat4 &worldFromObject); // 更新变换矩阵, 包围盒要等update时再更新
+    // 应用构建后的添加、删除和移动, 实例引用的模型refit后也要调用: 先自底向上更新包围盒,
+    // 新实例和移出原叶子的实例插入到代价最小的小子树中, 只重新构建这些子树, 模型的BVH不受影响
+    // 返回true表示改动太多或者树的质量下降太多, 已经重新构建整棵树
+    // 被打开的实例引用的形状重新构建过内部层次(如Model::refit返回true)时, 记录引用的节点已经失效, 总是重新构建并重新打开
+    bool update(float rebuild_threshold = 1.5f);
+    void rebuild(); // 收集所有存活的实例重新构建整棵树, 实例按构建参数重新打开
 
 private:
-    void recursiveSplit(SceneBVHTreeNode *node, SceneBVHState &state);
-    size_t recursiveFlatten(SceneBVHTreeNode *node);
+    friend class SceneBVHBuildTask;
+    SceneInstance makeInstance(const ShapeInstance &instance, uint32_t id); // 形状和材质去重后按索引引用, 同时写入实例的变换
+    void buildTree(std::vector<SceneInstance> &&instances); // 构建后instances按叶子的顺序移动到mOrderedInstances
+    void openInstances(std::vector<SceneInstance> &instances); // 按构建参数打开实例, 打开的节点换成两个孩子的记录追加到instances末尾
+    void indexRecords();                                       // 从mOrderedInstances重新建立mInstancesByID和mOpenedRecords
+    template <typename F>
+    void forEachRecord(size_t id, const F &f); // 对实例的每一条记录调用f, 包括树中的和等待插入的记录
+    void appendInstance(SceneInstanceArray &instances, const SceneInstance &instance); // 添加到不在树中的实例数组, 扩容后更新mInstancesByID
+    void refitLeaves();                                      // 自底向上更新包围盒, 叶子跳过已经删除的实例
+    int buildSubtree(std::vector<SceneInstance> &&instances); // 串行构建一棵子树, 展平到mNodes和mOrderedInstances的末尾, 返回子树根节点的索引
+    int emitSubtree(const SceneBVHUpdate &update, size_t index); // update时把旧树的一棵子树重新输出到mNodes, 子树为空时返回-1
+    Bounds instanceBounds(const SceneInstance &instance) const; // 将对象空间中的包围盒转换到世界空间中
+    bool splitNode(SceneBVHTreeNode *node, bool parallelBinning, SceneBVHState &state);
+    bool medianSplitNode(SceneBVHTreeNode *node, SceneBVHState &state); // SAH失败时按中位数分割, 实例不多时返回false作为叶子
+    void parallelSplit(SceneBVHTreeNode *root, SceneBVHState &state);
+    void recursiveSplit(SceneBVHTreeNode *node, SceneBVHState &state, const SceneBVHBuildTask *task = nullptr);
+    size_t recursiveFlatten(SceneBVHTreeNode *node, std::vector<SceneInstance> &instances);
 
 private:
     SceneBVHTreeNodeAllcator mAllocator{};
     std::vector<SceneBVHNode> mNodes;
     SceneBVHTreeNode *root;
-    std::vector<ShapeInstance> mOrderedInstances;
-    std::vector<ShapeInstance> mInfinityInstances; // 存储无穷大的物体
+    std::vector<SceneBVHPrimitive> mPrimitives; // 构建时的实例引用数组, 构建完成后释放
+    SceneInstanceArray mOrderedInstances;
+    SceneInstanceArray mInfinityInstances; // 存储无穷大的物体
+    SceneInstanceArray mPendingInstances;  // 构建后添加或者移出原叶子的实例, 等待update插入树中
+    std::vector<SceneInstance *> mInstancesByID;          // 按添加顺序索引到实例的记录, 删除的实例为空; 打开的实例指向其中任意一条记录
+    std::unordered_map<uint32_t, std::vector<SceneInstance *>> mOpenedRecords; // 被打开的实例在mOrderedInstances中的所有记录
+    std::unordered_map<uint32_t, uint32_t> mOpenedGenerations; // 被打开的形状(在mShapes中的索引)打开时的节点编号版本
+    std::vector<SceneInstanceTransform> mTransforms;      // 按实例编号存放
+    std::vector<const Shape *> mShapes;                   // 实例引用的形状, 去重后的表
+    std::vector<const Material *> mMaterials;             // 实例引用的材质, 去重后的表
+    std::unordered_map<const Shape *, uint32_t> mShapeIndices;
+    std::unordered_map<const Material *, uint32_t> mMaterialIndices;
+    std::vector<uint32_t> mMovedIDs; // 构建后变换改变过的实例, update时检查是否移出了原来的叶子
+    size_t mRemovedCount{};          // 树中已经删除、等待update移除的实例数量
+    SceneBVHBuildOptions mOptions{};
+    float mBuildSAHCost{};
+    size_t mMaxDepth{}; // 树的最大深度, 决定遍历栈的大小
 };
\ No newline at end of file
@@ -0,0 +1,25 @@
+#pragma once
+#include <array>
+#include <vector>
+
+// 遍历栈: 容量由构建时记录的树深度决定, 不超过N时用栈上的数组, 否则在堆上分配
+// 构建时限制了SAH分割的深度, 正常的树总是用栈上的数组
+template <typename T, size_t N>
+class TraversalStack
+{
+public:
+    explicit TraversalStack(size_t capacity)
+    {
+        if (capacity > N)
+        {
+            mHeap.resize(capacity);
+            mData = mHeap.data();
+        }
+    }
+    T *begin() { return mData; }
+
+private:
+    std::array<T, N> mArray;
+    std::vector<T> mHeap;
+    T *mData{mArray.data()};
+};
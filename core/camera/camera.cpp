@@ -31,6 +31,20 @@ Ray Camera::generateRay(const glm::ivec2 &pixelCoord, const glm::vec2 &offset) c
     return Ray{mPosition, glm::normalize(world - mPosition)}; // 光线方向是相机指向像素
 }
 
+RayPacket Camera::generateRayPacket(const glm::ivec2 &tileOrigin, const glm::vec2 *offsets) const
+{
+    RayPacket packet;
+    glm::ivec2 maxCoord{mFilm.getWidth() - 1, mFilm.getHeight() - 1};
+    for (size_t i = 0; i < RAY_PACKET_SIZE; i++)
+    {
+        glm::ivec2 pixelCoord = glm::min(tileOrigin + glm::ivec2(i % RAY_PACKET_WIDTH, i / RAY_PACKET_WIDTH), maxCoord);
+        packet.setRay(i, generateRay(pixelCoord, offsets ? offsets[i] : glm::vec2{0.5f, 0.5f}));
+        packet.t_max[i] = std::numeric_limits<float>::infinity();
+    }
+    packet.update();
+    return packet;
+}
+
 void Camera::move(float dt, Direction direction)
 {
     glm::vec3 forward = mViewDirection;
@@ -1,6 +1,7 @@
 #pragma once
 #include "../../application/film.hpp"
 #include "../ray.hpp"
+#include "../rayPacket.hpp"
 
 enum class Direction
 {
@@ -17,6 +18,9 @@ class Camera
 public:
     Camera(Film &film, const glm::vec3 &position, const glm::vec3 &viewpoint, float fovy);
     Ray generateRay(const glm::ivec2 &pixelCoord, const glm::vec2 &offset = {0.5f, 0.5f}) const;
+    // 以tileOrigin为左上角的RAY_PACKET_WIDTH x RAY_PACKET_WIDTH个像素的光线包, 按行存储; offsets为空时取像素中心
+    // 超出胶片的像素用胶片边缘的像素代替, 保证光线包总是满的
+    RayPacket generateRayPacket(const glm::ivec2 &tileOrigin, const glm::vec2 *offsets = nullptr) const;
 
     Film &getFilm() { return mFilm; }
     const Film &getFilm() const { return mFilm; }
@@ -2,7 +2,10 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <unordered_map>
 #include <rapidobj/rapidobj.hpp>
+#include "../until/mappedFile.hpp"
+#include "../until/hash.hpp"
 
 // Model::Model(const std::filesystem::path &fileName)
 // {
@@ -52,10 +55,60 @@
 //     buildBounds();
 // }
 
-Model::Model(const std::filesystem::path &fileName)
+Model::Model(const std::vector<Triangle> &triangles, const BVHBuildOptions &options)
 {
+    TriangleMesh mesh;
+    mesh.positions.reserve(triangles.size() * 3);
+    mesh.normals.reserve(triangles.size() * 3);
+    mesh.indices.reserve(triangles.size());
+    for (const auto &triangle : triangles)
+    {
+        uint32_t index = static_cast<uint32_t>(mesh.positions.size());
+        mesh.positions.insert(mesh.positions.end(), {triangle.p0, triangle.p1, triangle.p2});
+        mesh.normals.insert(mesh.normals.end(), {triangle.n0, triangle.n1, triangle.n2});
+        mesh.indices.push_back({index, index + 1, index + 2});
+    }
+    build(std::move(mesh), options);
+}
+
+Model::Model(const std::filesystem::path &fileName, const BVHBuildOptions &options)
+{
+    // 缓存按源文件的内容而不是修改时间判断是否有效, 哈希映射后的文件比解析快得多
+    uint64_t content_hash = 0;
+    auto cache_path = fileName;
+    cache_path += ".bvhcache";
+    if (options.disk_cache)
+    {
+        MappedFile file(fileName);
+        content_hash = hashBytes(file.data(), file.size());
+        if (file.isOpen() && mBVH.loadCache(cache_path, content_hash, options))
+        {
+            return;
+        }
+    }
+
     auto result = rapidobj::ParseFile(fileName, rapidobj::MaterialLibrary::Ignore());
-    std::vector<Triangle> triangles;
+    const auto &positions = result.attributes.positions;
+    const auto &normals = result.attributes.normals;
+
+    // obj的面按位置和法线分别索引, 两个索引都相同的顶点才能共享, 用(位置索引, 法线索引)作为键合并顶点
+    TriangleMesh mesh;
+    std::unordered_map<uint64_t, uint32_t> vertex_map;
+    vertex_map.reserve(positions.size() / 3);
+    auto addVertex = [&](const rapidobj::Index &index, bool has_normal) -> uint32_t
+    {
+        int normal_index = has_normal ? index.normal_index : -1;
+        uint64_t key = (static_cast<uint64_t>(index.position_index) << 32) | static_cast<uint32_t>(normal_index + 1);
+        auto [iter, inserted] = vertex_map.try_emplace(key, static_cast<uint32_t>(mesh.positions.size()));
+        if (inserted)
+        {
+            mesh.positions.emplace_back(positions[3 * index.position_index + 0], positions[3 * index.position_index + 1], positions[3 * index.position_index + 2]);
+            // 没有法线的顶点记为0, 命中时使用三角形的几何法线
+            mesh.normals.push_back(has_normal ? glm::vec3{normals[3 * normal_index + 0], normals[3 * normal_index + 1], normals[3 * normal_index + 2]} : glm::vec3{0.f});
+        }
+        return iter->second;
+    };
+
     for (const auto &shape : result.shapes)
     {
         size_t index_offset = 0;
@@ -63,63 +116,64 @@ Model::Model(const std::filesystem::path &fileName)
         {
             if (num_face_vertices == 3)
             {
-                auto index = shape.mesh.indices[index_offset];
-                glm::vec3 pos0{
-                    result.attributes.positions[3 * index.position_index + 0],
-                    result.attributes.positions[3 * index.position_index + 1],
-                    result.attributes.positions[3 * index.position_index + 2]};
-
-                index = shape.mesh.indices[index_offset + 1];
-                glm::vec3 pos1{
-                    result.attributes.positions[3 * index.position_index + 0],
-                    result.attributes.positions[3 * index.position_index + 1],
-                    result.attributes.positions[3 * index.position_index + 2]};
-
-                index = shape.mesh.indices[index_offset + 2];
-                glm::vec3 pos2{
-                    result.attributes.positions[3 * index.position_index + 0],
-                    result.attributes.positions[3 * index.position_index + 1],
-                    result.attributes.positions[3 * index.position_index + 2]};
-
-                if (index.normal_index >= 0)
-                {
-                    index = shape.mesh.indices[index_offset];
-                    glm::vec3 normal0{
-                        result.attributes.normals[3 * index.normal_index + 0],
-                        result.attributes.normals[3 * index.normal_index + 1],
-                        result.attributes.normals[3 * index.normal_index + 2]};
-
-                    index = shape.mesh.indices[index_offset + 1];
-                    glm::vec3 normal1{
-                        result.attributes.normals[3 * index.normal_index + 0],
-                        result.attributes.normals[3 * index.normal_index + 1],
-                        result.attributes.normals[3 * index.normal_index + 2]};
-
-                    index = shape.mesh.indices[index_offset + 2];
-                    glm::vec3 normal2{
-                        result.attributes.normals[3 * index.normal_index + 0],
-                        result.attributes.normals[3 * index.normal_index + 1],
-                        result.attributes.normals[3 * index.normal_index + 2]};
-
-                    triangles.push_back(Triangle(pos0, pos1, pos2, normal0, normal1, normal2));
-                }
-                else
-                {
-                    triangles.push_back(Triangle(pos0, pos1, pos2));
-                }
+                const auto *index = &shape.mesh.indices[index_offset];
+                bool has_normal = index[0].normal_index >= 0 && index[1].normal_index >= 0 && index[2].normal_index >= 0;
+                mesh.indices.push_back({addVertex(index[0], has_normal), addVertex(index[1], has_normal), addVertex(index[2], has_normal)});
             }
             index_offset += num_face_vertices;
         }
     }
 
-    if (triangles.empty())
+    bool has_triangles = !mesh.indices.empty();
+    if (!has_triangles)
     {
         std::cerr << "Warning: No triangles loaded from " << fileName << std::endl;
     }
-    mBVH.build(std::move(triangles));
+    if (options.disk_cache && has_triangles)
+    {
+        mCachePath = cache_path;
+        mContentHash = content_hash;
+    }
+    build(std::move(mesh), options);
+}
+
+void Model::build(TriangleMesh &&mesh, const BVHBuildOptions &options)
+{
+    mMesh = std::move(mesh);
+    mOptions = options;
+    if (!options.lazy)
+    {
+        buildBVH();
+        return;
+    }
+    // 只遍历一次三角形的顶点求包围盒, 与构建后根节点的包围盒相同
+    for (const auto &index : mMesh.indices)
+    {
+        mBounds.expand(mMesh.positions[index.x]);
+        mBounds.expand(mMesh.positions[index.y]);
+        mBounds.expand(mMesh.positions[index.z]);
+    }
+    mBuilt.store(false, std::memory_order_release);
+}
+
+void Model::buildBVH() const
+{
+    mBVH.build(std::move(mMesh), mOptions);
+    if (!mCachePath.empty())
+    {
+        mBVH.saveCache(mCachePath, mContentHash);
+    }
 }
 
-std::optional<HitInfo> Model::intersect(const Ray &ray, float t_min, float t_max) const
+void Model::lazyBuild() const
 {
-    return mBVH.intersect(ray, t_min, t_max);
+    // 渲染线程本身就是线程池的工作线程, 构建作为任务提交, 不持有任何锁, 等待时执行的渲染任务再次到达这个模型也只是嵌套等待
+    // 构建仍按mOptions.parallel把子树交给线程池, 等待的线程会帮忙执行
+    std::call_once(mBuildOnce, [this]
+                   { mBuildFuture = threadPool.submit([this]
+                                                      {
+                                                          buildBVH();
+                                                          mBuilt.store(true, std::memory_order_release);
+                                                      }); });
+    mBuildFuture.wait();
 }
\ No newline at end of file
@@ -1,21 +1,90 @@
 #pragma once
 #include "triangle.hpp"
+#include "triangleMesh.hpp"
 #include "../accelerate/bvh.hpp"
+#include "../../application/threadPool.hpp"
 #include <vector>
 #include <filesystem>
+#include <atomic>
+#include <mutex>
 class Model : public Shape
 {
 public:
-    Model(const std::vector<Triangle> &triangles)
+    Model(const std::vector<Triangle> &triangles, const BVHBuildOptions &options = {}); // 每个三角形的顶点各自独立, 不做合并
+    Model(TriangleMesh &&mesh, const BVHBuildOptions &options = {}) { build(std::move(mesh), options); }
+    Model(const std::filesystem::path &fileName, const BVHBuildOptions &options = {}); // 位置索引和法线索引都相同的顶点只存一份
+
+    bool intersectRecord(const Ray &ray, float t_min, float &t_max, HitRecord &record) const override { return reachBVH(ray, t_min, t_max) && mBVH.intersectRecord(ray, t_min, t_max, record); }
+    HitInfo resolveHit(const Ray &ray, const HitRecord &record) const override { return mBVH.resolveHit(ray, record); }
+    bool occluded(const Ray &ray, float t_min, float t_max) const override { return reachBVH(ray, t_min, t_max) && mBVH.occluded(ray, t_min, t_max); }
+    uint32_t intersectPacket(RayPacket &packet, HitRecord *records) const override { return reachBVH(packet) ? mBVH.intersectPacket(packet, records) : 0; }
+    Bounds getBounds() const override { return isBuilt() ? mBVH.getBounds() : mBounds; }
+    // 还没有构建的模型没有内部节点, 实例重编不会为了打开它而触发构建
+    bool getNodeChildren(uint32_t node, uint32_t children[2]) const override { return isBuilt() && mBVH.getNodeChildren(node, children); }
+    Bounds getNodeBounds(uint32_t node) const override { return isBuilt() ? mBVH.getNodeBounds(node) : mBounds; }
+    uint32_t getNodeGeneration() const override { return mBVH.getNodeGeneration(); }
+    bool intersectNode(uint32_t node, const Ray &ray, float t_min, float &t_max, HitRecord &record) const override { return reachBVH(ray, t_min, t_max) && mBVH.intersectNode(node, ray, t_min, t_max, record); }
+    bool occludedNode(uint32_t node, const Ray &ray, float t_min, float t_max) const override { return reachBVH(ray, t_min, t_max) && mBVH.occludedNode(node, ray, t_min, t_max); }
+    uint32_t intersectPacketNode(uint32_t node, RayPacket &packet, HitRecord *records) const override { return reachBVH(packet) ? mBVH.intersectPacketNode(node, packet, records) : 0; }
+    // 网格变形后更新BVH, 引用该模型的实例需要再调用Scene::update更新场景的包围盒
+    // 返回true时BVH已经重新构建, 节点重新编号, 之后的Scene::update会发现被打开的实例引用的节点失效并重新构建场景BVH
+    bool refit(const std::vector<glm::vec3> &positions, const std::vector<glm::vec3> &normals = {})
     {
-        auto ts = triangles;
-        mBVH.build(std::move(ts));
+        ensureBuilt();
+        return mBVH.refit(positions, normals);
     }
-    Model(const std::filesystem::path &fileName);
 
-    std::optional<HitInfo> intersect(const Ray &ray, float t_min, float t_max) const override;
-    Bounds getBounds() const override { return mBVH.getBounds(); }
+private:
+    void build(TriangleMesh &&mesh, const BVHBuildOptions &options); // 立即构建, 或者延迟构建时只记录网格和包围盒
+    void buildBVH() const;                                           // 用记录的网格构建BVH, 有缓存路径时写入磁盘缓存
+    void lazyBuild() const;                                          // 第一个到达的线程把构建提交给线程池, 所有到达的线程等待构建完成
+    bool isBuilt() const { return mBuilt.load(std::memory_order_acquire); }
+    void ensureBuilt() const
+    {
+        if (!isBuilt())
+        {
+            lazyBuild();
+        }
+    }
+    // 延迟构建时, 只有到达模型包围盒的光线才构建(或等待)BVH, 其余光线直接返回, 不受正在进行的构建影响
+    bool reachBVH(const Ray &ray, float t_min, float t_max) const
+    {
+        if (isBuilt())
+        {
+            return true;
+        }
+        if (!mBounds.hasIntersection(ray, t_min, t_max))
+        {
+            return false;
+        }
+        lazyBuild();
+        return true;
+    }
+    bool reachBVH(const RayPacket &packet) const
+    {
+        if (isBuilt())
+        {
+            return true;
+        }
+        for (size_t i = 0; i < RAY_PACKET_SIZE; i++)
+        {
+            if (mBounds.hasIntersection(packet, i))
+            {
+                lazyBuild();
+                return true;
+            }
+        }
+        return false;
+    }
 
 private:
-    BVH mBVH{};
-};
\ No newline at end of file
+    mutable BVH mBVH{};
+    mutable TriangleMesh mMesh;         // 等待构建的网格, 构建时移动给BVH
+    BVHBuildOptions mOptions{};         // 等待构建时的参数
+    Bounds mBounds{};                   // 加载时计算的网格包围盒, 构建之前代替BVH根节点的包围盒
+    std::filesystem::path mCachePath;   // 从文件加载并且使用磁盘缓存时, 构建后写入的缓存路径
+    uint64_t mContentHash{};            // 源文件内容的哈希
+    mutable std::atomic<bool> mBuilt{true};
+    mutable std::once_flag mBuildOnce;
+    mutable Future<void> mBuildFuture; // 延迟构建的任务, 等待时执行线程池中的其它任务, 包括构建自己的子树
+};
@@ -1,6 +1,6 @@
 #include "plane.hpp"
 
-std::optional<HitInfo> Plane::intersect(const Ray &ray, float t_min, float t_max) const
+bool Plane::intersectRecord(const Ray &ray, float t_min, float &t_max, HitRecord &record) const
 {
     // (o + td - p) dot n = 0
     // (o - p) dot n = -t(d dot n)
@@ -9,7 +9,20 @@ std::optional<HitInfo> Plane::intersect(const Ray &ray, float t_min, float t_max
     float hit_t = glm::dot(mPoint - ray.mOrigin, mNormal) / glm::dot(ray.mDirection, mNormal);
     if (hit_t > t_min && hit_t < t_max)
     {
-        return HitInfo{hit_t, ray.hit(hit_t), mNormal};
+        t_max = hit_t;
+        record = {hit_t};
+        return true;
     }
-    return {};
+    return false;
+}
+
+HitInfo Plane::resolveHit(const Ray &ray, const HitRecord &record) const
+{
+    return HitInfo{record.t, ray.hit(record.t), mNormal};
+}
+
+bool Plane::occluded(const Ray &ray, float t_min, float t_max) const
+{
+    float hit_t = glm::dot(mPoint - ray.mOrigin, mNormal) / glm::dot(ray.mDirection, mNormal);
+    return hit_t > t_min && hit_t < t_max;
 }
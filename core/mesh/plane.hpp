@@ -4,7 +4,9 @@
 struct Plane : public Shape 
 {
     Plane(const glm::vec3 &point,const glm::vec3 &normal) : mPoint(point), mNormal(glm::normalize(normal)) {};
-    std::optional<HitInfo> intersect(const Ray &ray, float t_min, float t_max) const override;
+    bool intersectRecord(const Ray &ray, float t_min, float &t_max, HitRecord &record) const override;
+    HitInfo resolveHit(const Ray &ray, const HitRecord &record) const override;
+    bool occluded(const Ray &ray, float t_min, float t_max) const override;
 
     // 平面定义
     // 点法式方程: (x - x0) * n.x + (y - y0) * n.y + (z - z0) * n.z = 0
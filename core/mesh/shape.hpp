@@ -1,16 +1,74 @@
 #pragma once
 #include "../ray.hpp"
+#include "../rayPacket.hpp"
 #include <optional>
 #include "../accelerate/bounds.hpp"
 
 struct Shape
 {
+    // 遍历用的求交: 找到比t_max更近的交点时更新t_max和record并返回true, 否则两者都不变
+    // 只记录最近交点的距离和图元, 不计算交点位置和法线, 被更近的交点取代的候选交点不会浪费这部分计算
+    virtual bool intersectRecord(const Ray &ray, float t_min, float &t_max, HitRecord &record) const = 0;
+
+    // 由最近交点的记录计算交点位置和法线(场景中还有材质), ray与求交时的光线相同
+    virtual HitInfo resolveHit(const Ray &ray, const HitRecord &record) const = 0;
+
     // t_min, t_max: 光线的交点和光线起点的距离
     // 交点在t_min和t_max之间才是有效的
     virtual std::optional<HitInfo> intersect(
         const Ray &ray,
         float t_min,
-        float t_max) const = 0;
+        float t_max) const
+    {
+        HitRecord record;
+        if (!intersectRecord(ray, t_min, t_max, record))
+        {
+            return {};
+        }
+        return resolveHit(ray, record);
+    }
+
+    // 只判断(t_min, t_max)内是否有交点, 用于阴影射线等不需要交点信息的查询, 找到任意一个交点就可以返回
+    // 默认退回到intersectRecord, 形状可以重写它跳过最近交点的查找
+    virtual bool occluded(const Ray &ray, float t_min, float t_max) const
+    {
+        HitRecord record;
+        return intersectRecord(ray, t_min, t_max, record);
+    }
+
+    // 光线包求交: 第i条光线找到比packet.t_max[i]更近的交点时, 更新t_max[i]和records[i], 返回值的第i位为1, 否则records[i]保持不变
+    // 默认逐条光线调用intersectRecord, BVH重写它让整包光线一起遍历
+    virtual uint32_t intersectPacket(RayPacket &packet, HitRecord *records) const { return intersectPacketNode(0, packet, records); }
 
     virtual Bounds getBounds() const { return {}; } // 无限大的物体默认返回一个退化的Bounds(有默认值)，获取到的Bounds定义在对象空间中
-};
\ No newline at end of file
+
+    // 实例重编(rebraiding): 场景BVH可以打开实例, 把形状内部层次的上层节点直接插入顶层树中, 之后从这些节点开始遍历
+    // 节点的编号由形状自己定义, 0总是根节点; 没有内部层次的形状只有根节点, 不能打开
+    virtual bool getNodeChildren(uint32_t node, uint32_t children[2]) const { return false; } // 返回false表示节点不能再打开
+    virtual Bounds getNodeBounds(uint32_t node) const { return getBounds(); }                 // 节点在对象空间中的包围盒
+    // 节点编号的版本, 形状重新构建内部层次(节点重新编号)后改变; 场景BVH据此发现打开的记录引用的节点已经失效
+    virtual uint32_t getNodeGeneration() const { return 0; }
+
+    // 与intersectRecord、occluded和intersectPacket相同, 只遍历以node为根的子树
+    virtual bool intersectNode(uint32_t node, const Ray &ray, float t_min, float &t_max, HitRecord &record) const { return intersectRecord(ray, t_min, t_max, record); }
+    virtual bool occludedNode(uint32_t node, const Ray &ray, float t_min, float t_max) const { return occluded(ray, t_min, t_max); }
+    virtual uint32_t intersectPacketNode(uint32_t node, RayPacket &packet, HitRecord *records) const
+    {
+        uint32_t hit_mask = 0;
+        for (size_t i = 0; i < RAY_PACKET_SIZE; i++)
+        {
+            if (packet.t_max[i] < packet.t_min) // 不参与求交的光线
+            {
+                continue;
+            }
+            Ray ray = packet.getRay(i);
+            if (node == 0 ? intersectRecord(ray, packet.t_min, packet.t_max[i], records[i]) : intersectNode(node, ray, packet.t_min, packet.t_max[i], records[i]))
+            {
+                hit_mask |= 1u << i;
+            }
+            DEBUG_LINE(packet.bounds_test_count += ray.bounds_test_count)
+            DEBUG_LINE(packet.triangles_test_count += ray.triangles_test_count)
+        }
+        return hit_mask;
+    }
+};
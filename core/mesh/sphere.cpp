@@ -1,6 +1,6 @@
 #include "sphere.hpp"
 
-std::optional<HitInfo> Sphere::intersect(const Ray &ray, float t_min, float t_max) const
+bool Sphere::intersectRecord(const Ray &ray, float t_min, float &t_max, HitRecord &record) const
 {
     glm::vec3 oc = ray.mOrigin - mCenter;//光线起点到圆心
     // at^2 + bt + c = 0, 代入射线方程(ray = o + td)到圆方程(x^2 + y^2 = r^2)
@@ -12,7 +12,7 @@ std::optional<HitInfo> Sphere::intersect(const Ray &ray, float t_min, float t_ma
     // Δ = b² - 4ac小于0, 没有交点
     if (discriminant < 0.f)
     {
-        return {};
+        return false;
     }
 
     // Δ = b² - 4ac大于0，有交点
@@ -26,9 +26,36 @@ std::optional<HitInfo> Sphere::intersect(const Ray &ray, float t_min, float t_ma
     // 检测交点是否在有效范围
     if (hit_t > t_min && hit_t < t_max)
     {
-        glm::vec3 hitPoint = ray.hit(hit_t); // 交点坐标
-        glm::vec3 normal = glm::normalize(hitPoint - mCenter); // 交点法向量
-        return HitInfo{hit_t, hitPoint, normal};
+        t_max = hit_t;
+        record = {hit_t};
+        return true;
     }
-    return {};
+    return false;
+}
+
+HitInfo Sphere::resolveHit(const Ray &ray, const HitRecord &record) const
+{
+    glm::vec3 hitPoint = ray.hit(record.t); // 交点坐标
+    glm::vec3 normal = glm::normalize(hitPoint - mCenter); // 交点法向量
+    return HitInfo{record.t, hitPoint, normal};
+}
+
+bool Sphere::occluded(const Ray &ray, float t_min, float t_max) const
+{
+    glm::vec3 oc = ray.mOrigin - mCenter;
+    float a = glm::dot(ray.mDirection, ray.mDirection);
+    float b = 2.f * glm::dot(ray.mDirection, oc);
+    float c = glm::dot(oc, oc) - mRadius * mRadius;
+    float discriminant = b * b - 4.f * a * c;
+    if (discriminant < 0.f)
+    {
+        return false;
+    }
+    // 与intersectRecord选取同一个根, 只是不计算交点和法线
+    float hit_t = (-b - glm::sqrt(discriminant)) * 0.5f / a;
+    if (hit_t < 0.f)
+    {
+        hit_t = (-b + glm::sqrt(discriminant)) * 0.5f / a;
+    }
+    return hit_t > t_min && hit_t < t_max;
 }
@@ -7,6 +7,8 @@ struct Sphere : public Shape
     glm::vec3 mCenter;
     float mRadius;
 
-    std::optional<HitInfo> intersect(const Ray &ray, float t_min, float t_max) const override; // 相交检测
+    bool intersectRecord(const Ray &ray, float t_min, float &t_max, HitRecord &record) const override; // 相交检测, 只记录距离
+    HitInfo resolveHit(const Ray &ray, const HitRecord &record) const override;                        // 计算交点和法线
+    bool occluded(const Ray &ray, float t_min, float t_max) const override;                   // 只检测是否相交
     Bounds getBounds() const override { return {mCenter - mRadius, mCenter + mRadius}; }
 };
\ No newline at end of file
@@ -1,6 +1,6 @@
 #include "triangle.hpp"
 
-std::optional<HitInfo> Triangle::intersect(const Ray &ray, float t_min, float t_max) const
+bool Triangle::intersectRecord(const Ray &ray, float t_min, float &t_max, HitRecord &record) const
 {
     // o + td = (1 - u - v)p0 + u * p0 + v * p1
     // o - p0 = -td + u(p1 - p0) + v(p2 - p0)
@@ -17,19 +17,47 @@ std::optional<HitInfo> Triangle::intersect(const Ray &ray, float t_min, float t_
     glm::vec3 s = ray.mOrigin - p0;
     float u = glm::dot(s1, s) * invDet;
     if (u < 0.f || u > 1.f)
-        return {};
+        return false;
 
     glm::vec3 s2 = glm::cross(s, e0);
     float v = glm::dot(s2, ray.mDirection) * invDet;
     if (v < 0.f || u + v > 1.f)
-        return {};
+        return false;
 
     float hit_t = glm::dot(s2, e1) * invDet;
     if (hit_t > t_min && hit_t < t_max)
     {
-        glm::vec3 hitPoint = ray.hit(hit_t);
-        glm::vec3 normal = (1.f - u - v) * n0 + u * n1 + v * n2; // 插值计算法线
-        return HitInfo{hit_t, hitPoint, glm::normalize(normal)};
+        t_max = hit_t;
+        record = {hit_t, u, v};
+        return true;
     }
-    return {};
+    return false;
+}
+
+HitInfo Triangle::resolveHit(const Ray &ray, const HitRecord &record) const
+{
+    glm::vec3 normal = (1.f - record.u - record.v) * n0 + record.u * n1 + record.v * n2; // 插值计算法线
+    return HitInfo{record.t, ray.hit(record.t), glm::normalize(normal)};
+}
+
+// 与intersectRecord相同的Möller–Trumbore求交, 命中时不计算交点和插值法线
+bool Triangle::occluded(const Ray &ray, float t_min, float t_max) const
+{
+    glm::vec3 e0 = p1 - p0;
+    glm::vec3 e1 = p2 - p0;
+    glm::vec3 s1 = glm::cross(ray.mDirection, e1);
+    float invDet = 1.f / glm::dot(s1, e0);
+
+    glm::vec3 s = ray.mOrigin - p0;
+    float u = glm::dot(s1, s) * invDet;
+    if (u < 0.f || u > 1.f)
+        return false;
+
+    glm::vec3 s2 = glm::cross(s, e0);
+    float v = glm::dot(s2, ray.mDirection) * invDet;
+    if (v < 0.f || u + v > 1.f)
+        return false;
+
+    float hit_t = glm::dot(s2, e1) * invDet;
+    return hit_t > t_min && hit_t < t_max;
 }
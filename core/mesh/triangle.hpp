@@ -19,7 +19,9 @@ struct Triangle : public Shape
         n2 = normal;
     }
 
-    std::optional<HitInfo> intersect(const Ray &ray, float t_min, float t_max) const override;
+    bool intersectRecord(const Ray &ray, float t_min, float &t_max, HitRecord &record) const override;
+    HitInfo resolveHit(const Ray &ray, const HitRecord &record) const override;
+    bool occluded(const Ray &ray, float t_min, float t_max) const override;
     Bounds getBounds() const override
     {
         Bounds bounds{};
@@ -0,0 +1,15 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+// 共享顶点的三角形网格: 每个顶点的位置和法线只存一份, 三角形只记录三个顶点的32位索引
+// 相比每个三角形各自保存三个位置和三个法线, 一个顶点通常被六个三角形共享, 内存占用小得多
+struct TriangleMesh
+{
+    std::vector<glm::vec3> positions; // 顶点位置
+    std::vector<glm::vec3> normals;   // 顶点法线, 与positions一一对应, 没有法线的顶点为0, 命中时改用几何法线
+    std::vector<glm::uvec3> indices;  // 每个三角形三个顶点的索引
+
+    size_t triangleCount() const { return indices.size(); }
+    const glm::vec3 &position(size_t triangle, size_t vertex) const { return positions[indices[triangle][vertex]]; }
+};
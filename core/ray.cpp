@@ -1,9 +1,10 @@
 #include "ray.hpp"
 
-Ray Ray::objectFromWorld(const glm::mat4 &_objectFromWorld) const
+Ray Ray::objectFromWorld(const glm::mat4x3 &_objectFromWorld) const
 {
-    // 将射线从世界空间转换到物体空间
-    glm::vec3 o = _objectFromWorld * glm::vec4(mOrigin, 1);
-    glm::vec3 d = _objectFromWorld * glm::vec4(mDirection, 0);
+    // 将射线从世界空间转换到物体空间, 最后一行总是(0, 0, 0, 1), 起点加上平移, 方向不受平移影响
+    const auto &m = _objectFromWorld;
+    glm::vec3 o = (m[0] * mOrigin.x + m[1] * mOrigin.y) + (m[2] * mOrigin.z + m[3]);
+    glm::vec3 d = (m[0] * mDirection.x + m[1] * mDirection.y) + m[2] * mDirection.z;
     return Ray{o, d};
 }
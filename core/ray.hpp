@@ -13,7 +13,7 @@ struct Ray
         return mOrigin + t * mDirection;
     }
 
-    Ray objectFromWorld(const glm::mat4 &_objectFromWorld) const;
+    Ray objectFromWorld(const glm::mat4x3 &_objectFromWorld) const; // 实例的变换都是仿射变换, 只需要3x4矩阵
 
     // mutable 关键字表示该const变量可以被修改
     DEBUG_LINE(mutable size_t bounds_test_count = 0)    // 包围盒相交测试次数
@@ -26,4 +26,13 @@ struct HitInfo
     glm::vec3 mHitPoint;
     glm::vec3 mNormal;
     const Material *mMaterial{nullptr};
+};
+
+// 遍历过程中的轻量交点记录: 只保存距离、重心坐标和图元/实例编号, 最近交点确定后才由Shape::resolveHit计算交点位置、法线和材质
+struct HitRecord
+{
+    float t;
+    float u, v;             // 三角形的重心坐标, 其他形状不使用
+    uint32_t primitive{};   // 三角形在网格中的索引
+    uint32_t instance{};    // 实例在场景中的编号, 由SceneBVH填写
 };
\ No newline at end of file
@@ -0,0 +1,83 @@
+#include "rayPacket.hpp"
+#pragma warning(push)
+#pragma warning(disable : 4267)
+#pragma warning(disable : 4244)
+
+void RayPacket::setRay(size_t i, const Ray &ray)
+{
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        origin[axis][i] = ray.mOrigin[axis];
+        direction[axis][i] = ray.mDirection[axis];
+    }
+}
+
+Ray RayPacket::getRay(size_t i) const
+{
+    return Ray{{origin[0][i], origin[1][i], origin[2][i]}, {direction[0][i], direction[1][i], direction[2][i]}};
+}
+
+void RayPacket::update()
+{
+    origin_min = glm::vec3(std::numeric_limits<float>::infinity());
+    origin_max = glm::vec3(-std::numeric_limits<float>::infinity());
+    inv_direction_min = origin_min;
+    inv_direction_max = origin_max;
+    dir_is_neg = glm::bvec3(false);
+    coherent = true;
+    bool first = true;
+    for (size_t i = 0; i < RAY_PACKET_SIZE; i++)
+    {
+        for (size_t axis = 0; axis < 3; axis++)
+        {
+            // 与单条光线的遍历一样直接取倒数, 保证包围盒测试的结果逐位相同
+            inv_direction[axis][i] = 1.0f / direction[axis][i];
+        }
+        if (t_max[i] < t_min) // 不参与求交的光线不影响区间和方向符号
+        {
+            continue;
+        }
+        for (size_t axis = 0; axis < 3; axis++)
+        {
+            if (first)
+            {
+                dir_is_neg[axis] = direction[axis][i] < 0;
+            }
+            origin_min[axis] = glm::min(origin_min[axis], origin[axis][i]);
+            origin_max[axis] = glm::max(origin_max[axis], origin[axis][i]);
+            inv_direction_min[axis] = glm::min(inv_direction_min[axis], inv_direction[axis][i]);
+            inv_direction_max[axis] = glm::max(inv_direction_max[axis], inv_direction[axis][i]);
+            // 方向为0时倒数为无穷大, 区间算术会出现0乘无穷, 也当作不一致处理
+            coherent &= direction[axis][i] != 0.f && (direction[axis][i] < 0) == dir_is_neg[axis];
+        }
+        first = false;
+    }
+}
+
+float RayPacket::maxT() const
+{
+    float max_t = -std::numeric_limits<float>::infinity();
+    for (size_t i = 0; i < RAY_PACKET_SIZE; i++)
+    {
+        max_t = glm::max(max_t, t_max[i]);
+    }
+    return max_t;
+}
+
+RayPacket RayPacket::objectFromWorld(const glm::mat4x3 &_objectFromWorld, uint32_t mask) const
+{
+    RayPacket packet;
+    for (size_t i = 0; i < RAY_PACKET_SIZE; i++)
+    {
+        if ((mask & (1u << i)) == 0)
+        {
+            packet.setRay(i, Ray{{0, 0, 0}, {0, 0, 0}});
+            packet.t_max[i] = -std::numeric_limits<float>::infinity();
+            continue;
+        }
+        packet.setRay(i, getRay(i).objectFromWorld(_objectFromWorld));
+        packet.t_max[i] = t_max[i];
+    }
+    packet.t_min = t_min;
+    return packet;
+}
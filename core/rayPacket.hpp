@@ -0,0 +1,44 @@
+#pragma once
+#include "ray.hpp"
+
+// 相邻像素的主光线打包成一个RAY_PACKET_WIDTH x RAY_PACKET_WIDTH的光线包, 一起遍历BVH
+constexpr size_t RAY_PACKET_WIDTH = 4;
+constexpr size_t RAY_PACKET_SIZE = RAY_PACKET_WIDTH * RAY_PACKET_WIDTH;
+
+// 光线按SoA存储, 包围盒测试一次SIMD测试多条光线; 同一个包内的光线共享节点的读取
+struct alignas(32) RayPacket
+{
+    float origin[3][RAY_PACKET_SIZE];        // 第一维是轴, 第二维是包内的光线
+    float direction[3][RAY_PACKET_SIZE];
+    float inv_direction[3][RAY_PACKET_SIZE];
+    float t_max[RAY_PACKET_SIZE];            // 每条光线的有效范围上限, 找到更近的交点后更新, 小于t_min的光线不参与求交
+    float t_min{1e-5f};
+
+    // 以下由update()计算: 所有光线起点和方向倒数在每个轴上的区间, 用区间算术一次剔除整包光线
+    glm::vec3 origin_min, origin_max;
+    glm::vec3 inv_direction_min, inv_direction_max;
+    glm::bvec3 dir_is_neg; // coherent为true时所有光线在每个轴上的方向符号相同
+    bool coherent;         // 方向符号不一致时区间会跨过0, 包遍历没有意义, 退回逐条光线求交
+
+    DEBUG_LINE(mutable size_t bounds_test_count = 0)    // 整个包的包围盒相交测试次数
+    DEBUG_LINE(mutable size_t triangles_test_count = 0) // 所有光线的三角形相交测试次数之和
+
+    void setRay(size_t i, const Ray &ray);
+    Ray getRay(size_t i) const;
+    glm::vec3 getInvDirection(size_t i) const { return {inv_direction[0][i], inv_direction[1][i], inv_direction[2][i]}; }
+    void update(); // 设置完所有光线后调用, 计算方向的倒数、区间和方向符号
+    float maxT() const; // 所有光线t_max的最大值, 用于区间算术测试
+
+    // mask中不小于first的第一个为1的位, 没有时返回RAY_PACKET_SIZE
+    static size_t firstActive(uint32_t mask, size_t first)
+    {
+        while (first < RAY_PACKET_SIZE && (mask & (1u << first)) == 0)
+        {
+            first++;
+        }
+        return first;
+    }
+
+    // 与Ray::objectFromWorld相同, 只变换mask中的光线, 其余光线的t_max设为负无穷; 返回的光线包还没有调用update()
+    RayPacket objectFromWorld(const glm::mat4x3 &_objectFromWorld, uint32_t mask) const;
+};
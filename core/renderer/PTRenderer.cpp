@@ -2,18 +2,22 @@
 #include "../until/frame.hpp"
 #include "../until/rng.hpp"
 
-glm::vec3 PTRenderer::renderPixel(const glm::ivec3 &pixelCoord)
+static const RNG &threadRNG(const glm::ivec3 &pixelCoord)
 {
     // 让每个线程都有一个随机数生成器，确保线程之间不会因为共享一个随机数生成器而资源竞争，导致性能下降
     thread_local RNG rng{static_cast<size_t>(pixelCoord.x * 1000000 + pixelCoord.y + pixelCoord.z * 10000000)};
-    auto ray = mCamera.generateRay(pixelCoord, {rng.uniform(), rng.uniform()});
+    return rng;
+}
+
+// 从主光线的交点hitInfo开始追踪一条路径, 之后每次弹射都重新与场景求交
+static glm::vec3 tracePath(const Scene &scene, Ray ray, std::optional<HitInfo> hitInfo, const RNG &rng)
+{
     // 遍历路径上的每一个点
     glm::vec3 beta = {1, 1, 1}; // i=1, beta=1; i>1, beta=∏(brdf*cosθ/pdf)
     glm::vec3 L = {0, 0, 0};    // radiance
     float q = 0.9f;
-    while (true)
+    for (; true; hitInfo = scene.intersect(ray)) // continue时也会重新求交
     {
-        auto hitInfo = mScene.intersect(ray);
         if (hitInfo.has_value())
         {
             // 如果是光源，直接累计，要在俄罗斯轮盘赌之前，防止光源上产生黑点
@@ -64,4 +68,29 @@ glm::vec3 PTRenderer::renderPixel(const glm::ivec3 &pixelCoord)
         }
     }
     return L;
-}
\ No newline at end of file
+}
+
+glm::vec3 PTRenderer::renderPixel(const glm::ivec3 &pixelCoord)
+{
+    const auto &rng = threadRNG(pixelCoord);
+    auto ray = mCamera.generateRay(pixelCoord, {rng.uniform(), rng.uniform()});
+    return tracePath(mScene, ray, mScene.intersect(ray), rng);
+}
+
+// 第一次弹射的主光线按像素块打包求交, 之后的弹射方向不再相关, 每条路径各自求交
+void PTRenderer::renderTile(const glm::ivec3 &tileCoord, glm::vec3 *colors)
+{
+    const auto &rng = threadRNG(tileCoord);
+    glm::vec2 offsets[RAY_PACKET_SIZE];
+    for (auto &offset : offsets)
+    {
+        offset = {rng.uniform(), rng.uniform()};
+    }
+    auto packet = mCamera.generateRayPacket(tileCoord, offsets);
+    std::optional<HitInfo> hitInfos[RAY_PACKET_SIZE];
+    mScene.intersectPacket(packet, hitInfos);
+    for (size_t i = 0; i < RAY_PACKET_SIZE; i++)
+    {
+        colors[i] = tracePath(mScene, packet.getRay(i), hitInfos[i], rng);
+    }
+}
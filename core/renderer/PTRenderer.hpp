@@ -1,4 +1,4 @@
 #pragma once
 #include "renderer.hpp"
 
-DEFINE_RENDERER(PT)
\ No newline at end of file
+DEFINE_PACKET_RENDERER(PT)
\ No newline at end of file
@@ -0,0 +1,199 @@
+#include "WavefrontPTRenderer.hpp"
+#include "../until/frame.hpp"
+#include "../until/rng.hpp"
+#include <typeindex>
+#pragma warning(push)
+#pragma warning(disable : 4267)
+#pragma warning(disable : 4244)
+
+// 一个像素块所有路径的状态, 按字段分开存储(SoA), 下标为路径编号: 采样序号 * 像素块像素数 + 像素在块内的序号
+// 每个线程复用同一份, 避免每个像素块重新分配内存
+struct WavefrontPaths
+{
+    std::vector<glm::vec3> origins, directions; // 下一次求交的光线
+    std::vector<glm::vec3> betas;               // 路径的吞吐量
+    std::vector<glm::vec3> radiances;           // 路径累计的radiance, 最后作为一个采样加到胶片上
+    std::vector<uint8_t> hits;                  // 最近一次求交是否有交点
+    std::vector<glm::vec3> hitPoints, normals;  // 最近一次求交的交点信息, 在世界空间中
+    std::vector<const Material *> materials;
+
+    std::vector<uint32_t> active;   // 存活的路径编号
+    std::vector<uint32_t> shading;  // 经过轮盘赌后需要采样BSDF的路径, 与bins一一对应
+    std::vector<uint32_t> bins;     // 材质类型的分组编号
+    std::vector<uint32_t> sorted;   // shading按分组排序后的结果
+    std::vector<size_t> binOffsets; // 每个分组在sorted中的起始位置
+    std::vector<std::type_index> binTypes; // 分组编号对应的材质类型, 通常只有几种
+
+    void resize(size_t count)
+    {
+        origins.resize(count);
+        directions.resize(count);
+        betas.assign(count, glm::vec3{1, 1, 1});
+        radiances.assign(count, glm::vec3{0, 0, 0});
+        hits.resize(count);
+        hitPoints.resize(count);
+        normals.resize(count);
+        materials.resize(count);
+        active.clear();
+    }
+
+    void setHit(uint32_t path, const std::optional<HitInfo> &hitInfo)
+    {
+        hits[path] = hitInfo.has_value();
+        if (hitInfo)
+        {
+            hitPoints[path] = hitInfo->mHitPoint;
+            normals[path] = hitInfo->mNormal;
+            materials[path] = hitInfo->mMaterial;
+        }
+    }
+
+    uint32_t binOf(const Material &material)
+    {
+        std::type_index type = typeid(material);
+        for (size_t i = 0; i < binTypes.size(); i++)
+        {
+            if (binTypes[i] == type)
+            {
+                return static_cast<uint32_t>(i);
+            }
+        }
+        binTypes.push_back(type);
+        return static_cast<uint32_t>(binTypes.size() - 1);
+    }
+};
+
+static_assert(RAY_PACKET_WIDTH <= 16 && 16 % RAY_PACKET_WIDTH == 0, "wavefront tiles are made of whole ray packets");
+
+size_t WavefrontPTRenderer::renderTileSamples(size_t tile_x, size_t tile_y, size_t sampleBegin, size_t sampleCount)
+{
+    thread_local RNG rng{};
+    thread_local WavefrontPaths paths;
+    // 与PTRenderer的种子相同, 按像素块和起始采样重新设置, 不同批次的采样互不相关, 结果也不依赖像素块分给了哪个线程
+    rng.setSeed(tile_x * 1000000 + tile_y + sampleBegin * 10000000);
+
+    auto &film = mCamera.getFilm();
+    const size_t tile_size = tileSize();
+    const size_t tile_pixels = tile_size * tile_size;
+    size_t x0 = tile_x * tile_size, y0 = tile_y * tile_size;
+    size_t width = std::min(tile_size, film.getWidth() - x0);
+    size_t height = std::min(tile_size, film.getHeight() - y0);
+    paths.resize(tile_pixels * sampleCount);
+
+    // 主光线: 每个采样按光线包生成并求交, 超出胶片的像素不产生路径
+    for (size_t sample = 0; sample < sampleCount; sample++)
+    {
+        for (size_t py = 0; py < height; py += RAY_PACKET_WIDTH)
+        {
+            for (size_t px = 0; px < width; px += RAY_PACKET_WIDTH)
+            {
+                glm::vec2 offsets[RAY_PACKET_SIZE];
+                for (auto &offset : offsets)
+                {
+                    offset = {rng.uniform(), rng.uniform()};
+                }
+                auto packet = mCamera.generateRayPacket(glm::ivec2(x0 + px, y0 + py), offsets);
+                std::optional<HitInfo> hitInfos[RAY_PACKET_SIZE];
+                mScene.intersectPacket(packet, hitInfos);
+                for (size_t i = 0; i < RAY_PACKET_SIZE; i++)
+                {
+                    size_t x = px + i % RAY_PACKET_WIDTH, y = py + i / RAY_PACKET_WIDTH;
+                    if (x >= width || y >= height)
+                    {
+                        continue;
+                    }
+                    uint32_t path = static_cast<uint32_t>(sample * tile_pixels + y * tile_size + x);
+                    auto ray = packet.getRay(i);
+                    paths.origins[path] = ray.mOrigin;
+                    paths.directions[path] = ray.mDirection;
+                    paths.setHit(path, hitInfos[i]);
+                    paths.active.push_back(path);
+                }
+            }
+        }
+    }
+
+    const float q = 0.9f;
+    while (!paths.active.empty())
+    {
+        // 1. 累计自发光, 没有交点或者被轮盘赌终止的路径不再进入后面的阶段
+        paths.shading.clear();
+        paths.bins.clear();
+        for (uint32_t path : paths.active)
+        {
+            if (!paths.hits[path] || paths.materials[path] == nullptr)
+            {
+                continue;
+            }
+            // 如果是光源，直接累计，要在俄罗斯轮盘赌之前，防止光源上产生黑点
+            paths.radiances[path] += paths.betas[path] * paths.materials[path]->mEmission;
+            if (rng.uniform() > q)
+            {
+                continue;
+            }
+            paths.betas[path] /= q;
+            paths.shading.push_back(path);
+            paths.bins.push_back(paths.binOf(*paths.materials[path]));
+        }
+
+        // 2. 按材质类型计数排序, 同一种材质的路径连续着色
+        paths.binOffsets.assign(paths.binTypes.size() + 1, 0);
+        for (uint32_t bin : paths.bins)
+        {
+            paths.binOffsets[bin + 1]++;
+        }
+        for (size_t i = 1; i < paths.binOffsets.size(); i++)
+        {
+            paths.binOffsets[i] += paths.binOffsets[i - 1];
+        }
+        paths.sorted.resize(paths.shading.size());
+        for (size_t i = 0; i < paths.shading.size(); i++)
+        {
+            paths.sorted[paths.binOffsets[paths.bins[i]]++] = paths.shading[i];
+        }
+
+        // 3. 采样BSDF生成下一段光线, 存活的路径压缩到active的前面
+        paths.active.clear();
+        for (uint32_t path : paths.sorted)
+        {
+            Frame frame(paths.normals[path]); // 构建局部坐标系
+            glm::vec3 viewDirection = frame.localFromWorld(-paths.directions[path]);
+            if (viewDirection.y == 0)
+            {
+                // 光线刚好掠过物体表面, 只移动光线起点再求交一次
+                paths.origins[path] = paths.hitPoints[path];
+                paths.active.push_back(path);
+                continue;
+            }
+            auto bsdf_sample = paths.materials[path]->sampleBSDF(paths.hitPoints[path], viewDirection, rng);
+            if (!bsdf_sample.has_value())
+            {
+                continue;
+            }
+            // 表面法线就是局部坐标系的y轴
+            paths.betas[path] *= bsdf_sample->bsdf * glm::abs(bsdf_sample->lightDirection.y) / bsdf_sample->pdf;
+            paths.origins[path] = paths.hitPoints[path];
+            paths.directions[path] = frame.worldFromLocal(bsdf_sample->lightDirection);
+            paths.active.push_back(path);
+        }
+
+        // 4. 批量求交, 这一阶段只有BVH遍历
+        // 弹射后的光线方向几乎不再一致, 打包求交得不偿失, 逐条光线求交
+        for (uint32_t path : paths.active)
+        {
+            paths.setHit(path, mScene.intersect(Ray{paths.origins[path], paths.directions[path]}));
+        }
+    }
+
+    for (size_t sample = 0; sample < sampleCount; sample++)
+    {
+        for (size_t y = 0; y < height; y++)
+        {
+            for (size_t x = 0; x < width; x++)
+            {
+                film.addSample(x0 + x, y0 + y, paths.radiances[sample * tile_pixels + y * tile_size + x]);
+            }
+        }
+    }
+    return width * height;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include "PTRenderer.hpp"
+
+/*
+    按波前(广度优先)组织的路径追踪: 一个像素块的所有采样的路径一起推进, 每一轮依次
+    1. 对所有存活的路径累计自发光并做俄罗斯轮盘赌
+    2. 按材质类型分组, 同一种材质的路径连续调用sampleBSDF
+    3. 把终止的路径从队列中压缩掉, 对剩下的路径批量求交
+    每一步都是同一段代码处理一整批路径, 主光线还可以按光线包求交. 每条路径的计算与PTRenderer相同, 期望的图像一致.
+*/
+class WavefrontPTRenderer : public PTRenderer
+{
+public:
+    WavefrontPTRenderer(Camera &camera, const Scene &scene) : PTRenderer(camera, scene) {}
+
+private:
+    size_t renderTileSamples(size_t tile_x, size_t tile_y, size_t sampleBegin, size_t sampleCount) override;
+    size_t tileSize() const override { return 16; } // 一个像素块的路径数量为16x16乘以采样数
+};
@@ -2,14 +2,30 @@
 #include "normalRenderer.hpp"
 #include "../colorSpace/rgb.hpp"
 
-glm::vec3 NormalRenderer::renderPixel(const glm::ivec3 &pixelCoord)
+static glm::vec3 normalColor(const std::optional<HitInfo> &hitInfo)
 {
-    auto ray = mCamera.generateRay(pixelCoord);
-    auto hitInfo = mScene.intersect(ray);
     if (hitInfo.has_value())
     {
         glm::ivec3 color = (hitInfo->mNormal * 0.5f + 0.5f) * 255.f;
         return RGB(color.r, color.g, color.b);
     }
     return {};
-}
\ No newline at end of file
+}
+
+glm::vec3 NormalRenderer::renderPixel(const glm::ivec3 &pixelCoord)
+{
+    auto ray = mCamera.generateRay(pixelCoord);
+    return normalColor(mScene.intersect(ray));
+}
+
+// 预览时整块像素的主光线一起求交
+void NormalRenderer::renderTile(const glm::ivec3 &tileCoord, glm::vec3 *colors)
+{
+    auto packet = mCamera.generateRayPacket(tileCoord);
+    std::optional<HitInfo> hitInfos[RAY_PACKET_SIZE];
+    mScene.intersectPacket(packet, hitInfos);
+    for (size_t i = 0; i < RAY_PACKET_SIZE; i++)
+    {
+        colors[i] = normalColor(hitInfos[i]);
+    }
+}
@@ -1,4 +1,4 @@
 #pragma once
 #include "renderer.hpp"
 
-DEFINE_RENDERER(Normal)
\ No newline at end of file
+DEFINE_PACKET_RENDERER(Normal)
\ No newline at end of file
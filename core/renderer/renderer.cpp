@@ -34,20 +34,13 @@ void Renderer::render(size_t spp, const std::filesystem::path &fileName)
     // 循环进行渲染，直到当前采样数达到指定的采样数
     while (currentSpp < spp)
     {
-        // 使用线程池并行处理胶片上的每个像素
-        threadPool.parallelFor(film.getWidth(), film.getHeight(), [&](size_t x, size_t y)
+        // 使用线程池并行处理胶片上的每个像素块, 相邻像素的主光线可以打包求交
+        threadPool.parallelFor(tileCount(film.getWidth()), tileCount(film.getHeight()), [&](size_t x, size_t y)
                                {
-            // 对当前像素进行多次采样，采样次数为 increase
-            for (int i = 0; i < increase; i++)
-            {
-                // 渲染指定坐标和采样数的像素，并将结果添加到胶片上
-                film.addSample(x, y, renderPixel({x, y, currentSpp + i}));
-            }
-            // 更新进度条，增加的进度为本次采样的次数
-            progressBar.update(increase); });
-
-        // 等待线程池中的所有任务完成
-        threadPool.wait();
+            // 对当前像素块进行多次采样，采样次数为 increase
+            size_t pixelCount = renderTileSamples(x, y, currentSpp, increase);
+            // 更新进度条，增加的进度为本次采样的次数乘以像素块中的像素数量
+            progressBar.update(increase * pixelCount); }, true, mTileOrder);
 
         // 更新当前采样数，加上本次迭代增加的采样数
         currentSpp += increase;
@@ -61,4 +54,39 @@ void Renderer::render(size_t spp, const std::filesystem::path &fileName)
         // 输出当前已经完成的采样数信息
         std::cout << currentSpp << " spp has been saved!" << std::endl;
     }
-}
\ No newline at end of file
+}
+
+void Renderer::renderTile(const glm::ivec3 &tileCoord, glm::vec3 *colors)
+{
+    const auto &film = mCamera.getFilm();
+    for (size_t i = 0; i < RAY_PACKET_SIZE; i++)
+    {
+        size_t x = tileCoord.x + i % RAY_PACKET_WIDTH;
+        size_t y = tileCoord.y + i / RAY_PACKET_WIDTH;
+        if (x < film.getWidth() && y < film.getHeight())
+        {
+            colors[i] = renderPixel({x, y, tileCoord.z});
+        }
+    }
+}
+
+size_t Renderer::renderTileSamples(size_t tile_x, size_t tile_y, size_t sampleBegin, size_t sampleCount)
+{
+    auto &film = mCamera.getFilm();
+    size_t x0 = tile_x * RAY_PACKET_WIDTH, y0 = tile_y * RAY_PACKET_WIDTH;
+    size_t width = std::min(RAY_PACKET_WIDTH, film.getWidth() - x0);
+    size_t height = std::min(RAY_PACKET_WIDTH, film.getHeight() - y0);
+    for (size_t sample = sampleBegin; sample < sampleBegin + sampleCount; sample++)
+    {
+        glm::vec3 colors[RAY_PACKET_SIZE]{};
+        renderTile({x0, y0, sample}, colors);
+        for (size_t y = 0; y < height; y++)
+        {
+            for (size_t x = 0; x < width; x++)
+            {
+                film.addSample(x0 + x, y0 + y, colors[x + y * RAY_PACKET_WIDTH]);
+            }
+        }
+    }
+    return width * height;
+}
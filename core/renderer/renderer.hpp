@@ -2,6 +2,7 @@
 
 #include "../camera/camera.hpp"
 #include "../scene.hpp"
+#include "../../application/threadPool.hpp"
 
 #define DEFINE_RENDERER(Name)                                                           \
     class Name##Renderer : public Renderer                                              \
@@ -13,6 +14,18 @@
         glm::vec3 renderPixel(const glm::ivec3 &pixelCoord) override;                   \
     };
 
+// 主光线按像素块打包求交的渲染器, 额外重写renderTile
+#define DEFINE_PACKET_RENDERER(Name)                                                     \
+    class Name##Renderer : public Renderer                                              \
+    {                                                                                   \
+    public:                                                                             \
+        Name##Renderer(Camera &camera, const Scene &scene) : Renderer(camera, scene){}; \
+                                                                                        \
+    private:                                                                            \
+        glm::vec3 renderPixel(const glm::ivec3 &pixelCoord) override;                   \
+        void renderTile(const glm::ivec3 &tileCoord, glm::vec3 *colors) override;       \
+    };
+
 class Renderer
 {
     friend class Previewer;
@@ -20,11 +33,21 @@ class Renderer
 public:
     Renderer(Camera &camera, const Scene &scene) : mCamera(camera), mScene(scene) {};
     void render(size_t spp, const std::filesystem::path &fileName);
+    void setTileOrder(TileOrder order) { mTileOrder = order; } // 像素块的访问顺序, 同时执行和连续渲染的像素块在图像上相邻
 
 private:
     virtual glm::vec3 renderPixel(const glm::ivec3 &pixelCoord) = 0;
+    // 渲染以(x, y)为左上角的RAY_PACKET_WIDTH x RAY_PACKET_WIDTH个像素的第z个采样, 颜色按行写入colors
+    // 默认逐个像素调用renderPixel, 超出胶片的像素不计算
+    virtual void renderTile(const glm::ivec3 &tileCoord, glm::vec3 *colors);
+    // 渲染第(tile_x, tile_y)个像素块从sampleBegin开始的sampleCount个采样并加到胶片上, 返回像素块中有效像素的数量
+    // 默认对每个采样调用renderTile, 像素块的边长为tileSize()
+    virtual size_t renderTileSamples(size_t tile_x, size_t tile_y, size_t sampleBegin, size_t sampleCount);
+    virtual size_t tileSize() const { return RAY_PACKET_WIDTH; }
+    size_t tileCount(size_t pixels) const { return (pixels + tileSize() - 1) / tileSize(); }
 
 protected:
     Camera &mCamera;
     const Scene &mScene;
+    TileOrder mTileOrder{TileOrder::Hilbert};
 };
\ No newline at end of file
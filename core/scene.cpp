@@ -2,16 +2,75 @@
 #include "until/debugMacro.hpp"
 #include <glm/ext/matrix_transform.hpp>
 
-void Scene::addShape(const Shape &shape, const Material *material, const glm::vec3 &position, const glm::vec3 &scale, const glm::vec3 &rotation)
+static glm::mat4 worldFromObjectMatrix(const glm::vec3 &position, const glm::vec3 &scale, const glm::vec3 &rotation)
 {
-    glm::mat4 worldFromObject =
-        glm::translate(glm::mat4(1.f), position) *
-        glm::rotate(glm::mat4(1.f), glm::radians(rotation.z), glm::vec3(0, 0, 1)) *
-        glm::rotate(glm::mat4(1.f), glm::radians(rotation.y), glm::vec3(0, 1, 0)) *
-        glm::rotate(glm::mat4(1.f), glm::radians(rotation.x), glm::vec3(1, 0, 0)) *
-        glm::scale(glm::mat4(1.f), scale);
+    return glm::translate(glm::mat4(1.f), position) *
+           glm::rotate(glm::mat4(1.f), glm::radians(rotation.z), glm::vec3(0, 0, 1)) *
+           glm::rotate(glm::mat4(1.f), glm::radians(rotation.y), glm::vec3(0, 1, 0)) *
+           glm::rotate(glm::mat4(1.f), glm::radians(rotation.x), glm::vec3(1, 0, 0)) *
+           glm::scale(glm::mat4(1.f), scale);
+}
+
+size_t Scene::addShape(const Shape &shape, const Material *material, const glm::vec3 &position, const glm::vec3 &scale, const glm::vec3 &rotation)
+{
+    glm::mat4 worldFromObject = worldFromObjectMatrix(position, scale, rotation);
+    if (mBuilt)
+    {
+        return mSceneBVH.addInstance(ShapeInstance{shape, material, worldFromObject});
+    }
+    mInstances.push_back(ShapeInstance{shape, material, worldFromObject});
+    return mInstances.size() - 1;
+}
+
+void Scene::removeShape(size_t id)
+{
+    if (mBuilt)
+    {
+        mSceneBVH.removeInstance(id);
+    }
+    else
+    {
+        mRemovedBeforeBuild.push_back(id);
+    }
+}
+
+void Scene::build(const SceneBVHBuildOptions &options)
+{
+    mSceneBVH.build(std::move(mInstances), options);
+    mBuilt = true;
+    if (!mRemovedBeforeBuild.empty())
+    {
+        for (size_t id : mRemovedBeforeBuild)
+        {
+            mSceneBVH.removeInstance(id);
+        }
+        std::vector<size_t>().swap(mRemovedBeforeBuild);
+        mSceneBVH.update();
+    }
+}
 
-    mInstances.push_back(ShapeInstance{shape, material, worldFromObject, glm::inverse(worldFromObject)});
+bool Scene::update(bool rebuild)
+{
+    if (rebuild)
+    {
+        mSceneBVH.rebuild();
+        return true;
+    }
+    return mSceneBVH.update();
+}
+
+// 构建前直接修改实例, 构建后交给场景BVH, 新的包围盒在update时生效
+void Scene::setTransform(size_t id, const glm::vec3 &position, const glm::vec3 &scale, const glm::vec3 &rotation)
+{
+    glm::mat4 worldFromObject = worldFromObjectMatrix(position, scale, rotation);
+    if (mBuilt)
+    {
+        mSceneBVH.setTransform(id, worldFromObject);
+    }
+    else
+    {
+        mInstances[id].mWorldFromObject = worldFromObject;
+    }
 }
 
 // 场景求交, 返回最近的交点信息, 如果没有交点, 返回空
@@ -19,3 +78,23 @@ std::optional<HitInfo> Scene::intersect(const Ray &ray, float t_min, float t_max
 {
     return mSceneBVH.intersect(ray, t_min, t_max);
 }
+
+// 场景遮挡查询, (t_min, t_max)内有任意交点就返回true
+bool Scene::occluded(const Ray &ray, float t_min, float t_max) const
+{
+    return mSceneBVH.occluded(ray, t_min, t_max);
+}
+
+// 整包光线遍历完后, 只对命中的光线计算一次交点信息
+void Scene::intersectPacket(RayPacket &packet, std::optional<HitInfo> *hitInfos) const
+{
+    HitRecord records[RAY_PACKET_SIZE];
+    uint32_t hit_mask = mSceneBVH.intersectPacket(packet, records);
+    for (size_t i = 0; i < RAY_PACKET_SIZE; i++)
+    {
+        if ((hit_mask & (1u << i)) != 0)
+        {
+            hitInfos[i] = mSceneBVH.resolveHit(packet.getRay(i), records[i]);
+        }
+    }
+}
@@ -6,20 +6,45 @@
 struct Scene : public Shape
 {
 public:
-    void addShape(const Shape &shape,
-                  const Material *material = nullptr,
-                  const glm::vec3 &position = {0, 0, 0},
-                  const glm::vec3 &scale = {1, 1, 1},
-                  const glm::vec3 &rotation = {0, 0, 0});
+    // 返回实例的编号, 之后用它更新实例的变换或者删除实例; 构建后添加的实例在update之后才进入场景BVH的树中
+    size_t addShape(const Shape &shape,
+                    const Material *material = nullptr,
+                    const glm::vec3 &position = {0, 0, 0},
+                    const glm::vec3 &scale = {1, 1, 1},
+                    const glm::vec3 &rotation = {0, 0, 0});
 
     std::optional<HitInfo> intersect(
         const Ray &ray,
         float t_min = 1e-5,
         float t_max = std::numeric_limits<float>::infinity()) const override;
 
-    void build() { mSceneBVH.build(std::move(mInstances)); }
+    // 阴影射线等只关心是否被遮挡的查询, 比intersect快: 找到任意交点就返回
+    bool occluded(
+        const Ray &ray,
+        float t_min = 1e-5,
+        float t_max = std::numeric_limits<float>::infinity()) const override;
+
+    bool intersectRecord(const Ray &ray, float t_min, float &t_max, HitRecord &record) const override { return mSceneBVH.intersectRecord(ray, t_min, t_max, record); }
+    HitInfo resolveHit(const Ray &ray, const HitRecord &record) const override { return mSceneBVH.resolveHit(ray, record); }
+    uint32_t intersectPacket(RayPacket &packet, HitRecord *records) const override { return mSceneBVH.intersectPacket(packet, records); }
+    // 相邻像素的主光线一起求交, 每条光线的结果与intersect相同
+    void intersectPacket(RayPacket &packet, std::optional<HitInfo> *hitInfos) const;
+
+    void setTransform(size_t id,
+                      const glm::vec3 &position = {0, 0, 0},
+                      const glm::vec3 &scale = {1, 1, 1},
+                      const glm::vec3 &rotation = {0, 0, 0});
+
+    // 删除后实例的编号不会被新的实例复用
+    void removeShape(size_t id);
+
+    void build(const SceneBVHBuildOptions &options = {});
+    // 构建后添加、删除、移动实例或者模型变形后调用, 只更新场景BVH中受影响的部分; rebuild为true时重新构建整棵树
+    bool update(bool rebuild = false);
 
 private:
     std::vector<ShapeInstance> mInstances;
+    std::vector<size_t> mRemovedBeforeBuild; // 构建前删除的实例, 构建时保留它们的编号, 构建后再删除
     SceneBVH mSceneBVH{};
+    bool mBuilt{false};
 };
\ No newline at end of file
@@ -0,0 +1,27 @@
+#pragma once
+#include <cstddef>
+#include <new>
+
+// 按Alignment字节对齐分配内存的分配器, 用于需要让元素与cache line对齐的数组
+template <typename T, size_t Alignment>
+struct AlignedAllocator
+{
+    using value_type = T;
+    template <typename U>
+    struct rebind
+    {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(Alignment))); }
+    void deallocate(T *ptr, size_t) { ::operator delete(ptr, std::align_val_t(Alignment)); }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment> &) const { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment> &) const { return false; }
+};
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+// 64位非加密哈希, 每次处理8个字节, 用于判断文件内容是否变化
+inline uint64_t hashMix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+inline uint64_t hashCombine(uint64_t seed, uint64_t value)
+{
+    return hashMix(seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2)));
+}
+
+inline uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0)
+{
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    uint64_t h = seed ^ (size * 0x9e3779b97f4a7c15ull);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, 8);
+        word *= 0x87c37b91114253d5ull;
+        word = (word << 31) | (word >> 33);
+        h ^= word * 0x4cf5ad432745937full;
+        h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + i, size - i);
+    return hashMix(h ^ tail);
+}
@@ -0,0 +1,103 @@
+#include "mappedFile.hpp"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+bool MappedFile::open(const std::filesystem::path &path)
+{
+    close();
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    mFile = file;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        close();
+        return false;
+    }
+    mMapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mMapping == nullptr)
+    {
+        close();
+        return false;
+    }
+    mData = static_cast<const std::byte *>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+    if (mData == nullptr)
+    {
+        close();
+        return false;
+    }
+    mSize = static_cast<size_t>(size.QuadPart);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (mData != nullptr)
+    {
+        UnmapViewOfFile(mData);
+    }
+    if (mMapping != nullptr)
+    {
+        CloseHandle(mMapping);
+    }
+    if (mFile != nullptr)
+    {
+        CloseHandle(mFile);
+    }
+    mData = nullptr;
+    mSize = 0;
+    mMapping = nullptr;
+    mFile = nullptr;
+}
+#else
+bool MappedFile::open(const std::filesystem::path &path)
+{
+    close();
+    mFile = ::open(path.c_str(), O_RDONLY);
+    if (mFile < 0)
+    {
+        return false;
+    }
+    struct stat info;
+    if (fstat(mFile, &info) != 0 || info.st_size == 0)
+    {
+        close();
+        return false;
+    }
+    void *data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, mFile, 0);
+    if (data == MAP_FAILED)
+    {
+        close();
+        return false;
+    }
+    mData = static_cast<const std::byte *>(data);
+    mSize = static_cast<size_t>(info.st_size);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (mData != nullptr)
+    {
+        munmap(const_cast<std::byte *>(mData), mSize);
+    }
+    if (mFile >= 0)
+    {
+        ::close(mFile);
+    }
+    mData = nullptr;
+    mSize = 0;
+    mFile = -1;
+}
+#endif
@@ -0,0 +1,31 @@
+#pragma once
+#include <filesystem>
+#include <cstddef>
+
+// 只读的内存映射文件, 按需由操作系统把文件页换入, 不用先把整个文件读进内存
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    explicit MappedFile(const std::filesystem::path &path) { open(path); }
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const std::filesystem::path &path); // 打开失败或者文件为空时返回false
+    void close();
+
+    const std::byte *data() const { return mData; }
+    size_t size() const { return mSize; }
+    bool isOpen() const { return mData != nullptr; }
+
+private:
+    const std::byte *mData{nullptr};
+    size_t mSize{};
+#ifdef _WIN32
+    void *mFile{nullptr};    // 文件句柄
+    void *mMapping{nullptr}; // 映射对象句柄
+#else
+    int mFile{-1};
+#endif
+};
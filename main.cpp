@@ -2,6 +2,7 @@
 
 #include "application/film.hpp"
 #include "application/previewer.hpp"
+#include "application/threadPool.hpp"
 
 #include "core/ray.hpp"
 #include "core/scene.hpp"
@@ -15,6 +16,7 @@
 #include "core/colorSpace/rgb.hpp"
 
 #include "core/renderer/PTRenderer.hpp"
+#include "core/renderer/WavefrontPTRenderer.hpp"
 
 #include "core/material/diffuseMaterial.hpp"
 #include "core/material/specularMaterial.hpp"
@@ -29,7 +31,9 @@ int main()
     // Film film(2560, 1440);
     Camera camera{film, {-10, 1.5, 0}, {0, 0, 0}, 45};
 
-    Model model("../../models/dragon_871k.obj");
+    // 模型在线程池中解析和构建BVH, 主线程同时添加其它物体, 用到模型时再等待
+    auto dragon = threadPool.submit([]
+                                    { return std::make_unique<Model>("../../models/dragon_871k.obj"); });
     Sphere sphere{{0, 0, 0}, 1.f};
     Plane plane{{0, 0, 0}, {0, 1, 0}};
 
@@ -70,6 +74,7 @@ int main()
         glm::vec3 c = RGB::GenerateHeatMap((i + 3.f) / 6.f);
         scene.addShape(sphere, new ConductorMaterial{glm::vec3(2.f - c * 2.f), glm::vec3(2.f + c * 3.f), (3.f - i) / 6.f, (3.f - i) / 18.f}, {0, 2.5f, i * 2.f}, {0.8f, 0.8f, 0.8f});
     }
+    Model &model = *dragon.get();
     scene.addShape(model, new DielectricMaterial{1.8f, RGB{128, 211, 131}, 0.1f, 0.1f}, {-5, 0.4, 1.5}, {2, 2, 2});
     scene.addShape(model, new ConductorMaterial{{0.1, 1.2, 1.8}, {5, 2.5, 2}, 0.1f, 0.1f}, {-5, 0.4, -1.5}, {2, 2, 2});
     scene.addShape(plane, new GroundMaterial{RGB(120, 204, 157)}, {0.f, -0.5f, 0.f});
@@ -98,6 +103,9 @@ int main()
     // TrianglesTestCountRenderer ttcRenderer{camera, scene};
     // ttcRenderer.render(1, "../../ppm/ttc.ppm");
 
+    // WavefrontPTRenderer wavefrontRenderer{camera, scene}; // 波前路径追踪, 期望的图像与PTRenderer一致, 可以对比渲染时间
+    // wavefrontRenderer.render(128, "../../wavefront.ppm");
+
     PTRenderer ptRenderer{camera, scene};
     Previewer previewer{ptRenderer};
     if (previewer.preview())